@@ -6,3 +6,9 @@ for id in $IPCS_S; do
   ipcrm -s $id;
 done
 
+
+IPCS_M=`ipcs -m | egrep "0x[0-9a-f]+ [0-9]+" | cut -f2 -d" "`
+
+for id in $IPCS_M; do
+  ipcrm -m $id;
+done
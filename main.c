@@ -134,6 +134,129 @@ int msem_rm_file(char *path, char *with_tag)
 
 
 
+/**
+ * msem_lock_tags
+ * ``````````````
+ * Lock every tag in @tags at @path, all at once.
+ *
+ * @path   : Path to the semaphore file.
+ * @tags   : Tags (one character each).
+ * @mode   : "-" or "-," (see msem_acquire).
+ * @timeout: Milliseconds before giving up.
+ * Return  : 1 if every tag was locked, else 0.
+ */
+int msem_lock_tags(char *path, char *tags, char *mode, int timeout)
+{
+        int sems[CHAR_MAX];
+        int n = 0;
+        int r = 0;
+        int i;
+
+        for (i=0; tags[i] != '\0' && n < CHAR_MAX; i++) {
+                if ((sems[n] = msem_open(path, &tags[i], 0)) == -1) {
+                        goto done;
+                }
+                n++;
+        }
+
+        r = msem_acquire(sems, n, mode, timeout);
+
+done:
+        while (n-- > 0) {
+                msem_close(sems[n]);
+        }
+        return r;
+}
+
+
+
+/**
+ * msem_select_tags
+ * ````````````````
+ * Lock whichever tags in @tags at @path can be locked first, and
+ * print them.
+ *
+ * @path   : Path to the semaphore file.
+ * @tags   : Tags (one character each).
+ * @timeout: Milliseconds before giving up.
+ * Return  : 1 if any tag was locked, else 0.
+ */
+int msem_select_tags(char *path, char *tags, int timeout)
+{
+        int sems[CHAR_MAX];
+        int fired[CHAR_MAX];
+        int n = 0;
+        int r = 0;
+        int i;
+
+        for (i=0; tags[i] != '\0' && n < CHAR_MAX; i++) {
+                if ((sems[n] = msem_open(path, &tags[i], 0)) == -1) {
+                        goto done;
+                }
+                n++;
+        }
+
+        if (msem_select(sems, n, "-", timeout, fired) > 0) {
+                for (i=0; i<n; i++) {
+                        if (fired[i]) {
+                                putchar(tags[i]);
+                        }
+                }
+                putchar('\n');
+                r = 1;
+        }
+
+done:
+        while (n-- > 0) {
+                msem_close(sems[n]);
+        }
+        return r;
+}
+
+
+
+/* Most waves whose counts are printed. */
+#define WAVES_MAX 1024
+
+/**
+ * msem_relax_staggered
+ * ````````````````````
+ * Release the waiters of @path:@tag in waves, and print how many
+ * were released in each.
+ *
+ * @path : Path to the semaphore file.
+ * @tag  : Tag (character) indicating the region of the file at @path.
+ * @size : Most waiters released in one wave.
+ * @pace : Milliseconds between waves.
+ * Return: 1 on success, else 0.
+ */
+int msem_relax_staggered(char *path, char *tag, int size, int pace)
+{
+        int released[WAVES_MAX];
+        int waves;
+        int s;
+        int i;
+
+        if ((s = msem_open(path, tag, 0)) == -1) {
+                return 0;
+        }
+
+        waves = msem_relax_waves(s, size, pace, released, WAVES_MAX);
+
+        for (i=0; i<waves && i<WAVES_MAX; i++) {
+                printf("%d\n", released[i]);
+        }
+
+        msem_close(s);
+
+        return (waves == -1) ? 0 : 1;
+}
+
+
+
+/* Longest a followed status waits for a change before redrawing. */
+#define FOLLOW_MS 250
+
 /**
  * msem_status
  * ```````````
@@ -143,6 +266,11 @@ int msem_rm_file(char *path, char *with_tag)
  * @tag  : Tag (character) indicating the region of the file at @path.
  * @loop : Should the output be followed (like tail -f).
  * Return: 1 on success, -1 on error.
+ *
+ * NOTE
+ * When following, the highlighted semaphore is watched (see
+ * msem_watch) between redraws, so a change to it shows at once,
+ * and the others and the keyboard are looked at every FOLLOW_MS.
  */
 int msem_status(char *path, char *user_tag, bool loop)
 {
@@ -154,6 +282,8 @@ int msem_status(char *path, char *user_tag, bool loop)
         int count;
         int key;
         int line=0;
+        int follow;
+        struct msem_state state;
         enum cmd { NONE, RELAX, INC, DEC } command = NONE;
 
         if (user_tag == NULL) {
@@ -174,6 +304,8 @@ int msem_status(char *path, char *user_tag, bool loop)
         refresh();
 
         do {
+                follow = -1;
+
                 for (i=0, count=0; i<len; i++) {
                         if (msem_exists(path, &tag[i])) {
                                 if ((sem = msem_open(path, &tag[i], 0)) > 0) {
@@ -196,8 +328,12 @@ int msem_status(char *path, char *user_tag, bool loop)
 
                                         if (count == line) {
                                                 attroff(A_REVERSE);
+                                                state.value = -1;
+                                                msem_watch(sem, &state, 0);
+                                                follow = msem_open(path, &tag[i], 0);
                                         }
 
+                                        msem_close(sem);
                                         count++;
                                         refresh();
                                 }
@@ -205,6 +341,13 @@ int msem_status(char *path, char *user_tag, bool loop)
                 }
                 refresh();
 
+                if (loop && follow > 0) {
+                        msem_watch(follow, &state, FOLLOW_MS);
+                        msem_close(follow);
+                } else if (loop) {
+                        sleep_ms(FOLLOW_MS);
+                }
+
                 if ((key = getch()) != ERR) {
                         switch (key) {
                         case 'j':
@@ -248,6 +391,12 @@ int main(int argc, char *argv[])
         char *ini = NULL;
         char *timeout = NULL;
         char *semid = NULL;
+        char *seq = NULL;
+        char *pri = NULL;
+        char *window = NULL;
+        char *size = NULL;
+        char *pace = NULL;
+        long long next;
         int s=-1;
         int r;
 
@@ -256,21 +405,56 @@ int main(int argc, char *argv[])
         if (bnf("msem -c <path> <tag> <ini>", &path, &tag, &ini)) {
                 return msem_create(path, tag, atoi(ini));
         }
+        if (bnf("msem -ce <path> <tag> <ini>", &path, &tag, &ini)) {
+                return msem_create_flags(path, tag, atoi(ini), MSEM_EDGE);
+        }
+        if (bnf("msem -co <path> <tag> <ini>", &path, &tag, &ini)) {
+                return msem_create_flags(path, tag, atoi(ini), MSEM_ORDERED);
+        }
+        if (bnf("msem -cr <path> <tag> <ini>", &path, &tag, &ini)) {
+                return msem_create_flags(path, tag, atoi(ini), MSEM_ROBUST);
+        }
         if (bnf("msem -d <path> <tag>", &path, &tag)) {
                 s = msem_open(path, tag, 0);
                 r = msem_remove(s);
                 goto done;
         }
         if (bnf("msem -p <path> <tag> <timeout>", &path, &tag, &timeout)) {
+                if (strlen(tag) > 1) {
+                        return msem_lock_tags(path, tag, "-", atoi(timeout));
+                }
                 s = msem_open(path, tag, 0);
                 r = msem(s, "-", atoi(timeout));
                 goto done;
         }
         if (bnf("msem -p, <path> <tag> <timeout>", &path, &tag, &timeout)) {
+                if (strlen(tag) > 1) {
+                        return msem_lock_tags(path, tag, "-,", atoi(timeout));
+                }
                 s = msem_open(path, tag, 0);
                 r = msem(s, "-,", atoi(timeout));
                 goto done;
         }
+        if (bnf("msem -pq <path> <tag> <pri> <timeout>", &path, &tag, &pri, &timeout)) {
+                s = msem_open(path, tag, 0);
+                r = msem_lock_priority(s, "-", atoi(pri), atoi(timeout));
+                goto done;
+        }
+        if (bnf("msem -p+ <path> <tag> <timeout>", &path, &tag, &timeout)) {
+                s = msem_open(path, tag, 0);
+                r = msem(s, "-*", atoi(timeout));
+                goto done;
+        }
+        if (bnf("msem -s <path> <tags> <timeout>", &path, &tag, &timeout)) {
+                return msem_select_tags(path, tag, atoi(timeout));
+        }
+        if (bnf("msem -n <path> <tag> <seq> <timeout>", &path, &tag, &seq, &timeout)) {
+                s = msem_open(path, tag, 0);
+                if ((next = msem_next(s, atoll(seq), atoi(timeout))) != -1) {
+                        printf("%lld\n", next);
+                }
+                goto done;
+        }
         if (bnf("msem -v <path> <tag>", &path, &tag)) {
                 s = msem_open(path, tag, 0);
                 r = msem(s, "+", 0);
@@ -286,6 +470,14 @@ int main(int argc, char *argv[])
                 r = msem(s, "+*", 0);
                 goto done;
         }
+        if (bnf("msem -vs <path> <tag> <size> <pace>", &path, &tag, &size, &pace)) {
+                return msem_relax_staggered(path, tag, atoi(size), atoi(pace));
+        }
+        if (bnf("msem -w <path> <tag> <window>", &path, &tag, &window)) {
+                s = msem_open(path, tag, 0);
+                r = msem_coalesce(s, atoi(window));
+                goto done;
+        }
 
         /* Follow semaphore status. */
         if (bnf("msem -f <path> [<tag>]", &path, &tag)) {
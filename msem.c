@@ -6,224 +6,92 @@
 #include <stdio.h>
 #include <string.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <limits.h>
 #include <sys/ipc.h>
-#include <sys/sem.h>
 #include <errno.h>
+#include <pthread.h>
+#include <sys/sem.h>
 #include <j/time.h>
 #include <j/file.h>
-#include <j/shell.h>
 #include <j/debug.h>
 #include "msem.h"
-
-extern int errno;
-
-/* 
- * After Steven's 3-member semaphore set implementation.
- *
- * Create a set of 3 semaphores:
- */
-
-        /* [0]: The actual semaphore value. */
-        #define SEMAPHORE 0
-        /* [1]: The process counter.        */
-        #define PROCESSES 1
-        /* [2]: A lock variable for internal use. */
-        #define NO_RACING 2
-
-/*
- * [1] is initialized to a large number, then decremented on every 
- * create/open, and incremented on every close. Makes it possible to
- * use the "adjust" feature to account for processes which exit before
- * calling sem_close().
- *
- * [2] is used to avoid the race conditions caused by sem_make()
- * and sem_close(), as discussed in those functions.
- */
-
-
-/* The maximum process count. */
-#define BIGCOUNT 10000
-
-/* Number of semaphores in the semaphore set. */
-#define NSEMS 3
-
-
+#include "msem_engine.h"
 
 /******************************************************************************
- * OPERATIONS
- *
- * System V's semop() will perform operations on arrays of 
- * type struct sembuf, combining the sequence of operations 
- * into atomic ones.
- *
- * In many of these operations, the flag SEM_UNDO is set, which
- * causes the relevant operation to be undone in the event of
- * the process abnormally terminating.
- *
- *      struct sembuf {
- *              short sem_num   Semaphore number
- *              short sem_op    Semaphore operation
- *              short sem_flg   Operation flags
- *      }
- *
+ * UTILITY FUNCTIONS 
  ******************************************************************************/
 
-/* 
- * LOCK
- * 0. Wait for NO_RACING to be 0 (unlocked).
- * 1. Increment NO_RACING to 1 (lock).
- */
-#define nops_lock 2
-static struct sembuf op_lock[nops_lock] = {
-        {NO_RACING,   0,   0},
-        {NO_RACING,   1,   SEM_UNDO}
-};
-
-
-/* 
- * ENDCREATE
- * 0. Decrement the PROCESSES counter.
- * 1. Unlock NO_RACING (decrement to 0). 
- */
-#define nops_endcreate 2
-static struct sembuf op_endcreate[nops_endcreate] = {
-        {PROCESSES,   -1,  SEM_UNDO},
-        {NO_RACING,   -1,  SEM_UNDO}
-};
-
-
-/*
- * OPEN
- * 0. Decrement PROCESSES.
- */
-#define nops_open 1
-static struct sembuf op_open[nops_open] = {
-        {PROCESSES, -1, SEM_UNDO}
-};
-
-
-/* 
- * CLOSE
- * 0. Wait for NO_RACING to be 0 (unlocked).
- * 1. Increment NO_RACING to 1 (lock).
- * 2. Increment the PROCESSES counter.
- */
-#define nops_close 3
-static struct sembuf op_close[nops_close] = {
-        {NO_RACING, 0, 0},
-        {NO_RACING, 1, SEM_UNDO},
-        {PROCESSES, 1, SEM_UNDO}
-};
-
-
-/*
- * UNLOCK
- * Decrement NO_RACING to 0 (unlock).
- */
-#define nops_unlock 1
-static struct sembuf op_unlock[nops_unlock] = {
-        {NO_RACING, -1, SEM_UNDO}
-};
-
-
-/*
- * SAFE SEMAPHORE OPERATION (WITH UNDO)
- * 0. Decrement or increment SEMAPHORE by 99.
- * NOTE
- * The 99 is set to the actual amount to
- * add or subtract (positive or negative).
+/**
+ * msem_timeout
+ * ````````````
+ * Convert a timeout in milliseconds to a relative timespec.
+ *
+ * @ms     : Milliseconds before timeout.
+ * @timeout: Relative timeout (filled in).
+ * Return  : @timeout, or NULL if @ms <= 0 (no timeout).
  */
-#define nops_sem 1
-static struct sembuf op_sem[nops_sem] = {
-        {SEMAPHORE, 99, SEM_UNDO}
-};
+struct timespec *msem_timeout(int ms, struct timespec *timeout)
+{
+        if (ms <= 0) {
+                return NULL;
+        }
 
+        timeout->tv_sec  = ms / SEC_IN_MS;
+        timeout->tv_nsec = MS_TO_NS((long)(ms % SEC_IN_MS));
 
-/*
- * UNSAFE SEMAPHORE OPERATION (NO UNDO)
- * 0. Decrement or increment SEMAPHORE by 99.
- * NOTE
- * The 99 is set to the actual amount to
- * add or subtract (positive or negative).
- */
-#define nops_raw 1
-static struct sembuf op_raw[nops_raw] = {
-        {SEMAPHORE, 99, 0}
-};
+        return timeout;
+}
 
 
-/******************************************************************************
- * SEMAPHORE CONTROL UNION 
+/**
+ * msem_deadline
+ * `````````````
+ * Convert a relative timeout to an absolute CLOCK_MONOTONIC deadline.
  *
- * Filled in by semctl during certain calls, and while
- * optional, should be provided each time. For more info
- * about it, see man(3) semctl.
- * 
- ******************************************************************************/
-union semun {
-        int             val;     /* Semaphore value */
-        struct semid_ds *buf;    /* Semaphore status struct */
-        unsigned short  *array;  /* Used to set multiple semvals. */
-} control;
+ * @timeout : Relative timeout.
+ * @deadline: Absolute deadline (filled in).
+ * Return   : Nothing.
+ */
+void msem_deadline(const struct timespec *timeout, struct timespec *deadline)
+{
+        clock_gettime(CLOCK_MONOTONIC, deadline);
 
+        deadline->tv_sec  += timeout->tv_sec;
+        deadline->tv_nsec += timeout->tv_nsec;
 
+        if (deadline->tv_nsec >= MS_TO_NS(SEC_IN_MS)) {
+                deadline->tv_sec  += 1;
+                deadline->tv_nsec -= MS_TO_NS(SEC_IN_MS);
+        }
+}
 
-/******************************************************************************
- * UTILITY FUNCTIONS 
- ******************************************************************************/
 
 /**
- * msem_operation 
+ * msem_remaining
  * ``````````````
- * Wrap the System V semaphore function semop().
- *
- * @semid: Semaphore ID
- * @sops : Semaphore operation array
- * @nsops: Number of operations in @sops
- * Return: -1 on error, else 0.
+ * Time left before an absolute CLOCK_MONOTONIC deadline.
  *
- * NOTE
- * This is intended to provide debugging assistance.
+ * @deadline: Absolute deadline.
+ * @left    : Relative time remaining (filled in).
+ * Return   : false if the deadline has passed, else true.
  */
-int msem_operation(int semid, struct sembuf *sops, size_t nsops)
+bool msem_remaining(const struct timespec *deadline, struct timespec *left)
 {
-        if (semop(semid, sops, nsops) == 0) {
-                return 0;
-        }
-        
-        switch (errno) {
-        case E2BIG: 
-                ERROR("[E2BIG] The value of nsops is greater than the system-imposed maximum\n");
-                break;
-        case EACCES:
-                ERROR("[EACCES] Permission is denied to the calling process\n");
-                break;
-        case EAGAIN:
-                ERROR("[EAGAIN] Would suspend calling process but &IPC_NOWAIT is non-zero\n");
-                break;
-        case EFBIG:
-                ERROR("[EFBIG] sem_num is less than 0 or >= #semaphores in this set\n");
-                break;
-        case EIDRM:
-                ERROR("[EIDRM] Semaphore ID %d has been removed from system\n", semid);
-                break;
-        case EINTR:
-                ERROR("[EINTR] Operation was interrupted by a signal\n");
-                break;
-        case EINVAL:
-                ERROR("[EINVAL] Not a valid semaphore ID, or SEM_UNDO exceeds system limit\n");
-                break;
-        case ENOSPC:
-                ERROR("[ENOSPC] Limit on processes requiring SEM_UNDO would be exceeded\n");
-                break;
-        case ERANGE:
-                ERROR("[ERANGE] Operation would cause a semval or semadj to overflow\n");
-                break;
+        struct timespec now;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        left->tv_sec  = deadline->tv_sec  - now.tv_sec;
+        left->tv_nsec = deadline->tv_nsec - now.tv_nsec;
+
+        if (left->tv_nsec < 0) {
+                left->tv_sec  -= 1;
+                left->tv_nsec += MS_TO_NS(SEC_IN_MS);
         }
 
-        return -1;
+        return (left->tv_sec > 0 || (left->tv_sec == 0 && left->tv_nsec > 0));
 }
 
 
@@ -278,760 +146,1578 @@ int msem_key(char *path, int tag, bool create)
 
 
 /******************************************************************************
- * ACCESSOR FUNCTIONS 
- * 
- * Retreive information about an operating semaphore.
- * None of these functions require the caller to
- * lock the semaphore being investigated.
+ * HANDLES 
+ *
+ * A handle binds an engine to the private state of one open
+ * semaphore. Handles are numbered from 1, and the numbers are
+ * what the public interface hands out, as with file descriptors.
+ *
+ * Allocating or releasing a handle takes a lock; looking one up
+ * does not. As with file descriptors, closing a handle while
+ * another thread is still using it is the caller's error.
  *
  ******************************************************************************/
 
+/* The maximum number of handles open at once in one process. */
+#define MSEM_HANDLE_MAX 65536
+
+/* Longest a lock waits on a robust semaphore between looks for dead holders. */
+#define MSEM_REAP_MS 1000
+
+/*
+ * Engine state replaced when a handle was resolved again
+ * (see msem_handle_renew). It is closed with the handle.
+ */
+struct msem_stale {
+        struct msem_stale *next;
+        void *sem;
+};
+
+/*
+ * An open handle.
+ *
+ * @engine: Engine which opened the semaphore.
+ * @sem   : Engine private state.
+ * @refs  : # of opens this handle answers for (see HANDLE CACHE).
+ * @next  : Next handle in the same cache bucket.
+ * @cached: In the cache.
+ * @stale : State replaced by msem_handle_renew.
+ * @init  : Initial value given when the handle was opened.
+ * @flags : MSEM_ flags given when the handle was opened.
+ * @reap  : When dead holders may next be looked for, in CLOCK_MONOTONIC
+ *          nanoseconds (see msem_handle_reap).
+ * @semid : Handle number.
+ * @dev   : Device of the file at @path when opened (0 if none).
+ * @ino   : Inode of the file at @path when opened (0 if none).
+ * @tag   : Tag of the semaphore.
+ * @path  : Path of the semaphore.
+ */
+struct msem_handle {
+        const struct msem_engine *engine;
+        void *sem;
+        int refs;
+        struct msem_handle *next;
+        bool cached;
+        struct msem_stale *stale;
+        int init;
+        int flags;
+        int64_t reap;
+        int semid;
+        dev_t dev;
+        ino_t ino;
+        char tag;
+        char path[];
+};
+
+static struct msem_handle *msem_handles[MSEM_HANDLE_MAX];
+static pthread_mutex_t msem_handles_lock = PTHREAD_MUTEX_INITIALIZER;
 
 
-        
 /**
- * msem_value
- * ``````````
- * Current value of the semaphore
+ * msem_handle_new
+ * ```````````````
+ * Store an open semaphore in a free handle.
+ *
+ * @engine: Engine which opened @sem.
+ * @sem   : Engine private state.
+ * @path  : Path of the semaphore.
+ * @tag   : Tag of the semaphore.
+ * @init  : Initial value given to the engine.
+ * @flags : MSEM_ flags given to the engine.
+ * Return : Handle, or NULL if none are free.
  *
- * @semid: Semaphore ID.
- * Return: Value, -1 on error
+ * NOTE
+ * Call with msem_handles_lock held. The new handle number is
+ * stored in @semid.
  */
-unsigned short msem_value(int semid)
+static struct msem_handle *msem_handle_new(const struct msem_engine *engine, void *sem, char *path, char tag, int init, int flags, int *semid)
 {
-        register int semval;
+        struct msem_handle *h;
+        int i;
 
-        control.val = 0;
-        if ((semval = semctl(semid, SEMAPHORE, GETVAL, control)) < 0) {
-                WARN("GETVAL failed.\n");
-                return -1;
+        if ((h = calloc(1, sizeof(struct msem_handle) + strlen(path) + 1)) == NULL) {
+                return NULL;
         }
 
-        return semval;
+        h->engine = engine;
+        h->sem    = sem;
+        h->refs   = 1;
+        h->init   = init;
+        h->flags  = flags;
+        h->tag    = tag;
+        strcpy(h->path, path);
+
+        for (i=1; i<MSEM_HANDLE_MAX; i++) {
+                if (msem_handles[i] == NULL) {
+                        h->semid = i;
+                        __atomic_store_n(&msem_handles[i], h, __ATOMIC_RELEASE);
+                        break;
+                }
+        }
+
+        if (i == MSEM_HANDLE_MAX) {
+                ERROR("Out of semaphore handles.\n");
+                free(h);
+                errno = EMFILE;
+                return NULL;
+        }
+
+        *semid = i;
+
+        return h;
 }
 
 
 /**
- * msem_pid
- * ````````
- * PID of the last process to modify the semaphore.
+ * msem_handle
+ * ```````````
+ * Look up an open handle.
  *
- * @semid: Semaphore ID
- * Return: PID value, -1 on error
+ * @semid: Handle number.
+ * Return: Handle, or NULL (errno EBADF) if it is not open.
  */
-pid_t msem_pid(int semid)
+static struct msem_handle *msem_handle(int semid)
 {
-        register pid_t sempid;
+        struct msem_handle *h = NULL;
 
-        control.val = 0;
-        if ((sempid = semctl(semid, SEMAPHORE, GETPID, control)) == -1) {
-                WARN("GETPID failed.\n");
-                return -1;
+        if (semid > 0 && semid < MSEM_HANDLE_MAX) {
+                h = __atomic_load_n(&msem_handles[semid], __ATOMIC_ACQUIRE);
+        }
+        if (h == NULL) {
+                WARN("[%d] Not an open semaphore handle.\n", semid);
+                errno = EBADF;
         }
 
-        return sempid;
+        return h;
 }
 
 
 /**
- * msem_ncount
- * ```````````
- * # of processes waiting for semaphore value to be greater than current value
- *
- * @semid: Semaphore ID
- * Return: Process count, -1 on error
+ * msem_handle_sem
+ * ```````````````
+ * @h    : Handle.
+ * Return: The engine state currently behind @h.
  */
-unsigned short msem_ncount(int semid)
+static void *msem_handle_sem(struct msem_handle *h)
 {
-        register unsigned short semncnt;
+        return __atomic_load_n(&h->sem, __ATOMIC_ACQUIRE);
+}
 
-        control.val = 0;
-        if ((semncnt = semctl(semid, SEMAPHORE, GETNCNT, control)) == -1) {
-                WARN("GETNCNT failed.\n");
-                return -1;
-        }
 
-        return semncnt;
+/**
+ * msem_handle_queued
+ * ``````````````````
+ * @h    : Handle.
+ * Return: TRUE if the waiters of the semaphore behind @h queue
+ *         beside it: it is ordered (MSEM_ORDERED), or edge-triggered
+ *         (MSEM_EDGE) on an engine with a queue.
+ */
+static bool msem_handle_queued(struct msem_handle *h)
+{
+        return (h->engine->queue != NULL && (h->engine->query(msem_handle_sem(h), 'f') & (MSEM_ORDERED|MSEM_EDGE)));
 }
 
 
 /**
- * msem_zcount
- * ```````````
- * # of processes waiting for semaphore value to be 0
- *
- * @semid: Semaphore ID.
- * Return: Process count, -1 on error 
+ * msem_handle_holders
+ * ```````````````````
+ * @h    : Handle.
+ * @sem  : Engine state behind @h.
+ * Return: The holders of the semaphore if it is robust (MSEM_ROBUST),
+ *         else NULL.
  */
-unsigned short msem_zcount(int semid)
+static struct msem_holders *msem_handle_holders(struct msem_handle *h, void *sem)
 {
-        register unsigned short semzcnt;
-
-        control.val = 0;
-        if ((semzcnt = semctl(semid, SEMAPHORE, GETZCNT, control)) == -1) {
-                WARN("GETZCNT failed.\n");
-                return -1;
+        if (h->engine->holders == NULL || (h->engine->query(sem, 'f') & MSEM_ROBUST) == 0) {
+                return NULL;
         }
 
-        return semzcnt;
+        return h->engine->holders(sem);
 }
 
 
 /**
- * msem_otime
- * ``````````
- * Time (sec. since UNIX epoch) of last semaphore operation
+ * msem_handle_query
+ * `````````````````
+ * Answer one of the msem_query() codes for a handle, counting the
+ * waiters in the queue of a queued semaphore in 'n', asking the
+ * holders of a robust semaphore for 'r', and the change word for
+ * 'w'.
  *
- * @semid: Semaphore ID.
- * Return: UNIX time, -1 on error 
+ * @h    : Handle.
+ * @code : Query code.
+ * Return: Answer, or -1 on error.
  */
-int msem_otime(int semid)
+static int msem_handle_query(struct msem_handle *h, char code)
 {
+        struct msem_holders *hs;
+        void *sem = msem_handle_sem(h);
+        int flags;
         int r;
 
-        if (control.buf == NULL) {
-                control.buf = calloc(1, sizeof(struct semid_ds));
+        if (code == 'r') {
+                return ((hs = msem_handle_holders(h, sem)) != NULL) ? msem_holders_reclaimed(hs) : 0;
+        }
+        if (code == 'w') {
+                return (h->engine->changes != NULL) ? __atomic_load_n(&h->engine->changes(sem, &flags)->window, __ATOMIC_SEQ_CST) : 0;
         }
 
-        if ((semctl(semid, SEMAPHORE, IPC_STAT, control)) == -1) {
-                WARN("IPC_STAT failed.\n");
-                return -1;
+        if ((r = h->engine->query(sem, code)) == -1 || code != 'n' || !msem_handle_queued(h)) {
+                return r;
         }
 
-        r = (int)control.buf->sem_otime;
+        return r + msem_queue_count(h->engine->queue(sem, &flags));
+}
+
 
-        if (control.buf != NULL) {
-                free(control.buf);
+/**
+ * msem_handle_member
+ * ``````````````````
+ * The System V set holding the semaphore behind a handle, for
+ * operations merged into one semop() (see BATCHES).
+ *
+ * @h    : Handle.
+ * @num  : Member number within the set (filled in).
+ * Return: The set, or -1 if the engine has none, or if the
+ *         semaphore is queued or robust and must go through its
+ *         queue or holders.
+ */
+static int msem_handle_member(struct msem_handle *h, unsigned short *num)
+{
+        if (h->engine->member == NULL || msem_handle_queued(h) || msem_handle_holders(h, msem_handle_sem(h)) != NULL) {
+                *num = 0;
+                return -1;
         }
 
-        return r;
+        return h->engine->member(msem_handle_sem(h), num);
 }
 
 
 /**
- * msem_ctime
- * ``````````
- * Time (sec. since UNIX epoch) of last semaphore control operation
+ * msem_handle_free
+ * ````````````````
+ * Close whatever a handle still holds and free it, once its
+ * number has been released.
  *
- * @semid: Semaphore ID.
- * Return: UNIX time, -1 on error 
+ * @h    : Handle.
+ * Return: What the engine's close returned for the current state.
  */
-int msem_ctime(int semid)
+static int msem_handle_free(struct msem_handle *h)
 {
+        struct msem_stale *s;
         int r;
 
-        if (control.buf == NULL) {
-                control.buf = calloc(1, sizeof(struct semid_ds));
-        }
+        r = h->engine->close(h->sem);
 
-        if ((semctl(semid, SEMAPHORE, IPC_STAT, control)) < 0) {
-                WARN("IPC_STAT failed.\n");
-                return -1;
+        while ((s = h->stale) != NULL) {
+                h->stale = s->next;
+                h->engine->close(s->sem);
+                free(s);
         }
 
-        r = (int)control.buf->sem_ctime;
-
-        if (control.buf != NULL) {
-                free(control.buf);
-        }
+        free(h);
 
         return r;
 }
 
 
 
-int msem_query(int semid, char *query_code)
-{
-        char code = query_code[0];
-
-        switch (code) {
-        case 'v':
-                return (int)msem_value(semid); 
-        case 'p':
-                return (int)msem_pid(semid);
-        case 'n':
-                return (int)msem_ncount(semid);
-        case 'z':
-                return (int)msem_zcount(semid);
-        case 'o':
-                return (int)msem_otime(semid);
-        case 'c':
-                return (int)msem_ctime(semid);
-        default:
-                WARN("Invalid query_code\n");
-                return -1;
-        }
-}
-
-
 /******************************************************************************
- * FILE RECORD AND STATE HANDLING
+ * HANDLE CACHE 
+ *
+ * Opening a semaphore is costly for most engines: System V, for
+ * one, needs the key (an access(2) and a stat(2) by ftok), then
+ * a semget(2) or two and a semop(2). Yet a process tends to open
+ * the same few semaphores over and over.
+ *
+ * So every handle opened by name is remembered, by engine, path
+ * and tag. Opening the same name again returns the same handle
+ * with its count of opens raised, which costs no system calls,
+ * and the semaphore is only closed with the last msem_close.
+ *
+ * A name is only as good as the file behind it, though: the keys
+ * are made from the file's device and inode, so a file removed
+ * and created again names a different semaphore. Each handle
+ * keeps the device and inode it was opened under, and a hit is
+ * only taken if one stat(2) of the path still agrees; otherwise
+ * the old handle leaves the cache (it stays open for those who
+ * hold it) and the name is opened afresh.
+ *
+ * The kernel is never asked. Instead, when an operation finds the
+ * semaphore has gone (EIDRM, or EINVAL from System V, which does
+ * not distinguish), the name is resolved again and the operation
+ * retried once; see msem_handle_renew. msem_remove takes the name
+ * out of the cache at once.
+ *
  ******************************************************************************/
 
-struct msem_data {
-        struct {
-                char tag;
-                key_t key;
-                int semid;
-        } row[CHAR_MAX];
-};
+/* Number of cache buckets (a power of 2). */
+#define MSEM_CACHE_BUCKETS 1024
 
+static struct msem_handle *msem_cache[MSEM_CACHE_BUCKETS];
 
 
-bool msem_scan(FILE *file, char *tag, key_t *key, int *semid)
+/**
+ * msem_cache_bucket
+ * `````````````````
+ * Hash an engine, path and tag to a cache bucket (FNV-1a).
+ *
+ * @engine: Engine.
+ * @path  : Path of the semaphore.
+ * @tag   : Tag of the semaphore.
+ * Return : Bucket head.
+ */
+static struct msem_handle **msem_cache_bucket(const struct msem_engine *engine, char *path, char tag)
 {
-        static long pos=-1;
+        const char *name = engine->name;
+        uint32_t h = 2166136261u;
 
-        if (feof(file)) {
-                pos = -1;
-                return false;
-        } 
-        if (pos!=-1) {
-                fseek(file, pos, SEEK_SET);
+        while (*name) {
+                h = (h ^ (unsigned char)*name++) * 16777619u;
+        }
+        while (*path) {
+                h = (h ^ (unsigned char)*path++) * 16777619u;
         }
-        fscanf(file, "%c %d %d", tag, key, semid);
-        pos = ftell(file);
-        return true;
+        h = (h ^ (unsigned char)tag) * 16777619u;
+
+        return &msem_cache[h & (MSEM_CACHE_BUCKETS-1)];
 }
 
+
 /**
- * msem_record()
- * `````````````
- * Write the semaphore ID to the file associated with it.
+ * msem_cache_drop
+ * ```````````````
+ * Forget a handle. Call with msem_handles_lock held.
+ *
+ * @h    : Handle.
+ * Return: Nothing.
  */
-int msem_record(char *path, char tag, key_t key, int id)
+static void msem_cache_drop(struct msem_handle *h)
 {
-        FILE *file;
-        if ((file = fopen(path, "a+"))) {
-                fprintf(file, "%c %d %d\n", tag, key, id);
-        } else {
-                return -1;
+        struct msem_handle **p;
+
+        if (!h->cached) {
+                return;
         }
-        fclose(file);
-        return 1;
-}
 
+        for (p = msem_cache_bucket(h->engine, h->path, h->tag); *p != NULL; p = &(*p)->next) {
+                if (*p == h) {
+                        *p = h->next;
+                        break;
+                }
+        }
 
+        h->cached = false;
+}
 
-/******************************************************************************
- * LOW-LEVEL FUNCTIONS 
- *
- * msem_create
- * msem_remove 
- * msem_open
- * msem_close
- * msem_exists
+
+/**
+ * msem_cache_file
+ * ```````````````
+ * Find the device and inode of the file at @path.
  *
- ******************************************************************************/
+ * @path : Path of the semaphore.
+ * @st   : Filled in; zeroed if there is no such file.
+ * Return: Nothing.
+ */
+static void msem_cache_file(char *path, struct stat *st)
+{
+        if (stat(path, st) == -1) {
+                st->st_dev = 0;
+                st->st_ino = 0;
+        }
+}
+
 
 /**
- * msem_create 
- * ```````````
- * Create a semaphore with a specified initial value.
+ * msem_cache_find
+ * ```````````````
+ * Find a cached handle. Call with msem_handles_lock held.
  *
- * @key  : Key value (see sem_key)
- * @init : Initial value of the semaphore.
- * Return: Semaphore ID if all OK, else -1
+ * @engine: Engine.
+ * @path  : Path of the semaphore.
+ * @tag   : Tag of the semaphore.
+ * @st    : The file at @path now (see msem_cache_file).
+ * Return : Handle number, or -1 if none is cached.
  *
  * NOTE
- * If the semaphore already exists, it isn't initialized.
+ * A handle opened under another file is dropped from the cache.
  */
-int msem_create(char *path, char *tags, int init)
+static int msem_cache_find(const struct msem_engine *engine, char *path, char tag, struct stat *st)
 {
-        key_t key;
-        register int id;
-        register char tag;
-        register int semval;
+        struct msem_handle *h;
 
-        tag = tags[0];
+        for (h = *msem_cache_bucket(engine, path, tag); h != NULL; h = h->next) {
+                if (h->engine == engine && h->tag == tag && !strcmp(h->path, path)) {
+                        if (h->dev == st->st_dev && h->ino == st->st_ino) {
+                                return h->semid;
+                        }
+                        DEBUG("%s was replaced; opening it again.\n", path);
+                        msem_cache_drop(h);
+                        return -1;
+                }
+        }
 
-        /*
-         * Build the key used to get the semaphore ID from
-         * the kernel's shared memory space. 
-         */
+        return -1;
+}
 
-        if ((key = msem_key(path, tag, true)) == -1) {
-                ERROR("Could not fetch key for file %s[%c]\n", path, tag);
-                return -1;
-        }
 
-again:
+/**
+ * msem_cache_add
+ * ``````````````
+ * Remember a handle by name. Call with msem_handles_lock held.
+ *
+ * @h    : Handle.
+ * Return: Nothing.
+ */
+static void msem_cache_add(struct msem_handle *h)
+{
+        struct msem_handle **bucket;
 
-        /*
-         * Try to create the semaphore. If it already exists,
-         * the IP_EXCL flag will ensure that semget() returns
-         * with an error.
-         */
+        bucket    = msem_cache_bucket(h->engine, h->path, h->tag);
+        h->next   = *bucket;
+        *bucket   = h;
+        h->cached = true;
+}
 
-        if ((id = semget(key, NSEMS, 0777|IPC_CREAT|IPC_EXCL)) < 0) {
-                //DEBUG("Semaphore exists, permission error, or tables full.\n");
-                return -1;
-        }
 
-        /*
-         * When the semaphore is created, we know that the value
-         * of all 3 members is 0.
-         *
-         * There is a race condition between the semget() above and 
-         * the semop() below. Another process can call sem_close() 
-         * and remove the semaphore (if that process is the last one 
-         * using it).
-         * 
-         * If the error condition occurs, we go back and create the
-         * semaphore anew. 
-         */
-        if ((msem_operation(id, &op_lock[0], nops_lock)) == -1) {
-                if (errno == EINVAL) {
-                        DEBUG("Bullet caught with bare hands\n");
-                        goto again;
+/**
+ * msem_handle_renew
+ * `````````````````
+ * Resolve a handle's name again, after the semaphore behind
+ * it has been removed.
+ *
+ * @h    : Handle.
+ * @old  : The state the failed operation used.
+ * Return: TRUE if the handle now refers to a live semaphore.
+ *
+ * NOTE
+ * The old state may still be in use by another thread, so it
+ * is kept until the handle is closed. If another thread has
+ * already renewed the handle, nothing is done.
+ */
+static bool msem_handle_renew(struct msem_handle *h, void *old)
+{
+        struct msem_stale *s;
+        char tag[2] = { h->tag, '\0' };
+        struct stat st;
+        void *sem;
+        bool r = true;
+
+        msem_cache_file(h->path, &st);
+
+        pthread_mutex_lock(&msem_handles_lock);
+
+        if (h->sem == old) {
+                if ((s = malloc(sizeof(struct msem_stale))) == NULL) {
+                        r = false;
+                } else if ((sem = h->engine->open(h->path, tag, h->init, false, h->flags)) == NULL) {
+                        free(s);
+                        r = false;
                 } else {
-                        ERROR("Can't lock the semaphore.\n");
-                        return -1;
+                        DEBUG("Renewed %s[%c]\n", h->path, h->tag);
+                        s->sem   = old;
+                        s->next  = h->stale;
+                        h->stale = s;
+                        h->dev   = st.st_dev;
+                        h->ino   = st.st_ino;
+                        __atomic_store_n(&h->sem, sem, __ATOMIC_RELEASE);
                 }
         }
 
-        /*
-         * Get the value of the process counter. If it equals 0, then
-         * no one has initialized the semaphore yet.
-         */ 
-        control.val = 0;
-        if ((semval = semctl(id, PROCESSES, GETVAL, control)) == -1) {
-                ERROR("Failed to get process count.\n");
-                return -1;
-        }
-
-        if (semval == 0) {
-                /*
-                 * Instead of initializing it with SETALL, which would
-                 * clear the adjust value set when we locked it above,
-                 * we do 2 system calls to initialize [0] and [1]. 
-                 */
-                control.val = init;
-                if (semctl(id, SEMAPHORE, SETVAL, control) == -1) {
-                        ERROR("Failed to set initial value.\n");
-                        return -1;
-                }
-
-                control.val = BIGCOUNT;
-                if (semctl(id, PROCESSES, SETVAL, control) == -1) {
-                        ERROR("Failed to initialize process count.\n");
-                        return -1;
-                }
-        }
+        pthread_mutex_unlock(&msem_handles_lock);
 
-        /*
-         * Decrement the process counter and then release the lock.
-         */
-        if (msem_operation(id, &op_endcreate[0], nops_endcreate) == -1) {
-                ERROR("Semaphore creation did not end cleanly.\n");
-                return -1;
-        }
-        
-        return id;
+        return r;
 }
 
 
-
 /**
- * msem_remove
- * ```````````
- * Remove a semaphore from shared memory.
+ * msem_hold
+ * `````````
+ * Take another reference on an open handle, as a second msem_open
+ * of the same name would, for code which goes on using a handle
+ * after its caller may have closed it (see msem_notify.c).
  *
- * @id   : Semaphore ID.
- * Return: TRUE on success, else FALSE.
+ * @semid: Handle.
+ * Return: @semid, or -1 (errno EBADF) if it is not open. Each
+ *         success must be matched by an msem_close.
  */
-int msem_remove(int semid)
+int msem_hold(int semid)
 {
-        /*
-         * Perform the remove operation.
-         */
+        struct msem_handle *h;
 
-        control.val = 0;
-        if (semctl(semid, SEMAPHORE, IPC_RMID, control) == -1) {
-                WARN("Failed to remove semaphore.\n");
-                return -1;
+        pthread_mutex_lock(&msem_handles_lock);
+
+        if ((h = msem_handle(semid)) != NULL) {
+                h->refs++;
         }
 
-        return 1;
-} 
+        pthread_mutex_unlock(&msem_handles_lock);
+
+        return (h != NULL) ? semid : -1;
+}
 
 
-        
 /**
- * msem_open
- * `````````
- * Convert a semaphore (path,uid) tuple to a semaphore id.
+ * msem_counter_of
+ * ```````````````
+ * The counter behind a handle, for code that operates on
+ * counters directly (see msem_ring.c).
  *
- * @path : Filesystem path to the semaphore.
- * @tag  : Tag (character) indicating the region of the file at @path.
- * @init : Initial value to set the semaphore if it is created.
- * Return: Semaphore id value on success, -1 on error (ENOENT usually)
+ * @semid: Handle.
+ * Return: Counter, or NULL (errno EOPNOTSUPP) if the engine
+ *         behind @semid does not keep one.
  */
-int msem_open(char *path, char *tags, int init)
+struct msem_counter *msem_counter_of(int semid)
 {
-        register int s;
-        register char tag;
-        key_t key;
+        struct msem_handle *h;
 
-        tag = (char)*tags;
+        if ((h = msem_handle(semid)) == NULL) {
+                return NULL;
+        }
+        if (h->engine->counter == NULL) {
+                WARN("[%d] The %s engine has no counter.\n", semid, h->engine->name);
+                errno = EOPNOTSUPP;
+                return NULL;
+        }
 
-        /*
-         * Try to create the semaphore. If the semaphore
-         * already exists, sem_create will return error. 
-         *
-         * If the error isn't EEXIST, its an actual problem
-         * and we have to quit. 
-         */
+        return h->engine->counter(msem_handle_sem(h));
+}
 
-        if ((s = msem_create(path, tags, init)) == -1) {
-                if (errno != EEXIST) {
-                        DEBUG("Create error\n");
-                        return -1;
-                } else {
-                        DEBUG("Semaphore already exists\n");
 
-                        /*
-                         * The semaphore already exists. Build the key used 
-                         * to get the semaphore ID from the kernel's shared 
-                         * memory space. 
-                         */
+/**
+ * msem_changes_of
+ * ```````````````
+ * The change word behind a handle, for code that waits on a
+ * semaphore for others (see msem_mux.c).
+ *
+ * @semid: Handle.
+ * @flags: Futex flags for the word (filled in).
+ * Return: Change word, or NULL (errno EOPNOTSUPP) if the engine
+ *         behind @semid does not keep one.
+ */
+struct msem_changes *msem_changes_of(int semid, int *flags)
+{
+        struct msem_handle *h;
 
-                        if ((key = msem_key(path, tag, true)) == -1) {
-                                ERROR("Could not fetch key for file %s[%c]\n", path, tag);
-                                return -1;
-                        }
+        if ((h = msem_handle(semid)) == NULL) {
+                return NULL;
+        }
+        if (h->engine->changes == NULL) {
+                WARN("[%d] The %s engine has no change word.\n", semid, h->engine->name);
+                errno = EOPNOTSUPP;
+                return NULL;
+        }
 
-                        /*
-                         * Get the semaphore ID of the existing semaphore. 
-                         * If the call to sem_create failed with EEXIST,
-                         * this will set the value of 's'.
-                         */
+        return h->engine->changes(msem_handle_sem(h), flags);
+}
 
-                        if ((s = semget(key, NSEMS, 0)) == -1) {
-                                ERROR("Still could not open semaphore\n");
-                                return -1;
-                        }
-                }
-        } else {
-                DEBUG("Created new semaphore %s[%c] with value %d\n", path, tag, init);
-                msem_record(path, tag, key, s);
-        }
 
-        /*
-         * Perform the open operation to provide the semaphore
-         * to your process. 
-         */
+/**
+ * msem_try
+ * ````````
+ * Lock a semaphore if it can be without waiting, for code that
+ * waits on its change word instead (see msem_notify.c).
+ *
+ * @semid: Handle.
+ * Return: 1 if locked, 0 if not, or -1 on error (errno EOPNOTSUPP
+ *         if the engine behind @semid cannot try a lock).
+ */
+int msem_try(int semid)
+{
+        struct msem_handle *h;
+        void *sem;
+        int r;
 
-        if (msem_operation(s, &op_open[0], nops_open) == -1) {
-                ERROR("Semaphore operation failed\n");
+        if ((h = msem_handle(semid)) == NULL) {
+                return -1;
+        }
+        if (h->engine->trylock == NULL) {
+                WARN("[%d] The %s engine cannot try a lock.\n", semid, h->engine->name);
+                errno = EOPNOTSUPP;
                 return -1;
         }
 
-        return s;
+        sem = msem_handle_sem(h);
+
+        if ((r = h->engine->trylock(sem, false)) == -1 && (errno == EIDRM || errno == EINVAL) && msem_handle_renew(h, sem)) {
+                r = h->engine->trylock(msem_handle_sem(h), false);
+        }
+
+        return r;
 }
 
 
+
+/******************************************************************************
+ * ENGINE SELECTION 
+ ******************************************************************************/
+
+/*
+ * Every engine that can be selected by name. The first is the
+ * default.
+ */
+static const struct msem_engine *msem_engines[] = {
+        &msem_sysv_engine,
+        &msem_futex_engine,
+        &msem_posix_engine,
+        &msem_local_engine,
+        &msem_pool_engine,
+        NULL
+};
+
+
 /**
- * msem_close
- * ``````````
- * Close a semaphore (used by exiting process).
+ * msem_engine_find
+ * ````````````````
+ * Look up an engine by name.
  *
- * @semid: Semaphore ID.
- * Return: TRUE on success, else FALSE.
+ * @name : Engine name, or NULL for the default.
+ * Return: Engine, or NULL (errno EINVAL) if there is none by @name.
  */
-int msem_close(int semid)
+static const struct msem_engine *msem_engine_find(const char *name)
 {
-        register int semval;
+        int i;
 
-        /* 
-         * Get a lock on the semaphore, then increment [1],
-         * the process counter.
-         */
-
-        if (msem_operation(semid, &op_close[0], nops_close) == -1) {
-                ERROR("Failed to close semaphore.\n");
-                return -1;
+        if (name == NULL || *name == '\0') {
+                return msem_engines[0];
         }
-        
-        /* 
-         * Read the value of the process counter to see if this
-         * is the last reference to the semaphore.
-         *
-         * Causes the race condition discussed in sem_make().
-         */
 
-        control.val = 0;
-        if ((semval = semctl(semid, PROCESSES, GETVAL, control)) == -1) {
-                ERROR("Failed to get process count.\n");
-                return -1;
+        for (i=0; msem_engines[i] != NULL; i++) {
+                if (!strcmp(name, msem_engines[i]->name)) {
+                        return msem_engines[i];
+                }
         }
 
-        if (semval > BIGCOUNT) {
-                ERROR("Process count (somehow) exceeds minimum.\n");
-                return -1;
-        } else if (semval == BIGCOUNT) {
-                WARN("Last process using semaphore. Removing semaphore.\n");
-                msem_remove(semid);
-                return 0;
-        } else {
-                if (msem_operation(semid, &op_unlock[0], nops_unlock) == -1) {
-                        ERROR("Failed to unlock semaphore.\n");
-                        return -1;
-                }
+        WARN("Unknown engine '%s'.\n", name);
+        errno = EINVAL;
+
+        return NULL;
+}
+
+
+/**
+ * msem_engine_default
+ * ```````````````````
+ * The engine selected by the MSEM_ENGINE environment variable.
+ *
+ * Return: The named engine, or the System V engine if unset.
+ *
+ * NOTE
+ * This lets existing callers move to another engine without
+ * changing any code.
+ */
+static const struct msem_engine *msem_engine_default(void)
+{
+        const struct msem_engine *engine;
+
+        if ((engine = msem_engine_find(getenv("MSEM_ENGINE"))) == NULL) {
+                return msem_engines[0];
         }
 
-        /* Decremented successfully */
-        return semval;
+        return engine;
 }
 
+
 /**
- * msem_exists()
- * `````````````
- * @path : Filesystem path to the semaphore.
- * @tag  : Tag (character) indicating the region of the file at @path.
- * Return: TRUE if semaphore exists at @path:@tag, else FALSE
+ * msem_engine_open
+ * ````````````````
+ * Open a semaphore with a given engine and give it a handle.
+ *
+ * @engine: Engine.
+ * @path  : Filesystem path to the semaphore.
+ * @tag   : Tag (character) indicating the region of the file at @path.
+ * @init  : Initial value to set the semaphore if it is created.
+ * @excl  : Fail with EEXIST if the semaphore already exists.
+ * @flags : MSEM_ flags for the semaphore if it is created.
+ * Return : Handle on success, -1 on error.
  */
-int msem_exists(char *path, char *tags)
+static int msem_engine_open(const struct msem_engine *engine, char *path, char *tag, int init, bool excl, int flags)
 {
-        key_t key;
-        int id;
-        char tag;
+        struct msem_handle *h;
+        struct stat st;
+        void *sem;
+        int semid;
 
-        tag = (char)*tags;
+        msem_cache_file(path, &st);
 
-        if ((key = ftok(path, tag)) == -1) {
-                return false;
+        pthread_mutex_lock(&msem_handles_lock);
+
+        if (!excl && (semid = msem_cache_find(engine, path, tag[0], &st)) != -1) {
+                msem_handles[semid]->refs++;
+                pthread_mutex_unlock(&msem_handles_lock);
+                return semid;
         }
-        if ((id = semget(key, 0, 0777)) == -1) {
-                return false;
+
+        pthread_mutex_unlock(&msem_handles_lock);
+
+        if ((flags & MSEM_ORDERED) && engine->queue == NULL) {
+                WARN("The %s engine cannot order its waiters.\n", engine->name);
+                errno = EOPNOTSUPP;
+                return -1;
         }
-        if (shell("ipcs -s | awk '{print $2}' | grep -q %d", id)) {
-                return false;
+
+        if ((flags & MSEM_ROBUST) && engine->holders == NULL) {
+                WARN("The %s engine cannot keep holders.\n", engine->name);
+                errno = EOPNOTSUPP;
+                return -1;
+        }
+
+        if ((sem = engine->open(path, tag, init, excl, flags)) == NULL) {
+                return -1;
+        }
+
+        /* The engine may have created the file. */
+        msem_cache_file(path, &st);
+
+        pthread_mutex_lock(&msem_handles_lock);
+
+        /* Someone may have opened the same name meanwhile. */
+        if (!excl && (semid = msem_cache_find(engine, path, tag[0], &st)) != -1) {
+                msem_handles[semid]->refs++;
+                pthread_mutex_unlock(&msem_handles_lock);
+                engine->close(sem);
+                return semid;
+        }
+
+        if ((h = msem_handle_new(engine, sem, path, tag[0], init, flags, &semid)) == NULL) {
+                pthread_mutex_unlock(&msem_handles_lock);
+                engine->close(sem);
+                return -1;
         }
-        return true;
+
+        h->dev = st.st_dev;
+        h->ino = st.st_ino;
+        msem_cache_add(h);
+
+        pthread_mutex_unlock(&msem_handles_lock);
+
+        return semid;
 }
- 
+
 
 
 /******************************************************************************
- * TIMEOUT SUPPORT 
+ * PUBLIC INTERFACE 
  ******************************************************************************/
 
-/* 
- * Set by the SIGALRM handler. Allows the caller 
- * to distinguish a timeout from some other error 
- * in the semaphore. 
+/**
+ * msem_create
+ * ```````````
+ * Create a semaphore with a specified initial value.
+ *
+ * @path : Filesystem path to the semaphore.
+ * @tag  : Tag (character) indicating the region of the file at @path.
+ * @init : Initial value of the semaphore.
+ * Return: Handle if all OK, else -1 (errno EEXIST if it exists).
  */
-volatile bool CAUGHT_ALARM = false;
+int msem_create(char *path, char *tag, int init)
+{
+        return msem_engine_open(msem_engine_default(), path, tag, init, true, 0);
+}
 
 
 /**
- * sem_alarm_handler
+ * msem_create_flags
  * `````````````````
- * Handler for SIGALRM signal.
+ * Like msem_create, but with MSEM_ flags (see msem.h), which
+ * stay with the semaphore for every process that opens it.
  *
- * @signo: Signal number (should be SIGALRM).
- * Return: Nothing.
+ * @path : Filesystem path to the semaphore.
+ * @tag  : Tag (character) indicating the region of the file at @path.
+ * @init : Initial value of the semaphore.
+ * @flags: MSEM_ flags.
+ * Return: Handle if all OK, else -1 (errno EEXIST if it exists).
  */
-void msem_alarm_handler(int sig)
+int msem_create_flags(char *path, char *tag, int init, int flags)
 {
-        CAUGHT_ALARM = 1;
+        return msem_engine_open(msem_engine_default(), path, tag, init, true, flags);
 }
 
 
 /**
- * sem_alarm_ms 
- * ```````````` 
- * Set a delayed SIGALRM signal.
+ * msem_open
+ * `````````
+ * Convert a semaphore (path,uid) tuple to a semaphore handle.
  *
- * @ms   : Number of milliseconds to delay.
- * Return: 1 on success, -1 on error.
+ * @path : Filesystem path to the semaphore.
+ * @tag  : Tag (character) indicating the region of the file at @path.
+ * @init : Initial value to set the semaphore if it is created.
+ * Return: Handle on success, -1 on error.
  */
-int set_alarm(int ms)
+int msem_open(char *path, char *tag, int init)
 {
-        struct itimerval when = {{0},{0}};
-
-        signal(SIGALRM, &msem_alarm_handler);
+        return msem_engine_open(msem_engine_default(), path, tag, init, false, 0);
+}
 
-        when.it_interval.tv_sec  = 0;
-        when.it_interval.tv_usec = 0;
-        when.it_value.tv_sec     = ms / SEC_IN_MS;
-        when.it_value.tv_usec    = MS_TO_US((ms%SEC_IN_MS));
 
-        /*DEBUG("tv_sec:  %ld\ntv_nsec: %ld\n", when.tv_sec, when.tv_nsec);*/
+/**
+ * msem_open_engine
+ * ````````````````
+ * Like msem_open, but with the engine chosen by the caller.
+ *
+ * @path  : Filesystem path to the semaphore.
+ * @tag   : Tag (character) indicating the region of the file at @path.
+ * @init  : Initial value to set the semaphore if it is created.
+ * @engine: Engine name ("sysv", "futex", "posix", "local", "pool"), or
+ *          NULL for the default (see MSEM_ENGINE).
+ * Return : Handle on success, -1 on error.
+ *
+ * NOTE
+ * Processes sharing a semaphore must all use the same engine;
+ * the same @path:@tag opened with two engines names two
+ * different semaphores.
+ */
+int msem_open_engine(char *path, char *tag, int init, char *engine)
+{
+        const struct msem_engine *e;
 
-        if ((setitimer(ITIMER_REAL, &when, 0)) == EINVAL) {
-                ERROR("Timer value not canonicalized.\n");
+        if ((e = msem_engine_find(engine)) == NULL) {
                 return -1;
         }
 
-        DEBUG("Programmed thread death in %dms.\n", ms);
-
-        return 1;
+        return msem_engine_open(e, path, tag, init, false, 0);
 }
 
 
-/******************************************************************************
- * SEMAPHORE OPERATIONS 
- ******************************************************************************/
-
 /**
- * msem_set_once
- * `````````````
- * Alter a semaphore's value by some amount.
+ * msem_close
+ * ``````````
+ * Close a semaphore handle.
  *
- * @semid: Semaphore ID
- * @value: Value to move semaphore.
- * @ms   : Milliseconds before timeout.
- * Return: -1 on error, return value of semop on success.
+ * @semid: Handle.
+ * Return: Remaining users of the semaphore, or -1 on error.
  *
  * NOTE
- * If the value of @ms is <= 0, no timeout will be
- * set. 
+ * A handle returned by more than one msem_open (see HANDLE CACHE)
+ * stays open until each has been matched by an msem_close; until
+ * then, the number of opens still outstanding is returned.
  */
-int msem_set_once(int semid, int value, int ms)
+int msem_close(int semid)
 {
-        pid_t pid = 1;
+        struct msem_handle *h;
+        int r;
 
-        /*
-         * No operation is defined for value 0, so
-         * we have to prevent this being argued.
-         */
+        pthread_mutex_lock(&msem_handles_lock);
 
-        if ((op_raw[0].sem_op = value) == 0) {
-                WARN("Semaphore operation value 0 not permitted.\n");
+        if ((h = msem_handle(semid)) == NULL) {
+                pthread_mutex_unlock(&msem_handles_lock);
                 return -1;
         }
 
-        /*
-         * If there are a valid number of milliseconds
-         * to wait, set the alarm handler before beginning
-         * the operation.
-         */
+        if ((r = --h->refs) == 0) {
+                msem_cache_drop(h);
+                __atomic_store_n(&msem_handles[semid], NULL, __ATOMIC_RELEASE);
+        }
 
-        if (ms > 0) {
-                if ((set_alarm(ms)) == -1) {
-                        ERROR("Could not establish timer, aborting.\n");
-                        return -1;
-                }
+        pthread_mutex_unlock(&msem_handles_lock);
+
+        if (r == 0) {
+                r = msem_handle_free(h);
         }
 
-        /*
-         * If the operation returns with an error, and the 
-         * CAUGHT_ALARM global variable was set, the operation 
-         * timed out.
-         */
+        return r;
+}
 
-        if ((msem_operation(semid, &op_raw[0], nops_raw)) == -1) {
-                if (CAUGHT_ALARM == true) {
-                        DEBUG("Caught SIGALRM (timed out).\n");
-                        pid = (int)getpid();
-                        DEBUG("[%d] Programmed thread death.\n", pid);
-                        CAUGHT_ALARM = false;
-                        return -1;
-                } else {
-                        WARN("Semaphore operation failed.\n");
-                        return -1;
-                }
+
+/**
+ * msem_remove
+ * ```````````
+ * Destroy the semaphore behind a handle. The handle must
+ * still be closed.
+ *
+ * @semid: Handle.
+ * Return: TRUE on success, else -1.
+ */
+int msem_remove(int semid)
+{
+        struct msem_handle *h;
+
+        if ((h = msem_handle(semid)) == NULL) {
+                return -1;
         }
 
-        return pid;
+        pthread_mutex_lock(&msem_handles_lock);
+        msem_cache_drop(h);
+        pthread_mutex_unlock(&msem_handles_lock);
+
+        return h->engine->remove(msem_handle_sem(h));
 }
 
 
 /**
- * msem_set_safe
- * `````````````
- * Alter a semaphore's value by some amount.
+ * msem_exists
+ * ```````````
+ * @path : Filesystem path to the semaphore.
+ * @tag  : Tag (character) indicating the region of the file at @path.
+ * Return: TRUE if semaphore exists at @path:@tag, else FALSE
+ */
+int msem_exists(char *path, char *tag)
+{
+        return (int)msem_engine_default()->exists(path, tag);
+}
+
+
+/**
+ * msem_query
+ * ``````````
+ * Retreive information about a semaphore.
  *
- * @semid: Semaphore ID
- * @value: Value to move semaphore.
- * Return: -1 on error, return value of semop on success.
+ * @semid     : Handle.
+ * @query_code: One of
+ *              'v' value
+ *              'p' PID of the last process to change the value
+ *              'n' # of waiters for the value to increase
+ *              'z' # of waiters for the value to reach 0
+ *              'o' time of the last operation
+ *              'c' time of the last change of control
+ *              'f' MSEM_ flags the semaphore was created with
+ *              'r' # of tokens reclaimed from dead holders and
+ *                  expired leases (0 unless robust)
+ *              'w' coalescing window in ms (see msem_coalesce)
+ * Return     : Answer, or -1 on error.
+ */
+int msem_query(int semid, char *query_code)
+{
+        struct msem_handle *h;
+
+        if ((h = msem_handle(semid)) == NULL) {
+                return -1;
+        }
+
+        return msem_handle_query(h, query_code[0]);
+}
+
+
+
+/**
+ * msem_handle_state
+ * `````````````````
+ * Take a snapshot of the semaphore behind a handle.
  *
- * NOTE
- * If the value of @ms is <= 0, no timeout will be
- * set. 
+ * @h    : Handle.
+ * @state: Snapshot (filled in).
+ * Return: -1 on error, else 0.
+ */
+static int msem_handle_state(struct msem_handle *h, struct msem_state *state)
+{
+        if ((state->value = msem_handle_query(h, 'v')) == -1
+         || (state->nwait = msem_handle_query(h, 'n')) == -1
+         || (state->zwait = msem_handle_query(h, 'z')) == -1
+         || (state->pid   = msem_handle_query(h, 'p')) == -1) {
+                return -1;
+        }
+
+        return 0;
+}
+
+
+/**
+ * msem_handle_changed
+ * ```````````````````
+ * Tell monitors of a semaphore that it may have changed, for
+ * operations made here rather than by the engine (see BATCHES).
  *
- * If the process dies while holding a semaphore, it will
- * undo any semaphore tokens it decremented. 
+ * @h    : Handle.
+ * Return: Nothing.
  */
-int msem_set_safe(int semid, int value, int ms)
+static void msem_handle_changed(struct msem_handle *h)
 {
-        pid_t pid = 1;
+        struct msem_changes *ch;
+        int flags;
 
-        /*
-         * No operation is defined for value 0, so
-         * we have to prevent this being argued.
-         */
+        if (h != NULL && h->engine->changes != NULL) {
+                ch = h->engine->changes(msem_handle_sem(h), &flags);
+                msem_changed(ch, flags);
+        }
+}
+
+
+/* How long a monitor woken by a waiter gives the kernel to count it. */
+#define MSEM_WATCH_SETTLE_MS 10
 
-        if ((op_sem[0].sem_op = value) == 0) {
-                WARN("Semaphore operation value 0 not permitted.\n");
+/**
+ * msem_watch
+ * ``````````
+ * Wait for the value, a waiter count or the last PID of a
+ * semaphore to change.
+ *
+ * @semid  : Handle.
+ * @state  : The snapshot last seen; filled in with the new one.
+ *           Set @state->value to -1 to take one at once.
+ * @timeout: Milliseconds before giving up (<= 0 for no timeout).
+ * Return  : 1 once @state differs from what was passed, or -1 on
+ *           error (errno EAGAIN on timeout).
+ *
+ * NOTE
+ * The engine moves a change word on at every operation, and the
+ * monitor sleeps on it, so a monitor costs nothing while nothing
+ * happens. The word is read before the snapshot, so no change
+ * made after the snapshot is missed.
+ *
+ * A System V lock moves the word on just before it enters the
+ * kernel, whether or not it will wait there, so a monitor woken by
+ * it may look too soon and find nothing new. It looks once more
+ * after MSEM_WATCH_SETTLE_MS, then sleeps on the word again.
+ *
+ * Operations made without this library (with semop(1) directly,
+ * say) do not move the word on, and are seen at the next one.
+ */
+int msem_watch(int semid, struct msem_state *state, int timeout)
+{
+        struct msem_handle *h;
+        struct msem_changes *ch;
+        struct msem_state now;
+        struct timespec rel;
+        struct timespec deadline;
+        struct timespec left;
+        uint32_t seen;
+        bool settle = false;
+        bool woken  = false;
+        int flags;
+        int ms;
+
+        if ((h = msem_handle(semid)) == NULL) {
+                return -1;
+        }
+        if (h->engine->changes == NULL) {
+                WARN("The %s engine cannot be watched.\n", h->engine->name);
+                errno = EOPNOTSUPP;
                 return -1;
         }
 
-        /*
-         * If there are a valid number of milliseconds
-         * to wait, set the alarm handler before beginning
-         * the operation.
-         */
+        if (msem_timeout(timeout, &rel) != NULL) {
+                msem_deadline(&rel, &deadline);
+        }
 
-        if (ms > 0) {
-                if ((set_alarm(ms)) == -1) {
-                        ERROR("Could not establish timer, aborting.\n");
+        for (;;) {
+                ch   = h->engine->changes(msem_handle_sem(h), &flags);
+                seen = __atomic_load_n(&ch->count, __ATOMIC_SEQ_CST);
+
+                if (msem_handle_state(h, &now) == -1) {
                         return -1;
                 }
-        }
+                if (state->value == -1 || memcmp(&now, state, sizeof(now)) != 0) {
+                        *state = now;
+                        return 1;
+                }
 
-        /*
-         * If the operation returns with an error, and the 
-         * CAUGHT_ALARM global variable was set, the operation 
-         * timed out.
-         */
+                ms = 0;
+                if (timeout > 0) {
+                        if (!msem_remaining(&deadline, &left)) {
+                                errno = EAGAIN;
+                                return -1;
+                        }
+                        ms = (int)(left.tv_sec * SEC_IN_MS + left.tv_nsec / NANO_IN_MILLI) + 1;
+                }
+                if (settle) {
+                        ms = (ms > 0 && ms < MSEM_WATCH_SETTLE_MS) ? ms : MSEM_WATCH_SETTLE_MS;
+                }
 
-        if ((msem_operation(semid, &op_sem[0], nops_sem)) == -1) {
-                if (CAUGHT_ALARM == true) {
-                        msem_close(semid);
-                        DEBUG("Caught SIGALRM (timed out).\n");
-                        pid = (int)getpid();
-                        DEBUG("[%d] Programmed thread death.\n", pid);
-                        CAUGHT_ALARM = false;
-                        return -1;
+                if (msem_changes_wait(ch, seen, flags, ms) == -1) {
+                        if (errno != EAGAIN && errno != EINTR) {
+                                return -1;
+                        }
+                        woken = false;
                 } else {
-                        WARN("Semaphore operation failed.\n");
-                        return -1;
+                        woken = true;
                 }
-        }
 
-        return pid;
+                /* Woken, and nothing seen yet: look once more soon. */
+                settle = woken && !settle;
+        }
 }
 
 
 
-
-
-
-
 /******************************************************************************
  * HANDY ONE-FUNCTION INTERFACE 
  ******************************************************************************/
 
-int msem(int semid, char *mode, int timeout)
+/**
+ * msem_handle_move
+ * ````````````````
+ * Move the value of a semaphore, through its queue if it is
+ * queued (see msem_queue.c), else with the engine's set.
+ *
+ * @h       : Handle.
+ * @sem     : Engine state behind @h.
+ * @value   : Value to move semaphore.
+ * @priority: Priority of a lock, if the semaphore is ordered.
+ * @ms      : Milliseconds before timeout.
+ * @undo    : Undo the change if the process exits.
+ * Return   : As the engine's set operation.
+ */
+static int msem_handle_move(struct msem_handle *h, void *sem, int value, int priority, int ms, bool undo)
 {
-        register int n = -1;
-        register int r = -1;
-
+        if (value == 0 || h->engine->queue == NULL || (h->engine->query(sem, 'f') & (MSEM_ORDERED|MSEM_EDGE)) == 0) {
+                return h->engine->set(sem, value, ms, undo);
+        }
+        if (value > 0) {
+                return msem_queue_give(h->engine, sem, value, undo);
+        }
+
+        return msem_queue_lock(h->engine, sem, -value, priority, ms, undo);
+}
+
+
+/**
+ * msem_handle_reap
+ * ````````````````
+ * Put back the tokens of any dead holders of a robust semaphore,
+ * at most once per MSEM_REAP_MS for each handle.
+ *
+ * @h    : Handle.
+ * @sem  : Engine state behind @h.
+ * @hs   : Its holders.
+ * Return: Nothing.
+ *
+ * NOTE
+ * Tokens a dead holder had given with undo ("+,") are taken back
+ * only as far as the value allows, as the kernel's undo would.
+ */
+static void msem_handle_reap(struct msem_handle *h, void *sem, struct msem_holders *hs)
+{
+        struct timespec now;
+        int64_t ns;
+        int amount;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        ns = (int64_t)now.tv_sec * MS_TO_NS(SEC_IN_MS) + now.tv_nsec;
+
+        if (ns < __atomic_load_n(&h->reap, __ATOMIC_RELAXED)) {
+                return;
+        }
+
+        __atomic_store_n(&h->reap, ns + MS_TO_NS(MSEM_REAP_MS), __ATOMIC_RELAXED);
+
+        while (msem_holders_reap(hs, &amount)) {
+                WARN("Reclaiming %d tokens of a dead holder.\n", amount);
+                if (amount > 0) {
+                        msem_handle_move(h, sem, amount, 0, 0, false);
+                }
+                for (; amount < 0 && h->engine->trylock(sem, false) == 1; amount++);
+        }
+}
+
+
+/**
+ * msem_handle_robust
+ * ``````````````````
+ * Move the value of a robust semaphore, keeping the caller in its
+ * holders in place of the engine's undo.
+ *
+ * @h       : Handle.
+ * @sem     : Engine state behind @h.
+ * @hs      : Its holders.
+ * @value   : Value to move semaphore.
+ * @priority: Priority of a lock, if the semaphore is ordered.
+ * @ms      : Milliseconds before timeout.
+ * @undo    : Undo the change if the process exits.
+ * Return   : As the engine's set operation.
+ *
+ * NOTE
+ * A lock which waits while anyone holds tokens waits in slices of
+ * MSEM_REAP_MS, looking for dead holders in between.
+ */
+static int msem_handle_robust(struct msem_handle *h, void *sem, struct msem_holders *hs, int value, int priority, int ms, bool undo)
+{
+        struct timespec rel;
+        struct timespec deadline;
+        struct timespec left;
+        bool slice;
+        int slot = -1;
+        int wait;
+        int r;
+
+        if (value > 0) {
+                if (undo && !msem_holders_room(hs)) {
+                        DEBUG("No room among the holders, using the engine's undo.\n");
+                        return msem_handle_move(h, sem, value, priority, ms, true);
+                }
+                /* Written down first: dying in between loses, not adds, a token. */
+                if (undo) {
+                        msem_holders_add(hs, -value);
+                }
+                if ((r = msem_handle_move(h, sem, value, priority, ms, false)) <= 0 && undo) {
+                        msem_holders_add(hs, value);
+                }
+                return r;
+        }
+
+        /* Claimed first, so the tokens need only be written in after. */
+        if (undo && (slot = msem_holders_claim(hs)) == -1) {
+                DEBUG("No room among the holders, using the engine's undo.\n");
+                return msem_handle_move(h, sem, value, priority, ms, true);
+        }
+
+        if (msem_timeout(ms, &rel) != NULL) {
+                msem_deadline(&rel, &deadline);
+        }
+
+        for (;;) {
+                wait  = ms;
+                slice = false;
+
+                if (msem_holders_busy(hs, slot != -1)) {
+                        msem_handle_reap(h, sem, hs);
+                        if (ms <= 0 || ms > MSEM_REAP_MS) {
+                                wait  = MSEM_REAP_MS;
+                                slice = true;
+                        }
+                }
+
+                if ((r = msem_handle_move(h, sem, value, priority, wait, false)) != -1 || errno != EAGAIN || !slice) {
+                        break;
+                }
+
+                if (ms > 0) {
+                        if (!msem_remaining(&deadline, &left)) {
+                                errno = EAGAIN;
+                                break;
+                        }
+                        ms = (int)(left.tv_sec * SEC_IN_MS + left.tv_nsec / MS_TO_NS(1)) + 1;
+                }
+        }
+
+        if (slot != -1 && !msem_holders_fill(hs, slot, (r == 1) ? -value : 0)) {
+                WARN("Lock held without undo: no room among the holders.\n");
+        }
+
+        return r;
+}
+
+
+/**
+ * msem_handle_change
+ * ``````````````````
+ * As msem_handle_move, through the holders if the semaphore is
+ * robust (see msem_handle_robust).
+ */
+static int msem_handle_change(struct msem_handle *h, void *sem, int value, int priority, int ms, bool undo)
+{
+        struct msem_holders *hs;
+
+        if ((hs = msem_handle_holders(h, sem)) != NULL) {
+                return msem_handle_robust(h, sem, hs, value, priority, ms, undo);
+        }
+
+        return msem_handle_move(h, sem, value, priority, ms, undo);
+}
+
+
+/**
+ * msem_handle_step
+ * ````````````````
+ * Move the value of the semaphore behind a handle, resolving
+ * the handle again if the semaphore has been removed.
+ *
+ * @h       : Handle.
+ * @value   : Value to move semaphore.
+ * @priority: Priority of a lock, if the semaphore is ordered.
+ * @ms      : Milliseconds before timeout.
+ * @undo    : Undo the change if the process exits.
+ * Return   : As the engine's set operation.
+ */
+static int msem_handle_step(struct msem_handle *h, int value, int priority, int ms, bool undo)
+{
+        void *sem = msem_handle_sem(h);
+        int r;
+
+        if ((r = msem_handle_change(h, sem, value, priority, ms, undo)) == -1 && value != 0) {
+                if ((errno == EIDRM || errno == EINVAL) && msem_handle_renew(h, sem)) {
+                        r = msem_handle_change(h, msem_handle_sem(h), value, priority, ms, undo);
+                }
+        }
+
+        return r;
+}
+
+
+/**
+ * msem_handle_give
+ * ````````````````
+ * The number of tokens an unlock may give.
+ *
+ * @h     : Handle.
+ * @amount: Tokens asked for.
+ * Return : @amount, or, if the semaphore is edge-triggered
+ *          (MSEM_EDGE) on an engine without a queue, no more than
+ *          the number of waiters.
+ *
+ * NOTE
+ * An edge-triggered semaphore with a queue hands its tokens to the
+ * waiters in it, and to no one else (see msem_queue_give). Without
+ * one, the waiters are counted just before the tokens are given,
+ * so a waiter which times out in between leaves its token behind.
+ */
+static int msem_handle_give(struct msem_handle *h, int amount)
+{
+        int n;
+
+        if ((msem_handle_query(h, 'f') & MSEM_EDGE) == 0 || msem_handle_queued(h)) {
+                return amount;
+        }
+        if ((n = msem_handle_query(h, 'n')) < amount) {
+                amount = (n > 0) ? n : 0;
+        }
+
+        return amount;
+}
+
+
+/**
+ * msem_handle_merge
+ * `````````````````
+ * @h    : Handle.
+ * Return: TRUE if a relax of the semaphore behind @h was merged into
+ *         a burst (see msem_changes_merge), and is not to be made.
+ */
+static bool msem_handle_merge(struct msem_handle *h)
+{
+        int flags;
+
+        if (h->engine->changes == NULL) {
+                return false;
+        }
+
+        return msem_changes_merge(h->engine->changes(msem_handle_sem(h), &flags));
+}
+
+
+/**
+ * msem_handle_release
+ * ```````````````````
+ * Release everyone waiting on a semaphore.
+ *
+ * @h    : Handle.
+ * Return: As the engine's set operation.
+ */
+static int msem_handle_release(struct msem_handle *h)
+{
+        struct msem_changes *ch;
+        int flags;
+        int n;
+
+        if (msem_handle_queued(h)) {
+                n = msem_queue_relax(h->engine, msem_handle_sem(h));
+                WARN("'+*' (relaxed %d queued)\n", n);
+        }
+        if (h->engine->relax != NULL) {
+                WARN("'+*' (relax)\n");
+                return h->engine->relax(msem_handle_sem(h));
+        }
+
+        /* Selectors see the relax on the change word, and take no token. */
+        n = msem_handle_query(h, 'n');
+        if (h->engine->changes != NULL) {
+                ch = h->engine->changes(msem_handle_sem(h), &flags);
+                n -= msem_selectors(ch);
+                msem_changes_relax(ch, flags);
+        }
+        WARN("'+*' (relax %d)\n", n);
+
+        return (n > 0) ? msem_handle_step(h, n, 0, 0, false) : 1;
+}
+
+
+/**
+ * msem_handle_relax
+ * `````````````````
+ * Relax a semaphore: release everyone waiting, or merge into the
+ * relax owed at the end of a burst (see msem_coalesce).
+ *
+ * @h    : Handle.
+ * Return: As the engine's set operation.
+ */
+static int msem_handle_relax(struct msem_handle *h)
+{
+        if (msem_handle_merge(h)) {
+                WARN("'+*' (merged into a burst)\n");
+                return 1;
+        }
+
+        return msem_handle_release(h);
+}
+
+
+/**
+ * msem_handle_once
+ * ````````````````
+ * Wait once, as msem_handle_wait.
+ */
+static int64_t msem_handle_once(struct msem_handle *h, char code, int64_t arg, int priority, int ms, bool undo)
+{
+        switch (code) {
+        case '-':
+                return msem_handle_step(h, (int)arg, priority, ms, undo);
+        case '*':
+                return h->engine->await(msem_handle_sem(h), ms);
+        default:
+                return h->engine->next(msem_handle_sem(h), arg, ms);
+        }
+}
+
+
+/**
+ * msem_handle_wait
+ * ````````````````
+ * Wait on the semaphore behind a handle, and, should a burst of
+ * relaxes close meanwhile owing one, make it (see msem_coalesce).
+ *
+ * @h       : Handle.
+ * @code    : What to wait for:
+ *            '-' a lock of -@arg tokens
+ *            '*' the next relax
+ *            'n' a sequence number past @arg (see msem_next)
+ * @arg     : As @code.
+ * @priority: Priority of a lock, if the semaphore is ordered.
+ * @ms      : Milliseconds before timeout.
+ * @undo    : Undo a lock if the process exits.
+ * Return   : As the engine's set, await or next operation.
+ *
+ * NOTE
+ * While a burst is open, the wait is cut short at its end. A
+ * waiter released by the relax owed then returns as the engine's
+ * own waiters do: a lock with MSEM_RELAXED, and an await with 1.
+ */
+static int64_t msem_handle_wait(struct msem_handle *h, char code, int64_t arg, int priority, int ms, bool undo)
+{
+        struct msem_changes *ch = NULL;
+        struct timespec rel;
+        struct timespec deadline;
+        struct timespec left;
+        bool timed = false;
+        int64_t burst = 0;
+        int64_t r;
+        int flags;
+        int due;
+
+        if (h->engine->changes != NULL) {
+                ch = h->engine->changes(msem_handle_sem(h), &flags);
+        }
+
+        for (;;) {
+                due = (ch != NULL) ? msem_changes_due(ch, &burst) : 0;
+
+                if (due == 0 || (ms > 0 && due >= ms)) {
+                        return msem_handle_once(h, code, arg, priority, ms, undo);
+                }
+                if (ms > 0 && !timed) {
+                        msem_timeout(ms, &rel);
+                        msem_deadline(&rel, &deadline);
+                        timed = true;
+                }
+
+                if ((r = msem_handle_once(h, code, arg, priority, due, undo)) != -1 || errno != EAGAIN) {
+                        return r;
+                }
+
+                switch (msem_changes_done(ch, burst)) {
+                case 1:
+                        WARN("'+*' (owed by a burst)\n");
+                        msem_handle_release(h);
+                        /* fall through */
+                case 0:
+                        if (code != 'n') {
+                                return (code == '-') ? MSEM_RELAXED : 1;
+                        }
+                        break;
+                }
+
+                if (timed) {
+                        if (!msem_remaining(&deadline, &left)) {
+                                errno = EAGAIN;
+                                return -1;
+                        }
+                        ms = (int)(left.tv_sec * SEC_IN_MS + left.tv_nsec / MS_TO_NS(1)) + 1;
+                }
+        }
+}
+
+
+/**
+ * msem_handle_lock
+ * ````````````````
+ * As msem_handle_step, waiting out the end of any burst of
+ * relaxes (see msem_handle_wait).
+ */
+static int msem_handle_lock(struct msem_handle *h, int value, int priority, int ms, bool undo)
+{
+        if (value < 0) {
+                return (int)msem_handle_wait(h, '-', value, priority, ms, undo);
+        }
+
+        return msem_handle_step(h, value, priority, ms, undo);
+}
+
+
+/**
+ * msem_handle_set
+ * ```````````````
+ * As msem_handle_lock, with no priority.
+ */
+static int msem_handle_set(struct msem_handle *h, int value, int ms, bool undo)
+{
+        return msem_handle_lock(h, value, 0, ms, undo);
+}
+
+
+/**
+ * msem
+ * ````
+ * Operate on a semaphore.
+ *
+ * @semid  : Handle.
+ * @mode   : One of
+ *           "-"  lock
+ *           "-," lock, undone if the process exits
+ *           "-*" wait for the next relax
+ *           "+"  unlock
+ *           "+," unlock, undone if the process exits
+ *           "+*" relax (release everyone waiting), or merge into
+ *                the relax owed at the end of a burst (see
+ *                msem_coalesce)
+ * @timeout: Milliseconds before a lock or wait times out (<= 0
+ *           for no timeout).
+ * Return  : TRUE on success, else FALSE.
+ *
+ * NOTE
+ * An unlock of an edge-triggered semaphore (see MSEM_EDGE) with
+ * no one waiting does nothing, and succeeds.
+ */
+int msem(int semid, char *mode, int timeout)
+{
+        struct msem_handle *h;
+        register int n = -1;
+        register int r = -1;
+
+        if ((h = msem_handle(semid)) == NULL) {
+                return (int)false;
+        }
+
         switch (mode[0]) {
         case '-':
         case 'p':
                 WARN("[%d] '- or p' (lock)\n", semid);
+                timeout = msem_expire(timeout);
                 switch (mode[1]) {
+                case '*':
+                        WARN("[%d] '-*' (await relax)\n", semid);
+                        if (h->engine->await == NULL) {
+                                WARN("The %s engine cannot await a relax.\n", h->engine->name);
+                                errno = EOPNOTSUPP;
+                                return (int)false;
+                        }
+                        r = (int)msem_handle_wait(h, '*', 0, 0, timeout, false);
+                        break;
                 case ',':
                         WARN("[%d] '-,' (lock with undo)\n", semid);
-                        r = msem_set_safe(semid, -1, timeout);
+                        r = msem_handle_set(h, -1, timeout, true);
                         break;
                 case '\0':
                         WARN("[%d] '-' (lock)\n", semid);
-                        r = msem_set_once(semid, -1, timeout);
+                        r = msem_handle_set(h, -1, timeout, false);
                         break;
                 }
                 break;
@@ -1040,18 +1726,19 @@ int msem(int semid, char *mode, int timeout)
                 WARN("[%d] '+ or v' (unlock)\n", semid);
                 switch (mode[1]) {
                 case '*':
-                        n = msem_query(semid, "n");
-                        WARN("[%d] '+*' (relax %d)\n", semid, n);
-                        r = msem_set_once(semid, n, 0);
+                        WARN("[%d] '+*' (relax)\n", semid);
+                        r = msem_handle_relax(h);
                         break;
                 case ',':
                         WARN("[%d] '+,' (unlock with undo)\n", semid);
-                        r = msem_set_safe(semid, 1, 0);
+                        n = msem_handle_give(h, 1);
+                        r = (n > 0) ? msem_handle_set(h, n, 0, true) : 1;
                         break;
 
                 case '\0':
                         WARN("[%d] '+' (unlock)\n", semid);
-                        r = msem_set_once(semid, 1, 0);
+                        n = msem_handle_give(h, 1);
+                        r = (n > 0) ? msem_handle_set(h, n, 0, false) : 1;
                         break;
                 }
                 break;
@@ -1064,3 +1751,935 @@ int msem(int semid, char *mode, int timeout)
 }
 
 
+
+/**
+ * msem_lock_priority
+ * ``````````````````
+ * Lock a semaphore, ahead of waiters of lower priority.
+ *
+ * @semid   : Handle.
+ * @mode    : "-" to lock, or "-," to lock with undo.
+ * @priority: Priority of this waiter; higher is served first, and
+ *            msem() waits at priority 0.
+ * @timeout : Milliseconds before the lock times out (<= 0 for no
+ *            timeout).
+ * Return   : TRUE on success, else FALSE.
+ *
+ * NOTE
+ * Only an ordered semaphore (see MSEM_ORDERED) has a queue to
+ * jump; on any other, @priority is ignored. Among waiters of
+ * equal priority, the one whose timeout runs out first is served
+ * first, and those with no timeout last, in order of arrival.
+ */
+int msem_lock_priority(int semid, char *mode, int priority, int timeout)
+{
+        struct msem_handle *h;
+
+        if ((h = msem_handle(semid)) == NULL) {
+                return (int)false;
+        }
+        if ((mode[0] != '-' && mode[0] != 'p') || (mode[1] != '\0' && mode[1] != ',')) {
+                WARN("Invalid mode supplied\n");
+                errno = EINVAL;
+                return (int)false;
+        }
+
+        timeout = msem_expire(timeout);
+
+        return (msem_handle_lock(h, -1, priority, timeout, (mode[1] == ',')) > 0) ? (int)true : (int)false;
+}
+
+
+/**
+ * msem_take
+ * `````````
+ * Lock a semaphore on behalf of others, telling a lock that holds
+ * a token from a release by a relax, which holds none (see
+ * msem_mux.c).
+ *
+ * @semid  : Handle.
+ * @undo   : Undo the lock if the process exits.
+ * @timeout: Milliseconds before the lock times out (<= 0 for no
+ *           timeout).
+ * Return  : -1 on error (errno EAGAIN on timeout), MSEM_RELAXED if
+ *           released by a relax, else 1.
+ */
+int msem_take(int semid, bool undo, int timeout)
+{
+        struct msem_handle *h;
+        int r;
+
+        if ((h = msem_handle(semid)) == NULL) {
+                return -1;
+        }
+
+        if ((r = msem_handle_set(h, -1, msem_expire(timeout), undo)) == MSEM_RELAXED) {
+                return MSEM_RELAXED;
+        }
+
+        return (r > 0) ? 1 : -1;
+}
+
+
+
+/**
+ * msem_lease
+ * ``````````
+ * Lock a robust semaphore under a lease, which is reclaimed if it
+ * is not renewed in time.
+ *
+ * @semid  : Handle.
+ * @mode   : One of
+ *           "-" lock, under a lease of @lease ms
+ *           "=" renew the caller's lease, for @lease ms from now
+ *           "+" unlock, ending the lease
+ * @lease  : Milliseconds the lease lasts.
+ * @timeout: Milliseconds before the lock times out (<= 0 for no
+ *           timeout).
+ * Return  : TRUE on success, else FALSE (errno ETIMEDOUT if the
+ *           lease has run out and been reclaimed).
+ *
+ * NOTE
+ * A holder which hangs keeps the token only until its lease runs
+ * out; the next lock that has to wait then puts it back, within
+ * MSEM_REAP_MS, and msem_query(semid, "r") counts it. A late "+"
+ * then fails and gives nothing, so the token is not given twice.
+ *
+ * Leases are kept with the holders (see msem_holders.c), so the
+ * semaphore must be robust (MSEM_ROBUST). A process has one lease
+ * on each semaphore, covering all the tokens it holds under lease.
+ */
+int msem_lease(int semid, char *mode, int lease, int timeout)
+{
+        struct msem_handle *h;
+        struct msem_holders *hs;
+        struct timespec rel;
+        struct timespec deadline;
+        int64_t ns = 0;
+        int n;
+
+        if ((h = msem_handle(semid)) == NULL) {
+                return (int)false;
+        }
+        if ((hs = msem_handle_holders(h, msem_handle_sem(h))) == NULL) {
+                WARN("[%d] Leases need a robust semaphore.\n", semid);
+                errno = EOPNOTSUPP;
+                return (int)false;
+        }
+        if (lease <= 0 && mode[0] != '+' && mode[0] != 'v') {
+                WARN("Invalid lease supplied\n");
+                errno = EINVAL;
+                return (int)false;
+        }
+
+        if (msem_timeout(lease, &rel) != NULL) {
+                msem_deadline(&rel, &deadline);
+                ns = (int64_t)deadline.tv_sec * MS_TO_NS(SEC_IN_MS) + deadline.tv_nsec;
+        }
+
+        switch (mode[0]) {
+        case '-':
+        case 'p':
+                WARN("[%d] '-' (lock under a %dms lease)\n", semid, lease);
+                if ((n = msem_handle_lock(h, -1, 0, msem_expire(timeout), false)) <= 0) {
+                        return (int)false;
+                }
+                if (n == MSEM_RELAXED) {
+                        /* Released by a relax: there is no token to lease. */
+                        return (int)true;
+                }
+                /* The handle may have been renewed while waiting. */
+                if ((hs = msem_handle_holders(h, msem_handle_sem(h))) == NULL || !msem_holders_lease(hs, 1, ns)) {
+                        msem_handle_set(h, 1, 0, false);
+                        return (int)false;
+                }
+                return (int)true;
+        case '=':
+                WARN("[%d] '=' (renew lease for %dms)\n", semid, lease);
+                return (int)msem_holders_renew(hs, ns);
+        case '+':
+        case 'v':
+                WARN("[%d] '+' (unlock, ending lease)\n", semid);
+                if (!msem_holders_lease(hs, -1, 0)) {
+                        return (int)false;
+                }
+                n = msem_handle_give(h, 1);
+                return (n <= 0 || msem_handle_set(h, n, 0, false) > 0) ? (int)true : (int)false;
+        default:
+                WARN("Invalid mode supplied\n");
+                errno = EINVAL;
+                return (int)false;
+        }
+}
+
+
+/**
+ * msem_coalesce
+ * `````````````
+ * Merge the relaxes of a semaphore that come close together.
+ *
+ * @semid : Handle.
+ * @window: Milliseconds a burst of relaxes lasts, or 0 to relax
+ *          at once, every time (the default).
+ * Return : TRUE on success, else FALSE.
+ *
+ * NOTE
+ * The window is kept with the semaphore, so it holds for every
+ * process that relaxes it. The first relax ("+*") of a burst is
+ * made at once and opens @window; those made while it is open
+ * return at once, merged into one relax owed when it closes, so
+ * a waiter is woken at most twice per burst rather than once per
+ * relax. No publisher sleeps: the relax owed is made by whoever
+ * is waiting when the window closes (locks, "-*" and msem_next
+ * wait no longer than that), or else by the next relax.
+ */
+int msem_coalesce(int semid, int window)
+{
+        struct msem_handle *h;
+        int flags;
+
+        if ((h = msem_handle(semid)) == NULL) {
+                return (int)false;
+        }
+        if (h->engine->changes == NULL) {
+                WARN("The %s engine cannot merge relaxes.\n", h->engine->name);
+                errno = EOPNOTSUPP;
+                return (int)false;
+        }
+        if (window < 0) {
+                WARN("Invalid window supplied\n");
+                errno = EINVAL;
+                return (int)false;
+        }
+
+        __atomic_store_n(&h->engine->changes(msem_handle_sem(h), &flags)->window, window, __ATOMIC_SEQ_CST);
+
+        return (int)true;
+}
+
+
+/**
+ * msem_relax_waves
+ * ````````````````
+ * Release the processes waiting to lock a semaphore a few at a time,
+ * rather than all at once as a relax does.
+ *
+ * @semid   : Handle.
+ * @size    : Most waiters released in one wave.
+ * @pace    : Milliseconds between waves.
+ * @released: Filled in with the number released in each wave, for
+ *            the first @max waves (may be NULL).
+ * @max     : Length of @released.
+ * Return   : Number of waves made, or -1 on error.
+ *
+ * NOTE
+ * Those counted as waiting ('n') when called are released, and no
+ * more: each wave unlocks the semaphore by @size, or by fewer if
+ * fewer are left or still waiting, so a waiter which times out
+ * meanwhile leaves no token behind. Waiters who arrive meanwhile
+ * may be served in place of those who were counted.
+ *
+ * Unlike a relax, the waves do not move the sequence number on,
+ * so those waiting for the next relax ("-*", msem_next) stay put.
+ */
+int msem_relax_waves(int semid, int size, int pace, int *released, int max)
+{
+        struct msem_handle *h;
+        int waves;
+        int left;
+        int n;
+
+        if ((h = msem_handle(semid)) == NULL) {
+                return -1;
+        }
+        if (size <= 0) {
+                WARN("Invalid wave size supplied\n");
+                errno = EINVAL;
+                return -1;
+        }
+        if ((left = msem_handle_query(h, 'n')) == -1) {
+                return -1;
+        }
+
+        for (waves=0; left > 0; waves++) {
+                if (waves > 0 && pace > 0) {
+                        sleep_ms(pace);
+                }
+                if ((n = msem_handle_query(h, 'n')) == -1) {
+                        return -1;
+                }
+                n = (n < left) ? n : left;
+                n = (n < size) ? n : size;
+
+                if (n <= 0) {
+                        break;
+                }
+                if (msem_handle_set(h, n, 0, false) <= 0) {
+                        return -1;
+                }
+                if (released != NULL && waves < max) {
+                        released[waves] = n;
+                }
+                WARN("[%d] Wave %d released %d\n", semid, waves, n);
+                left -= n;
+        }
+
+        return waves;
+}
+
+
+
+/**
+ * msem_next
+ * `````````
+ * Wait for a semaphore's sequence number to move past one
+ * already seen.
+ *
+ * @semid  : Handle.
+ * @after  : Sequence number the caller last saw, or -1 for none.
+ * @timeout: Milliseconds before giving up (<= 0 for no timeout).
+ * Return  : The new sequence number, or -1 on error (errno EAGAIN
+ *           on timeout).
+ *
+ * NOTE
+ * The sequence number counts the relaxes ('+*') of a semaphore.
+ * If it has already moved past @after, this returns at once, so
+ * a client which passes back whatever it was last given misses
+ * no relax made while it was away. Pass -1 to read the current
+ * number without waiting.
+ *
+ * Numbers only grow while the semaphore exists. One lower than
+ * @after means it was created again since, and is returned at
+ * once like any other.
+ */
+long long msem_next(int semid, long long after, int timeout)
+{
+        struct msem_handle *h;
+
+        if ((h = msem_handle(semid)) == NULL) {
+                return -1;
+        }
+        if (h->engine->next == NULL) {
+                WARN("The %s engine has no sequence number.\n", h->engine->name);
+                errno = EOPNOTSUPP;
+                return -1;
+        }
+
+        return (long long)msem_handle_wait(h, 'n', (int64_t)after, 0, msem_expire(timeout), false);
+}
+
+
+
+/******************************************************************************
+ * BATCHES 
+ *
+ * Many operations, on many semaphores, in as few system calls
+ * as possible. Entries whose semaphores share a System V set are
+ * merged into one semop(), which the kernel applies atomically:
+ * all of them happen, or (on timeout or error) none do. Other
+ * entries, and every relax ("+*"), are applied one at a time; a
+ * relax goes through the engine as msem() makes it, so waiters for
+ * the next relax see it.
+ *
+ ******************************************************************************/
+
+/* Most entries merged into one semop() (the kernel's SEMOPM). */
+#define MSEM_BATCH_MAX 500
+
+
+/**
+ * msem_op_value
+ * `````````````
+ * The amount a lock or unlock entry moves its semaphore by.
+ *
+ * @h    : Handle of the entry.
+ * @op   : Entry.
+ * @undo : Whether the entry asks for undo (filled in).
+ * @value: Amount (filled in); 0 if there is nothing to do.
+ * Return: -1 (errno EINVAL) if @op->mode is not valid, else 0.
+ */
+static int msem_op_value(struct msem_handle *h, struct msem_op *op, bool *undo, int *value)
+{
+        int amount = (op->amount > 0) ? op->amount : 1;
+
+        *undo = (op->mode[0] != '\0' && op->mode[1] == ',');
+
+        switch (op->mode[0]) {
+        case '-':
+        case 'p':
+                if (op->mode[1] == '\0' || op->mode[1] == ',') {
+                        *value = -amount;
+                        return 0;
+                }
+                break;
+        case '+':
+        case 'v':
+                if (op->mode[1] == '\0' || op->mode[1] == ',') {
+                        *value = msem_handle_give(h, amount);
+                        return 0;
+                }
+                break;
+        }
+
+        WARN("Invalid mode supplied\n");
+        errno = EINVAL;
+
+        return -1;
+}
+
+
+/**
+ * msem_op_relax
+ * `````````````
+ * @op   : Entry.
+ * Return: TRUE if @op is a relax ("+*").
+ */
+static bool msem_op_relax(struct msem_op *op)
+{
+        return (op->mode[0] == '+' || op->mode[0] == 'v') && op->mode[1] == '*';
+}
+
+
+static void msem_op_done(struct msem_op *op, bool ok, int error)
+{
+        op->result = (ok) ? 1 : 0;
+        op->error  = (ok) ? 0 : error;
+}
+
+
+/**
+ * msem_batch
+ * ``````````
+ * Apply many operations at once.
+ *
+ * @ops    : Entries (see struct msem_op in msem.h).
+ * @nops   : Number of entries.
+ * @timeout: Milliseconds before the whole batch times out (<= 0
+ *           for no timeout).
+ * Return  : Number of entries which succeeded.
+ *
+ * NOTE
+ * Entries merged into one semop() succeed or fail together, so
+ * a lock which cannot be had holds back the unlocks merged with
+ * it until it can (or the timeout expires). Callers who do not
+ * want that should not mix locks and unlocks on one set.
+ */
+int msem_batch(struct msem_op *ops, int nops, int timeout)
+{
+        struct sembuf sops[MSEM_BATCH_MAX];
+        int which[MSEM_BATCH_MAX];
+        struct timespec rel;
+        struct timespec deadline;
+        struct timespec left;
+        struct msem_handle *h;
+        unsigned short num;
+        bool *done;
+        bool undo;
+        int value;
+        int set;
+        int ms = 0;
+        int ok = 0;
+        int n;
+        int i;
+        int j;
+
+        if ((done = calloc(nops, sizeof(bool))) == NULL) {
+                for (i=0; i<nops; i++) {
+                        msem_op_done(&ops[i], false, ENOMEM);
+                }
+                return 0;
+        }
+
+        timeout = msem_expire(timeout);
+
+        if (msem_timeout(timeout, &rel) != NULL) {
+                msem_deadline(&rel, &deadline);
+        }
+
+        for (i=0; i<nops; i++) {
+                if (done[i]) {
+                        continue;
+                }
+
+                if (timeout > 0) {
+                        if (!msem_remaining(&deadline, &left)) {
+                                msem_op_done(&ops[i], false, EAGAIN);
+                                continue;
+                        }
+                        ms = (int)(left.tv_sec * SEC_IN_MS + left.tv_nsec / NANO_IN_MILLI) + 1;
+                }
+
+                /*
+                 * Gather this entry and every later one on the same
+                 * set; an entry not on a System V set goes alone.
+                 */
+                set = -1;
+                n   = 0;
+
+                for (j=i; j<nops && n<MSEM_BATCH_MAX; j++) {
+                        if (done[j]) {
+                                continue;
+                        }
+                        if ((h = msem_handle(ops[j].semid)) == NULL) {
+                                if (j == i) {
+                                        done[j] = true;
+                                        msem_op_done(&ops[j], false, errno);
+                                }
+                                continue;
+                        }
+                        if (msem_op_relax(&ops[j])) {
+                                /* A relax goes alone, through the engine. */
+                                if (j == i) {
+                                        done[j] = true;
+                                        if (msem_handle_relax(h) > 0) {
+                                                msem_op_done(&ops[j], true, 0);
+                                                ok++;
+                                        } else {
+                                                msem_op_done(&ops[j], false, errno);
+                                        }
+                                        break;
+                                }
+                                continue;
+                        }
+                        if (j == i) {
+                                set = msem_handle_member(h, &num);
+                        } else if (set == -1 || msem_handle_member(h, &num) != set) {
+                                continue;
+                        }
+
+                        done[j] = true;
+
+                        if (msem_op_value(h, &ops[j], &undo, &value) == -1) {
+                                msem_op_done(&ops[j], false, errno);
+                        } else if (value == 0) {
+                                /* Nothing to do (an unlock with no waiters). */
+                                msem_op_done(&ops[j], true, 0);
+                                ok++;
+                        } else if (set == -1 || value > MSEM_SEMVMX || value < -MSEM_SEMVMX) {
+                                /* Alone, or too large for one semop(). */
+                                if (msem_handle_set(h, value, ms, undo) > 0) {
+                                        msem_op_done(&ops[j], true, 0);
+                                        ok++;
+                                } else {
+                                        msem_op_done(&ops[j], false, errno);
+                                }
+                        } else {
+                                sops[n].sem_num = num;
+                                sops[n].sem_op  = value;
+                                sops[n].sem_flg = (undo) ? SEM_UNDO : 0;
+                                which[n]        = j;
+                                n++;
+                        }
+
+                        if (set == -1) {
+                                break;
+                        }
+                }
+
+                if (n == 0) {
+                        continue;
+                }
+
+                DEBUG("[%d] Merged %d operations into one semop.\n", set, n);
+
+                for (j=0; j<n; j++) {
+                        msem_handle_changed(msem_handle(ops[which[j]].semid));
+                }
+
+                if (msem_operation(set, sops, n, (timeout > 0) ? &left : NULL) == 0) {
+                        for (j=0; j<n; j++) {
+                                msem_op_done(&ops[which[j]], true, 0);
+                        }
+                        ok += n;
+                } else {
+                        for (j=0; j<n; j++) {
+                                msem_op_done(&ops[which[j]], false, errno);
+                        }
+                }
+
+                for (j=0; j<n; j++) {
+                        msem_handle_changed(msem_handle(ops[which[j]].semid));
+                }
+        }
+
+        free(done);
+
+        return ok;
+}
+
+
+
+/******************************************************************************
+ * ATOMIC ACQUISITION 
+ *
+ * Locking several semaphores one at a time invites deadlock: one
+ * process holds A and waits for B while another holds B and waits
+ * for A. msem_acquire takes them all or none.
+ *
+ * Semaphores in the same System V set are locked together by one
+ * semop(), which the kernel makes atomic. Otherwise they are locked
+ * in an order every process agrees on -- by set ID for System V,
+ * then by engine, path and tag -- so no two processes can each hold
+ * what the other waits for. If any lock times out or fails, those
+ * already taken are given back.
+ *
+ ******************************************************************************/
+
+/*
+ * A semaphore to acquire.
+ *
+ * @h  : Handle.
+ * @set: System V set holding it, or -1.
+ * @num: Member number within @set.
+ */
+struct msem_want {
+        struct msem_handle *h;
+        int set;
+        unsigned short num;
+};
+
+
+/**
+ * msem_want_order
+ * ```````````````
+ * The order in which semaphores are acquired (see qsort(3)).
+ */
+static int msem_want_order(const void *a, const void *b)
+{
+        const struct msem_want *x = a;
+        const struct msem_want *y = b;
+        int r;
+
+        if (x->set != y->set) {
+                if (x->set == -1 || y->set == -1) {
+                        return (x->set == -1) ? 1 : -1; /* System V first */
+                }
+                return (x->set < y->set) ? -1 : 1;
+        }
+        if (x->set != -1) {
+                return (int)x->num - (int)y->num;
+        }
+        if ((r = strcmp(x->h->engine->name, y->h->engine->name)) != 0) {
+                return r;
+        }
+        if ((r = strcmp(x->h->path, y->h->path)) != 0) {
+                return r;
+        }
+
+        return (int)x->h->tag - (int)y->h->tag;
+}
+
+
+/**
+ * msem_want_step
+ * ``````````````
+ * Lock or unlock one step of an acquisition: a run of semaphores
+ * in one System V set, or a single semaphore otherwise.
+ *
+ * @w    : First semaphore of the step.
+ * @n    : Number in the step.
+ * @value: -1 to lock, 1 to unlock.
+ * @undo : Undo the change if the process exits.
+ * @ms   : Milliseconds before timeout (<= 0 for none).
+ * Return: -1 on error (errno EAGAIN on timeout), MSEM_RELAXED if a
+ *         lone semaphore was released by a relax, and holds nothing
+ *         to give back, else 0.
+ */
+static int msem_want_step(struct msem_want *w, int n, int value, bool undo, int ms)
+{
+        struct sembuf sops[MSEM_BATCH_MAX];
+        struct timespec timeout;
+        int r;
+        int i;
+
+        if (w->set == -1) {
+                if ((r = msem_handle_set(w->h, value, ms, undo)) == MSEM_RELAXED) {
+                        return MSEM_RELAXED;
+                }
+                return (r > 0) ? 0 : -1;
+        }
+
+        for (i=0; i<n; i++) {
+                sops[i].sem_num = w[i].num;
+                sops[i].sem_op  = value;
+                sops[i].sem_flg = (undo) ? SEM_UNDO : 0;
+                msem_handle_changed(w[i].h);
+        }
+
+        r = msem_operation(w->set, sops, n, msem_timeout(ms, &timeout));
+
+        for (i=0; i<n; i++) {
+                msem_handle_changed(w[i].h);
+        }
+
+        return r;
+}
+
+
+/**
+ * msem_acquire
+ * ````````````
+ * Lock several semaphores at once: all of them, or none.
+ *
+ * @semids : Handles.
+ * @nsems  : Number of handles (at most 500).
+ * @mode   : "-" to lock, or "-," to lock with undo.
+ * @timeout: Milliseconds before giving up (<= 0 for no timeout).
+ * Return  : TRUE if every semaphore was locked, else FALSE (and
+ *           none are held).
+ */
+int msem_acquire(int *semids, int nsems, char *mode, int timeout)
+{
+        struct msem_want want[MSEM_BATCH_MAX];
+        struct timespec rel;
+        struct timespec deadline;
+        struct timespec left;
+        bool undo;
+        int step[MSEM_BATCH_MAX];
+        int took[MSEM_BATCH_MAX];
+        int nsteps = 0;
+        int ms = 0;
+        int err;
+        int i;
+        int j;
+
+        if (nsems <= 0 || nsems > MSEM_BATCH_MAX || (mode[0] != '-' && mode[0] != 'p')) {
+                WARN("Invalid acquisition.\n");
+                errno = EINVAL;
+                return (int)false;
+        }
+
+        undo = (mode[1] == ',');
+
+        for (i=0; i<nsems; i++) {
+                if ((want[i].h = msem_handle(semids[i])) == NULL) {
+                        return (int)false;
+                }
+                want[i].set = msem_handle_member(want[i].h, &want[i].num);
+        }
+
+        qsort(want, nsems, sizeof(struct msem_want), msem_want_order);
+
+        /* Each step starts a run of one System V set, or is alone. */
+        for (i=0; i<nsems; i++) {
+                if (i == 0 || want[i].set == -1 || want[i].set != want[i-1].set) {
+                        step[nsteps++] = i;
+                }
+        }
+
+        timeout = msem_expire(timeout);
+
+        if (msem_timeout(timeout, &rel) != NULL) {
+                msem_deadline(&rel, &deadline);
+        }
+
+        for (i=0; i<nsteps; i++) {
+                if (timeout > 0) {
+                        if (!msem_remaining(&deadline, &left)) {
+                                errno = EAGAIN;
+                                break;
+                        }
+                        ms = (int)(left.tv_sec * SEC_IN_MS + left.tv_nsec / NANO_IN_MILLI) + 1;
+                }
+                j = ((i+1 < nsteps) ? step[i+1] : nsems) - step[i];
+                if ((took[i] = msem_want_step(&want[step[i]], j, -1, undo, ms)) == -1) {
+                        break;
+                }
+        }
+
+        if (i == nsteps) {
+                return (int)true;
+        }
+
+        /*
+         * Give back everything taken so far.
+         */
+        err = errno;
+        DEBUG("Acquisition failed at step %d of %d (%d), rolling back.\n", i, nsteps, err);
+
+        while (i-- > 0) {
+                if (took[i] == MSEM_RELAXED) {
+                        continue;
+                }
+                j = ((i+1 < nsteps) ? step[i+1] : nsems) - step[i];
+                msem_want_step(&want[step[i]], j, 1, undo, 0);
+        }
+
+        errno = err;
+
+        return (int)false;
+}
+
+
+
+/******************************************************************************
+ * SELECTION 
+ *
+ * Waiting to lock any one of several semaphores, as select(2)
+ * waits on any of several descriptors. The selector counts itself
+ * as a waiter on each semaphore (see struct msem_changes), so
+ * relaxes and edge-triggered unlocks leave it a token, then tries
+ * each without waiting, and sleeps on all of their change words
+ * at once until one moves.
+ *
+ ******************************************************************************/
+
+/* Most semaphores in one selection (futex_waitv's limit). */
+#define MSEM_SELECT_MAX 128
+
+
+/**
+ * msem_select
+ * ```````````
+ * Lock whichever of several semaphores can be locked first.
+ *
+ * @semids : Handles.
+ * @nsems  : Number of handles (at most 128).
+ * @mode   : "-" to lock, or "-," to lock with undo.
+ * @timeout: Milliseconds before giving up (<= 0 for no timeout).
+ * @fired  : Filled in with 1 for each semaphore locked, else 0.
+ * Return  : Number of semaphores locked, or -1 on error (errno
+ *           EAGAIN on timeout, and none are held).
+ *
+ * NOTE
+ * Every semaphore which has a token when the selector looks is
+ * locked, so more than one may fire at once; each is unlocked as
+ * usual. One relax of several semaphores, say, fires them all.
+ *
+ * A relax of a semaphore fires it for every selector waiting on
+ * it, without a token, as it releases the engine's own waiters
+ * (see msem_changes_relax). A selector counted by an unlock of an
+ * edge-triggered semaphore which then returns (having fired on
+ * another semaphore, or timed out) before taking the token leaves
+ * it behind, as a timed-out waiter does.
+ *
+ * Robust semaphores (MSEM_ROBUST) are looked at for dead holders
+ * every MSEM_REAP_MS while the selector waits, as by msem_handle_robust.
+ */
+int msem_select(int *semids, int nsems, char *mode, int timeout, int *fired)
+{
+        struct msem_handle *h[MSEM_SELECT_MAX];
+        struct msem_changes *ch[MSEM_SELECT_MAX];
+        struct msem_holders *hs[MSEM_SELECT_MAX];
+        uint32_t seen[MSEM_SELECT_MAX];
+        uint32_t relaxes[MSEM_SELECT_MAX];
+        int flags[MSEM_SELECT_MAX];
+        struct timespec rel;
+        struct timespec deadline;
+        struct timespec left;
+        struct timespec *dl = NULL;
+        struct timespec slice;
+        struct timespec *wdl;
+        bool undo;
+        int slot;
+        int n = 0;
+        int err = 0;
+        int r;
+        int i;
+
+        if (nsems <= 0 || nsems > MSEM_SELECT_MAX || (mode[0] != '-' && mode[0] != 'p')) {
+                WARN("Invalid selection.\n");
+                errno = EINVAL;
+                return -1;
+        }
+
+        undo = (mode[1] == ',');
+
+        for (i=0; i<nsems; i++) {
+                fired[i] = 0;
+                if ((h[i] = msem_handle(semids[i])) == NULL) {
+                        return -1;
+                }
+                if (h[i]->engine->changes == NULL || h[i]->engine->trylock == NULL) {
+                        WARN("The %s engine cannot be selected.\n", h[i]->engine->name);
+                        errno = EOPNOTSUPP;
+                        return -1;
+                }
+        }
+
+        timeout = msem_expire(timeout);
+
+        if (msem_timeout(timeout, &rel) != NULL) {
+                msem_deadline(&rel, &deadline);
+                dl = &deadline;
+        }
+
+        for (i=0; i<nsems; i++) {
+                hs[i] = msem_handle_holders(h[i], msem_handle_sem(h[i]));
+                ch[i] = h[i]->engine->changes(msem_handle_sem(h[i]), &flags[i]);
+                __atomic_add_fetch(&ch[i]->nselect, 1, __ATOMIC_SEQ_CST);
+                relaxes[i] = __atomic_load_n(&ch[i]->relaxes, __ATOMIC_SEQ_CST);
+                msem_changed(ch[i], flags[i]);
+        }
+
+        for (;;) {
+                for (i=0; i<nsems; i++) {
+                        seen[i] = __atomic_load_n(&ch[i]->count, __ATOMIC_SEQ_CST);
+                }
+                for (i=0; i<nsems && err == 0; i++) {
+                        if (fired[i]) {
+                                continue;
+                        }
+                        if (__atomic_load_n(&ch[i]->relaxes, __ATOMIC_SEQ_CST) != relaxes[i]) {
+                                /* Released by a relax: no token to take. */
+                                fired[i] = 1;
+                                n++;
+                                continue;
+                        }
+                        if (undo && hs[i] != NULL && (slot = msem_holders_claim(hs[i])) != -1) {
+                                r = h[i]->engine->trylock(msem_handle_sem(h[i]), false);
+                                msem_holders_fill(hs[i], slot, (r == 1) ? 1 : 0);
+                        } else {
+                                r = h[i]->engine->trylock(msem_handle_sem(h[i]), undo);
+                        }
+                        if (r == -1) {
+                                err = errno;
+                        } else if (r == 1) {
+                                fired[i] = 1;
+                                n++;
+                        }
+                }
+                if (n > 0 || err != 0) {
+                        break;
+                }
+                if (dl != NULL && !msem_remaining(dl, &left)) {
+                        err = EAGAIN;
+                        break;
+                }
+                wdl = dl;
+                for (i=0; i<nsems; i++) {
+                        if (hs[i] == NULL || !msem_holders_busy(hs[i], false)) {
+                                continue;
+                        }
+                        msem_handle_reap(h[i], msem_handle_sem(h[i]), hs[i]);
+                        if (wdl != &slice) {
+                                msem_timeout(MSEM_REAP_MS, &rel);
+                                msem_deadline(&rel, &slice);
+                                if (dl == NULL || slice.tv_sec < dl->tv_sec) {
+                                        wdl = &slice;
+                                }
+                        }
+                }
+                if (msem_changes_waitv(ch, seen, flags, nsems, wdl) == -1 && errno != EINTR) {
+                        if (errno == EAGAIN && wdl == &slice) {
+                                continue;
+                        }
+                        err = errno;
+                        break;
+                }
+        }
+
+        for (i=0; i<nsems; i++) {
+                __atomic_sub_fetch(&ch[i]->nselect, 1, __ATOMIC_SEQ_CST);
+                msem_changed(ch[i], flags[i]);
+        }
+
+        if (n > 0) {
+                return n;
+        }
+
+        DEBUG("Selection of %d failed (%d).\n", nsems, err);
+        errno = err;
+
+        return -1;
+}
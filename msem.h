@@ -5,16 +5,138 @@
 #include <sys/ipc.h>
 #include <stdbool.h>
 
+/*
+ * Flags for msem_create_flags.
+ *
+ * MSEM_EDGE   : Edge-triggered. An unlock gives tokens only to
+ *               processes already waiting, so the value never grows
+ *               while no one waits.
+ * MSEM_ORDERED: Ordered. An unlock gives its token to the waiter with
+ *               the highest priority (see msem_lock_priority), then
+ *               the nearest deadline, rather than in kernel order.
+ * MSEM_ROBUST : Robust. Locks and unlocks with undo ("-,", "+,") are
+ *               kept in a table of holders instead of the kernel's
+ *               undo lists, and a dead holder's tokens are put back
+ *               by the next lock that has to wait, on every engine.
+ *               Locks may also be leased (see msem_lease).
+ */
+#define MSEM_EDGE    0x1
+#define MSEM_ORDERED 0x2
+#define MSEM_ROBUST  0x4
+
 int msem_create(char *path, char *tag, int init);
+int msem_create_flags(char *path, char *tag, int init, int flags);
 int msem_exists(char *path, char *tags);
 int msem_open  (char *path, char *tag, int init);
+int msem_open_engine(char *path, char *tag, int init, char *engine);
 int msem_remove(int semid);
 int msem_close (int semid);
 
 bool msem_scan(FILE *file, char *tag, key_t *key, int *semid);
 
 int msem_query(int semid, char *query_code);
+
+/*
+ * What a monitor can see of a semaphore (see msem_watch).
+ *
+ * @value: Value ('v').
+ * @nwait: # of waiters for the value to increase ('n').
+ * @zwait: # of waiters for the value to reach 0 ('z').
+ * @pid  : PID of the last process to change the value ('p').
+ */
+struct msem_state {
+        int value;
+        int nwait;
+        int zwait;
+        int pid;
+};
+
+int msem_watch(int semid, struct msem_state *state, int timeout);
 int msem      (int semid, char *mode, int timeout);
 
+int msem_lock_priority(int semid, char *mode, int priority, int timeout);
+int msem_lease(int semid, char *mode, int lease, int timeout);
+int msem_coalesce(int semid, int window);
+int msem_relax_waves(int semid, int size, int pace, int *released, int max);
+
+long long msem_next(int semid, long long after, int timeout);
+
+/*
+ * Expiry policies for msem_expiry (msem_expiry.c).
+ *
+ * MSEM_EXPIRE_EXACT : A timeout expires when asked (the default).
+ * MSEM_EXPIRE_JITTER: A timeout expires up to a band early, at random.
+ * MSEM_EXPIRE_SPREAD: Timeouts expire up to a band early, spread
+ *                     evenly across it.
+ */
+#define MSEM_EXPIRE_EXACT  0
+#define MSEM_EXPIRE_JITTER 1
+#define MSEM_EXPIRE_SPREAD 2
+
+int msem_expiry(int policy, int band);
+
+
+/*
+ * One entry of a batch (see msem_batch).
+ *
+ * @semid : Handle.
+ * @mode  : As for msem(): "-", "-,", "+", "+," or "+*".
+ * @amount: Tokens to take or give (0 means 1); ignored by "+*".
+ * @result: 1 on success, 0 on failure (filled in).
+ * @error : errno, if @result is 0 (filled in).
+ */
+struct msem_op {
+        int semid;
+        char *mode;
+        int amount;
+        int result;
+        int error;
+};
+
+int msem_batch(struct msem_op *ops, int nops, int timeout);
+
+int msem_acquire(int *semids, int nsems, char *mode, int timeout);
+
+int msem_select(int *semids, int nsems, char *mode, int timeout, int *fired);
+
+
+/*
+ * Wait rings (msem_ring.c): wait to lock many semaphores at once.
+ *
+ * @semid : Handle given to msem_ring_wait.
+ * @result: 1 if the semaphore was locked, 0 if the wait timed out,
+ *          -1 if it failed.
+ * @error : errno, if @result is -1.
+ * @data  : Pointer given to msem_ring_wait.
+ */
+struct msem_ring;
+
+struct msem_ring_event {
+        int semid;
+        int result;
+        int error;
+        void *data;
+};
+
+struct msem_ring *msem_ring_open (unsigned entries);
+int               msem_ring_wait (struct msem_ring *ring, int semid, int timeout, void *data);
+int               msem_ring_reap (struct msem_ring *ring, struct msem_ring_event *events, int max, int timeout);
+void              msem_ring_close(struct msem_ring *ring);
+
+
+/*
+ * Notifiers (msem_notify.c): a file descriptor for a semaphore,
+ * for use with poll, select or epoll.
+ */
+int msem_notify      (int semid, char *mode);
+int msem_notify_close(int fd);
+
+
+/*
+ * Multiplexer (msem_mux.c): many threads of one process waiting on
+ * a semaphore, with only one of them in the kernel.
+ */
+int msem_mux(int semid, char *mode, int timeout);
+
 
 #endif
@@ -3,11 +3,28 @@
 #include <stdbool.h>
 %}
 
+#define MSEM_EDGE    0x1
+#define MSEM_ORDERED 0x2
+#define MSEM_ROBUST  0x4
+
+#define MSEM_EXPIRE_EXACT  0
+#define MSEM_EXPIRE_JITTER 1
+#define MSEM_EXPIRE_SPREAD 2
+
 int msem_create(char *path, char *tag, int init);
+int msem_create_flags(char *path, char *tag, int init, int flags);
 int msem_open  (char *path, char *tag, int init);
+int msem_open_engine(char *path, char *tag, int init, char *engine=NULL);
 int msem_remove(int semid);
 int msem_close (int semid);
 
 int msem_query(int semid, char *query_code);
 int msem      (int semid, char *mode, int timeout=-1);
+int msem_lock_priority(int semid, char *mode, int priority, int timeout=-1);
+int msem_lease(int semid, char *mode, int lease, int timeout=-1);
+int msem_coalesce(int semid, int window);
+int msem_relax_waves(int semid, int size, int pace, int *released=NULL, int max=0);
+
+long long msem_next(int semid, long long after=-1, int timeout=-1);
 
+int msem_expiry(int policy, int band);
@@ -0,0 +1,332 @@
+#ifndef _INCLUDE_MSEM_ENGINE_H
+#define _INCLUDE_MSEM_ENGINE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+
+/******************************************************************************
+ * ENGINES
+ *
+ * The public interface in msem.h deals in small integer handles,
+ * much like file descriptors. Each handle refers to a semaphore
+ * that is implemented by an engine, which supplies the operations
+ * below. The engine is chosen when the semaphore is opened.
+ *
+ * @name  : Name used to select the engine (see MSEM_ENGINE).
+ * @open  : Create or open the semaphore at @path:@tag, setting
+ *          it to @init and giving it the MSEM_ @flags (see msem.h)
+ *          if it is created. If @excl is set, fail with EEXIST
+ *          when it already exists. Returns the engine's private
+ *          state, or NULL on error.
+ * @close : Release the caller's reference and free the state.
+ *          Returns the number of remaining users, or -1.
+ * @remove: Destroy the semaphore. The state must still be closed.
+ * @exists: TRUE if a semaphore exists at @path:@tag.
+ * @query : Answer one of the msem_query() codes, including 'f',
+ *          the flags the semaphore was created with.
+ * @set   : Move the value by @value, waiting at most @ms (if > 0).
+ *          If @undo is set, the change is reverted should the
+ *          process exit. Returns -1 on error (errno EAGAIN on
+ *          timeout), MSEM_RELAXED if a lock was released by a
+ *          relax, else 1. An unlock which fails partway leaves
+ *          the tokens it gave given (see msem_semop_give).
+ * @counter: (optional) The struct msem_counter behind the
+ *          semaphore, for engines that keep one.
+ * @member: (optional) The System V set holding the semaphore,
+ *          with its member number in @num, for engines built on
+ *          System V sets. Operations on several semaphores in one
+ *          set can then be made in a single semop().
+ * @relax : (optional) Release everyone waiting: wake every waiter
+ *          in @await and in @set, and move @changes->relaxes on
+ *          (see msem_changes_relax). Without it, a relax reads the
+ *          waiter count with @query and gives that many tokens
+ *          with @set.
+ * @await : (optional) Wait at most @ms (if > 0) for the next relax.
+ *          Returns -1 on error (errno EAGAIN on timeout), else 1.
+ * @next  : (optional) Wait at most @ms (if > 0) for the sequence
+ *          number, which counts relaxes, to differ from @after.
+ *          Returns it, or -1 on error (errno EAGAIN on timeout).
+ * @changes: (optional) The struct msem_changes of the semaphore,
+ *          which the engine moves on whenever the value, the
+ *          waiter counts or the last PID may have changed, with
+ *          the futex flags to use on it in @flags. Its selectors
+ *          count as waiters in 'n' and in @relax.
+ * @trylock: (optional) Take one token if there is one, without
+ *          waiting. Returns 1 if one was taken, 0 if there was
+ *          none, or -1 on error.
+ * @queue : (optional) The struct msem_queue of the semaphore, with
+ *          the futex flags to use on it in @flags. Without it, the
+ *          engine cannot make ordered semaphores (MSEM_ORDERED).
+ * @holders: (optional) The struct msem_holders of the semaphore.
+ *          Without it, the engine cannot make robust semaphores
+ *          (MSEM_ROBUST).
+ *
+ ******************************************************************************/
+
+struct msem_engine {
+        const char *name;
+        void *(*open)  (char *path, char *tag, int init, bool excl, int flags);
+        int   (*close) (void *sem);
+        int   (*remove)(void *sem);
+        bool  (*exists)(char *path, char *tag);
+        int   (*query) (void *sem, char code);
+        int   (*set)   (void *sem, int value, int ms, bool undo);
+        struct msem_counter *(*counter)(void *sem);
+        int   (*member)(void *sem, unsigned short *num);
+        int   (*relax) (void *sem);
+        int   (*await) (void *sem, int ms);
+        int64_t (*next)(void *sem, int64_t after, int ms);
+        struct msem_changes *(*changes)(void *sem, int *flags);
+        int   (*trylock)(void *sem, bool undo);
+        struct msem_queue *(*queue)(void *sem, int *flags);
+        struct msem_holders *(*holders)(void *sem);
+};
+
+/*
+ * What @set returns for a lock which a relax released, rather than
+ * an unlock: it holds no token of its own, and has none to give
+ * back or to undo.
+ */
+#define MSEM_RELAXED 2
+
+extern const struct msem_engine msem_sysv_engine;
+extern const struct msem_engine msem_futex_engine;
+extern const struct msem_engine msem_posix_engine;
+extern const struct msem_engine msem_local_engine;
+extern const struct msem_engine msem_pool_engine;
+
+
+/******************************************************************************
+ * CHANGES (msem_futex.c)
+ *
+ * A word which moves on whenever the observable state of a
+ * semaphore may have changed, so that a monitor can sleep until
+ * it does (see msem_watch) instead of asking again and again.
+ *
+ * @count  : Moved on at every change (futex).
+ * @nwatch : # of monitors sleeping on @count.
+ * @nselect: # of selectors waiting to lock (see msem_select), which
+ *           sleep on @count rather than in the engine, and which
+ *           the engine counts among its waiters in 'n'.
+ * @relaxes: Moved on at every relax, before @count, so that those
+ *           who sleep on @count can tell they were released.
+ * @window : Milliseconds over which relaxes are merged (see
+ *           msem_coalesce), or 0.
+ * @burst  : End of the burst of relaxes now being merged, in
+ *           CLOCK_MONOTONIC nanoseconds, and whether it owes a
+ *           relax (see msem_changes_merge).
+ *
+ ******************************************************************************/
+
+struct msem_changes {
+        uint32_t count;
+        uint32_t nwatch;
+        uint32_t nselect;
+        uint32_t relaxes;
+        int32_t  window;
+        int64_t  burst;
+};
+
+void msem_changed      (struct msem_changes *ch, int flags);
+int  msem_changes_wait (struct msem_changes *ch, uint32_t seen, int flags, int ms);
+int  msem_changes_waitv(struct msem_changes **chs, const uint32_t *seen, const int *flags, int n, const struct timespec *deadline);
+int  msem_selectors    (struct msem_changes *ch);
+void msem_changes_relax(struct msem_changes *ch, int flags);
+bool msem_changes_merge(struct msem_changes *ch);
+int  msem_changes_due  (struct msem_changes *ch, int64_t *burst);
+int  msem_changes_done (struct msem_changes *ch, int64_t burst);
+
+
+/******************************************************************************
+ * QUEUES (msem_queue.c)
+ *
+ * The waiters of an ordered semaphore (MSEM_ORDERED), each in a
+ * slot of a table kept beside the semaphore, so that an unlock can
+ * choose which of them gets its token.
+ *
+ * @state   : One of the SLOT_ states in msem_queue.c (futex).
+ * @priority: Served before any lower priority.
+ * @amount  : Tokens waited for, all handed over at once.
+ * @pid     : Process waiting; 0 while the slot is filled in or emptied.
+ * @start   : When @pid started (see msem_proc_start).
+ * @deadline: When the wait times out (CLOCK_MONOTONIC, in ns), or
+ *            INT64_MAX for never. Nearer deadlines come first.
+ * @ticket  : Order of arrival, among waiters otherwise equal.
+ *
+ ******************************************************************************/
+
+#define MSEM_QUEUE_SLOTS 64
+
+struct msem_waiter {
+        uint32_t state;
+        int32_t  priority;
+        int32_t  amount;
+        pid_t    pid;
+        uint64_t start;
+        int64_t  deadline;
+        uint64_t ticket;
+};
+
+struct msem_queue {
+        uint64_t ticket;
+        struct msem_waiter slot[MSEM_QUEUE_SLOTS];
+};
+
+int msem_queue_lock (const struct msem_engine *engine, void *sem, int amount, int priority, int ms, bool undo);
+int msem_queue_give (const struct msem_engine *engine, void *sem, int amount, bool undo);
+int msem_queue_relax(const struct msem_engine *engine, void *sem);
+int msem_queue_count(struct msem_queue *q);
+
+
+/******************************************************************************
+ * HOLDERS (msem_holders.c)
+ *
+ * Who holds the tokens of a robust semaphore (MSEM_ROBUST), taken or
+ * given "with undo", or under a lease (see msem_lease), so that those
+ * of a process which has died or hung can be reclaimed without the
+ * kernel's undo lists.
+ *
+ * @own  : PID of the holder, and the tokens to give back if it dies
+ *         (negative: to take back), changed together (see
+ *         msem_holders.c); 0 if the slot is free.
+ * @start: When the holder started (see proc(5), starttime), to tell
+ *         it from a later process with the same PID; 0 if unknown.
+ * @lease: When the holder's lease runs out, in CLOCK_MONOTONIC
+ *         nanoseconds, if the slot is a lease.
+ * @count: # of slots in use.
+ * @reclaimed: # of tokens reclaimed from dead holders and expired
+ *         leases (see msem_query, 'r').
+ *
+ ******************************************************************************/
+
+#define MSEM_HOLDER_SLOTS 128
+
+struct msem_holder {
+        uint64_t own;
+        uint64_t start;
+        int64_t  lease;
+};
+
+struct msem_holders {
+        uint32_t count;
+        uint32_t reclaimed;
+        struct msem_holder slot[MSEM_HOLDER_SLOTS];
+};
+
+bool msem_holders_add  (struct msem_holders *hs, int amount);
+int  msem_holders_claim(struct msem_holders *hs);
+bool msem_holders_fill (struct msem_holders *hs, int slot, int amount);
+bool msem_holders_lease(struct msem_holders *hs, int amount, int64_t deadline);
+bool msem_holders_renew(struct msem_holders *hs, int64_t deadline);
+int  msem_holders_reclaimed(struct msem_holders *hs);
+bool msem_holders_busy (struct msem_holders *hs, bool claimed);
+bool msem_holders_room (struct msem_holders *hs);
+bool msem_holders_reap (struct msem_holders *hs, int *amount);
+
+uint64_t msem_proc_start(pid_t pid);
+uint64_t msem_proc_self (void);
+bool     msem_proc_dead (pid_t pid, uint64_t start);
+
+
+/******************************************************************************
+ * COUNTERS (msem_futex.c)
+ *
+ * A counting semaphore operated with atomics, which enters the
+ * kernel only to sleep or to wake a sleeper. It may live in a
+ * shared segment or in private memory.
+ *
+ * @ready      : 0 until the creator has initialized @value (futex).
+ * @value      : The actual semaphore value (futex).
+ * @nwait      : # of lock waiters, sleeping until @value is
+ *               positive or @gen moves.
+ * @pid        : PID of the last process to change @value.
+ * @futex_flags: FUTEX_PRIVATE_FLAG if the counter is never shared
+ *               with another process, else 0.
+ * @otime      : Time of the last change to @value.
+ * @ctime      : Time the counter was initialized.
+ * @gen        : Generation, counting relaxes (futex).
+ * @gwait      : # of waiters sleeping until @gen moves, lock
+ *               waiters among them.
+ * @seq        : Sequence number, counting relaxes without wrapping.
+ * @flags      : MSEM_ flags given when the counter was created.
+ * @changes    : Moved on at every change to @value, @nwait or @pid.
+ * @queue      : Waiters, if the counter is ordered (MSEM_ORDERED).
+ * @holders    : Holders, if the counter is robust (MSEM_ROBUST).
+ *
+ ******************************************************************************/
+
+struct msem_counter {
+        uint32_t ready;
+        int32_t  value;
+        uint32_t nwait;
+        pid_t    pid;
+        int32_t  futex_flags;
+        int64_t  otime;
+        int64_t  ctime;
+        uint32_t gen;
+        uint32_t gwait;
+        uint64_t seq;
+        int32_t  flags;
+        struct msem_changes changes;
+        struct msem_queue queue;
+        struct msem_holders holders;
+};
+
+int  msem_counter_query  (struct msem_counter *c, char code);
+int  msem_counter_set    (struct msem_counter *c, pid_t self, int value, int ms);
+bool msem_counter_trylock(struct msem_counter *c, pid_t self, int32_t *seen);
+int  msem_counter_relax  (struct msem_counter *c, pid_t self);
+int  msem_counter_await  (struct msem_counter *c, int ms);
+int64_t msem_counter_next(struct msem_counter *c, int64_t after, int ms);
+
+int  msem_ready_wait(uint32_t *ready, int shmid);
+void msem_ready_set (uint32_t *ready);
+
+void    msem_gen_bump(uint32_t *gen, uint32_t *gwait, uint64_t *seq, int flags);
+int     msem_gen_wait(uint32_t *gen, uint32_t *gwait, int flags, int ms);
+int64_t msem_gen_next(uint32_t *gen, uint32_t *gwait, uint64_t *seq, int flags, int64_t after, int ms);
+void    msem_gen_post (uint32_t *word, uint32_t *nwait, int n, int flags);
+int     msem_gen_sleep(uint32_t *word, uint32_t seen, uint32_t *gen, uint32_t gseen, int flags, const struct timespec *deadline);
+
+
+/******************************************************************************
+ * SYSTEM V HELPERS (msem_sysv.c)
+ ******************************************************************************/
+
+/* Largest value of a System V semaphore, and of one operation (SEMVMX). */
+#define MSEM_SEMVMX 32767
+
+struct sembuf;
+
+int msem_operation(int semid, struct sembuf *sops, size_t nsops, const struct timespec *timeout);
+int msem_semop_give(int semid, unsigned short num, int value, bool undo);
+
+
+/******************************************************************************
+ * HELPERS SHARED BY ENGINES (msem.c)
+ ******************************************************************************/
+
+int msem_key(char *path, int tag, bool create);
+
+int msem_hold(int semid);
+int msem_take(int semid, bool undo, int timeout);
+
+struct msem_counter *msem_counter_of(int semid);
+struct msem_changes *msem_changes_of(int semid, int *flags);
+int                  msem_try(int semid);
+
+struct timespec *msem_timeout(int ms, struct timespec *timeout);
+void             msem_deadline(const struct timespec *timeout, struct timespec *deadline);
+bool             msem_remaining(const struct timespec *deadline, struct timespec *left);
+
+
+/******************************************************************************
+ * EXPIRY (msem_expiry.c)
+ ******************************************************************************/
+
+int msem_expire(int ms);
+
+
+#endif
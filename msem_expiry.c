@@ -0,0 +1,233 @@
+#define _JDL_NO_PRINT_DEBUG
+#define _JDL_NO_PRINT_WARN
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <j/debug.h>
+#include "msem.h"
+#include "msem_engine.h"
+
+/******************************************************************************
+ * EXPIRY POLICIES
+ *
+ * Clients which start waiting together with the same timeout (a
+ * long poll, say, of `msem -p <path> <tag> 30000`) time out
+ * together, come back together, and so stay in step for as long as
+ * nothing wakes them. An expiry policy breaks the step by cutting
+ * each timeout short by up to a band of milliseconds:
+ *
+ *      jitter  by a random amount, drawn afresh for each wait
+ *      spread  by successive points of a sequence which fills the
+ *              band evenly, from a random start in each process
+ *
+ * A timeout is never made longer, and never cut by more than half,
+ * so a short wait is not cut to nothing by a wide band. Waits with
+ * no timeout are left alone.
+ *
+ * The policy is the process's own: set it with msem_expiry, or in
+ * the MSEM_EXPIRY environment variable ("jitter:<band>" or
+ * "spread:<band>"), which lets existing callers use it without
+ * changing any code.
+ *
+ ******************************************************************************/
+
+/* The fractional part of the golden ratio. */
+#define EXPIRY_PHI 0.6180339887498949
+
+static int expiry_policy = MSEM_EXPIRE_EXACT;
+static int expiry_band;
+static double expiry_phase;
+static uint32_t expiry_turn;
+
+static pthread_once_t expiry_once = PTHREAD_ONCE_INIT;
+
+/* Each thread draws from its own generator. */
+static __thread uint64_t expiry_state;
+
+
+
+/******************************************************************************
+ * RANDOMNESS
+ ******************************************************************************/
+
+/**
+ * expiry_mix
+ * ``````````
+ * Scramble a 64-bit word (the finalizer of splitmix64).
+ *
+ * @x    : Word.
+ * Return: Scrambled word.
+ */
+static uint64_t expiry_mix(uint64_t x)
+{
+        x += 0x9e3779b97f4a7c15ULL;
+        x  = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        x  = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+
+        return x ^ (x >> 31);
+}
+
+
+/**
+ * expiry_random
+ * `````````````
+ * Draw a number from the calling thread's generator.
+ *
+ * Return: Uniform in [0, 1).
+ *
+ * NOTE
+ * The generator (xorshift64*) is seeded from the PID, the clock
+ * and the thread, so processes started in the same instant do not
+ * draw the same numbers, as they would from a generator seeded
+ * with time(2) alone.
+ */
+static double expiry_random(void)
+{
+        struct timespec now;
+        uint64_t x;
+
+        if (expiry_state == 0) {
+                clock_gettime(CLOCK_MONOTONIC, &now);
+                x = ((uint64_t)getpid() << 32) ^ (uint64_t)now.tv_sec ^ (uint64_t)now.tv_nsec;
+                x = expiry_mix(x ^ (uint64_t)(uintptr_t)&expiry_state);
+                expiry_state = (x != 0) ? x : 1;
+        }
+
+        x  = expiry_state;
+        x ^= x >> 12;
+        x ^= x << 25;
+        x ^= x >> 27;
+        expiry_state = x;
+
+        return (double)((x * 0x2545f4914f6cdd1dULL) >> 11) / (double)(1ULL << 53);
+}
+
+
+
+/******************************************************************************
+ * POLICY
+ ******************************************************************************/
+
+/**
+ * expiry_init
+ * ```````````
+ * Read the policy from the MSEM_EXPIRY environment variable.
+ *
+ * Return: Nothing.
+ */
+static void expiry_init(void)
+{
+        char *env;
+        char *band;
+
+        expiry_phase = expiry_random();
+
+        if ((env = getenv("MSEM_EXPIRY")) == NULL || *env == '\0') {
+                return;
+        }
+
+        band = strchr(env, ':');
+
+        if (!strncmp(env, "jitter", 6) && band != NULL) {
+                expiry_policy = MSEM_EXPIRE_JITTER;
+        } else if (!strncmp(env, "spread", 6) && band != NULL) {
+                expiry_policy = MSEM_EXPIRE_SPREAD;
+        } else if (strcmp(env, "exact") != 0) {
+                WARN("Unknown expiry policy '%s'.\n", env);
+                return;
+        }
+
+        if (band != NULL && (expiry_band = atoi(band + 1)) <= 0) {
+                expiry_policy = MSEM_EXPIRE_EXACT;
+                expiry_band   = 0;
+        }
+}
+
+
+/**
+ * msem_expire
+ * ```````````
+ * Apply the process's expiry policy to a timeout.
+ *
+ * @ms   : Milliseconds before timeout (<= 0 for no timeout).
+ * Return: Milliseconds before timeout under the policy.
+ */
+int msem_expire(int ms)
+{
+        int policy;
+        int cut;
+        double at;
+
+        pthread_once(&expiry_once, expiry_init);
+
+        if (ms <= 0 || (policy = __atomic_load_n(&expiry_policy, __ATOMIC_ACQUIRE)) == MSEM_EXPIRE_EXACT) {
+                return ms;
+        }
+
+        cut = __atomic_load_n(&expiry_band, __ATOMIC_RELAXED);
+        cut = (cut < ms / 2) ? cut : ms / 2;
+
+        if (policy == MSEM_EXPIRE_SPREAD) {
+                at = expiry_phase + __atomic_fetch_add(&expiry_turn, 1, __ATOMIC_RELAXED) * EXPIRY_PHI;
+                at = at - (double)(int64_t)at;
+        } else {
+                at = expiry_random();
+        }
+
+        return ms - (int)(at * cut);
+}
+
+
+
+/******************************************************************************
+ * PUBLIC INTERFACE
+ ******************************************************************************/
+
+/**
+ * msem_expiry
+ * ```````````
+ * Set how the timeouts of this process's waits expire.
+ *
+ * @policy: One of
+ *          MSEM_EXPIRE_EXACT  when asked
+ *          MSEM_EXPIRE_JITTER up to @band ms early, at random
+ *          MSEM_EXPIRE_SPREAD up to @band ms early, spread evenly
+ * @band  : Milliseconds by which a timeout may be cut short.
+ * Return : 0 on success, -1 (errno EINVAL) on a bad @policy or @band.
+ *
+ * NOTE
+ * This overrides MSEM_EXPIRY, and applies to every wait made from
+ * then on: locks, relax waits (msem_next), batches, msem_acquire,
+ * msem_select and wait rings.
+ *
+ * Under MSEM_EXPIRE_SPREAD, the waits of one process take turns
+ * along the band, each about 0.618 of it on from the last (the
+ * golden ratio), so any run of them lands nearly evenly across it,
+ * where random draws would bunch. Processes start at random points.
+ */
+int msem_expiry(int policy, int band)
+{
+        if (policy != MSEM_EXPIRE_EXACT && policy != MSEM_EXPIRE_JITTER && policy != MSEM_EXPIRE_SPREAD) {
+                WARN("Unknown expiry policy %d.\n", policy);
+                errno = EINVAL;
+                return -1;
+        }
+        if (policy != MSEM_EXPIRE_EXACT && band <= 0) {
+                WARN("An expiry band must be positive.\n");
+                errno = EINVAL;
+                return -1;
+        }
+
+        pthread_once(&expiry_once, expiry_init);
+
+        __atomic_store_n(&expiry_band, band, __ATOMIC_RELAXED);
+        __atomic_store_n(&expiry_policy, policy, __ATOMIC_RELEASE);
+
+        return 0;
+}
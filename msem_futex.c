@@ -0,0 +1,1252 @@
+#define _JDL_NO_PRINT_DEBUG
+#define _JDL_NO_PRINT_WARN
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <linux/time_types.h>
+#include <errno.h>
+#include <j/time.h>
+#include <j/debug.h>
+#include "msem.h"
+#include "msem_engine.h"
+
+/******************************************************************************
+ * FUTEX ENGINE
+ *
+ * The semaphore is a counter in a System V shared memory segment,
+ * keyed as the semaphore sets are (see msem_key), but with the top
+ * bit of the tag set (FUTEX_KEY_BIT), so that it is never the
+ * header of the System V engine's semaphore of the same name. Locking
+ * and unlocking are atomic operations on the counter; the kernel
+ * is entered only to sleep when there are no tokens, or to wake
+ * a sleeper when tokens are returned.
+ *
+ * An uncontended lock or unlock makes no system calls.
+ *
+ * NOTE
+ * There is no kernel undo for a counter in shared memory, so the
+ * "with undo" operations behave exactly like the plain ones.
+ *
+ ******************************************************************************/
+
+/*
+ * Set in the tag of every key, to keep the counters apart from the
+ * System V engine's headers. Tags are ASCII.
+ */
+#define FUTEX_KEY_BIT 0x80
+
+/*
+ * The private state of an open semaphore.
+ */
+struct msem_futex {
+        int shmid;
+        pid_t self;
+        struct msem_counter *shm;
+};
+
+
+/* How long an opener waits for the creator to initialize a segment. */
+#define READY_MS 1000
+
+/*
+ * Set in a ready flag, with the PID of an opener who has taken over
+ * initializing the segment from a creator that died (see
+ * msem_ready_wait).
+ */
+#define READY_TAKEN 0x80000000u
+
+/*
+ * Set in a ready flag, with the PID of the last process attached,
+ * while it decides whether to remove the segment (see futex_close).
+ */
+#define READY_GONE 0x40000000u
+
+/* Not yet in every copy of the system headers. */
+#ifndef SYS_futex_waitv
+#define SYS_futex_waitv 449
+#endif
+
+
+
+/******************************************************************************
+ * UTILITY FUNCTIONS
+ ******************************************************************************/
+
+/**
+ * futex_wait
+ * ``````````
+ * Sleep while *@addr equals @val.
+ *
+ * @addr   : Futex word.
+ * @val    : Expected value.
+ * @timeout: Relative timeout, or NULL to wait indefinitely.
+ * @flags  : FUTEX_PRIVATE_FLAG if @addr is never shared with
+ *           another process, else 0.
+ * Return  : -1 on error (errno ETIMEDOUT, EAGAIN, EINTR), else 0.
+ */
+static int futex_wait(void *addr, uint32_t val, const struct timespec *timeout, int flags)
+{
+        return syscall(SYS_futex, addr, FUTEX_WAIT|flags, val, timeout, NULL, 0);
+}
+
+
+/**
+ * futex_wake
+ * ``````````
+ * Wake up to @n waiters sleeping on @addr.
+ *
+ * @addr : Futex word.
+ * @n    : Maximum number of waiters to wake.
+ * @flags: As for futex_wait.
+ * Return: Number woken, or -1 on error.
+ */
+static int futex_wake(void *addr, int n, int flags)
+{
+        return syscall(SYS_futex, addr, FUTEX_WAKE|flags, n, NULL, NULL, 0);
+}
+
+
+/**
+ * msem_ready_wait
+ * ```````````````
+ * Wait for the creator of a shared segment to finish initializing
+ * it (see msem_ready_set), or take over from it if it has died.
+ *
+ * @ready: Ready flag of the segment (futex).
+ * @shmid: The segment, whose creator (shm_cpid) initializes it.
+ * Return: 1 once ready; 0 if the caller has taken over, and must
+ *         initialize the segment and then call msem_ready_set; -1
+ *         (errno ETIMEDOUT) if a live initializer never finished.
+ *
+ * NOTE
+ * An initializer that dies leaves the flag 0 (or taken, with its
+ * PID) for good. Whoever times out waiting for it and finds it
+ * dead takes the flag over, with one compare-and-swap, so only one
+ * opener initializes; the rest wait READY_MS more for that one.
+ *
+ * A flag marked gone belongs to a last user that is closing the
+ * segment. The caller waits for it to decide, and fails with
+ * EIDRM once the segment is removed, so as to open a new one. A
+ * closer that died deciding had not removed it, and the flag is
+ * put back.
+ */
+int msem_ready_wait(uint32_t *ready, int shmid)
+{
+        struct shmid_ds ds;
+        struct timespec timeout;
+        struct timespec deadline;
+        struct timespec left;
+        uint32_t seen;
+        uint32_t last;
+        pid_t pid;
+
+        msem_deadline(msem_timeout(READY_MS, &timeout), &deadline);
+
+        last = __atomic_load_n(ready, __ATOMIC_ACQUIRE);
+
+        while ((seen = __atomic_load_n(ready, __ATOMIC_ACQUIRE)) != 1) {
+                if (seen & READY_GONE) {
+                        if (shmctl(shmid, IPC_STAT, &ds) == -1 || (ds.shm_perm.mode & SHM_DEST)) {
+                                errno = EIDRM;
+                                return -1;
+                        }
+                        if (msem_proc_dead((pid_t)(seen & ~READY_GONE), 0)) {
+                                WARN("Last user of segment %d died closing it.\n", shmid);
+                                __atomic_compare_exchange_n(ready, &seen, 1, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+                                futex_wake(ready, INT_MAX, 0);
+                        } else {
+                                futex_wait(ready, seen, msem_timeout(READY_MS, &timeout), 0);
+                        }
+                        continue;
+                }
+                if (seen != last) {
+                        /* Taken over meanwhile: give the new initializer its time. */
+                        msem_deadline(msem_timeout(READY_MS, &timeout), &deadline);
+                        last = seen;
+                }
+                if (msem_remaining(&deadline, &left)) {
+                        futex_wait(ready, seen, &left, 0);
+                        continue;
+                }
+
+                if (seen & READY_TAKEN) {
+                        pid = (pid_t)(seen & ~READY_TAKEN);
+                } else if (shmctl(shmid, IPC_STAT, &ds) == 0) {
+                        pid = ds.shm_cpid;
+                } else {
+                        return -1;
+                }
+                if (!msem_proc_dead(pid, 0)) {
+                        errno = ETIMEDOUT;
+                        return -1;
+                }
+                if (__atomic_compare_exchange_n(ready, &seen, READY_TAKEN | (uint32_t)getpid(), false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+                        WARN("Initializer %d of segment %d died; taking over.\n", pid, shmid);
+                        futex_wake(ready, INT_MAX, 0);
+                        return 0;
+                }
+        }
+
+        return 1;
+}
+
+
+/**
+ * msem_ready_set
+ * ``````````````
+ * Mark a shared segment initialized, and wake those waiting for it.
+ *
+ * @ready: Ready flag of the segment (futex).
+ * Return: Nothing.
+ */
+void msem_ready_set(uint32_t *ready)
+{
+        __atomic_store_n(ready, 1, __ATOMIC_RELEASE);
+        futex_wake(ready, INT_MAX, 0);
+}
+
+
+
+/******************************************************************************
+ * COUNTERS
+ *
+ * The semaphore proper. These work on any struct msem_counter,
+ * whether it lives in a shared segment or in private memory.
+ *
+ ******************************************************************************/
+
+/**
+ * msem_counter_query
+ * ``````````````````
+ * Answer one of the msem_query() codes.
+ *
+ * @c    : Counter.
+ * @code : Query code.
+ * Return: Answer, or -1 on error.
+ *
+ * NOTE
+ * Nothing waits for the value to reach zero, so 'z' is always 0,
+ * and there are no control operations after creation, so 'c' is
+ * the time the semaphore was created.
+ */
+int msem_counter_query(struct msem_counter *c, char code)
+{
+        switch (code) {
+        case 'v':
+                return (int)__atomic_load_n(&c->value, __ATOMIC_RELAXED);
+        case 'p':
+                return (int)__atomic_load_n(&c->pid, __ATOMIC_RELAXED);
+        case 'n':
+                return (int)__atomic_load_n(&c->nwait, __ATOMIC_RELAXED) + msem_selectors(&c->changes);
+        case 'z':
+                return 0;
+        case 'o':
+                return (int)__atomic_load_n(&c->otime, __ATOMIC_RELAXED);
+        case 'c':
+                return (int)__atomic_load_n(&c->ctime, __ATOMIC_RELAXED);
+        case 'f':
+                return (int)c->flags;
+        default:
+                WARN("Invalid query_code\n");
+                return -1;
+        }
+}
+
+
+/**
+ * msem_counter_set
+ * ````````````````
+ * Alter a semaphore's value by some amount.
+ *
+ * @c    : Counter.
+ * @self : PID to record as the last to change the value.
+ * @value: Value to move semaphore.
+ * @ms   : Milliseconds before timeout.
+ * Return: -1 on error (errno EAGAIN on timeout), MSEM_RELAXED if
+ *         a relax released the lock, else 1.
+ *
+ * NOTE
+ * A waiter counts itself in @nwait before it sleeps, and the
+ * waker checks @nwait after it has changed @value. Both are
+ * sequentially consistent, so either the waker sees the waiter
+ * and wakes it, or the waiter sees the new value and the kernel
+ * refuses to put it to sleep.
+ *
+ * A lock waiter also sleeps on the generation, read before the
+ * value, and a relax made since lets it through without a token
+ * (see msem_counter_relax).
+ */
+int msem_counter_set(struct msem_counter *c, pid_t self, int value, int ms)
+{
+        struct timespec timeout;
+        struct timespec deadline;
+        struct timespec left;
+        uint32_t gen;
+        int32_t v;
+        int r;
+
+        if (value == 0) {
+                WARN("Semaphore operation value 0 not permitted.\n");
+                return -1;
+        }
+
+        if (value > 0) {
+                __atomic_add_fetch(&c->value, value, __ATOMIC_SEQ_CST);
+                msem_changed(&c->changes, c->futex_flags);
+                if (__atomic_load_n(&c->nwait, __ATOMIC_SEQ_CST) > 0) {
+                        futex_wake(&c->value, value, c->futex_flags);
+                }
+                goto done;
+        }
+
+        if (msem_timeout(ms, &timeout) != NULL) {
+                msem_deadline(&timeout, &deadline);
+        }
+
+        gen = __atomic_load_n(&c->gen, __ATOMIC_SEQ_CST);
+        v   = __atomic_load_n(&c->value, __ATOMIC_SEQ_CST);
+
+        for (;;) {
+                /*
+                 * Fast path: enough tokens, take them.
+                 */
+                if (v >= -value) {
+                        if (__atomic_compare_exchange_n(&c->value, &v, v + value, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+                                goto done;
+                        }
+                        continue;
+                }
+
+                /*
+                 * Released by a relax since the lock began.
+                 */
+                if (__atomic_load_n(&c->gen, __ATOMIC_SEQ_CST) != gen) {
+                        return MSEM_RELAXED;
+                }
+
+                /*
+                 * Slow path: sleep until the value or the generation changes.
+                 */
+                if (ms > 0 && !msem_remaining(&deadline, &left)) {
+                        DEBUG("Timed out after %dms.\n", ms);
+                        errno = EAGAIN;
+                        return -1;
+                }
+
+                __atomic_add_fetch(&c->nwait, 1, __ATOMIC_SEQ_CST);
+                __atomic_add_fetch(&c->gwait, 1, __ATOMIC_SEQ_CST);
+                msem_changed(&c->changes, c->futex_flags);
+
+                r = msem_gen_sleep((uint32_t *)&c->value, (uint32_t)v, &c->gen, gen, c->futex_flags, (ms > 0) ? &deadline : NULL);
+
+                __atomic_sub_fetch(&c->gwait, 1, __ATOMIC_SEQ_CST);
+                __atomic_sub_fetch(&c->nwait, 1, __ATOMIC_SEQ_CST);
+                msem_changed(&c->changes, c->futex_flags);
+
+                if (r == -1 && errno == EINTR && ms <= 0) {
+                        return -1;
+                }
+
+                v = __atomic_load_n(&c->value, __ATOMIC_SEQ_CST);
+        }
+
+done:
+        __atomic_store_n(&c->pid, self, __ATOMIC_RELAXED);
+        __atomic_store_n(&c->otime, (int64_t)time(NULL), __ATOMIC_RELAXED);
+        msem_changed(&c->changes, c->futex_flags);
+
+        return 1;
+}
+
+
+
+/**
+ * msem_counter_trylock
+ * ````````````````````
+ * Take one token if there is one, without ever sleeping.
+ *
+ * @c    : Counter.
+ * @self : PID to record as the last to change the value.
+ * @seen : The value that was found, if there was no token.
+ * Return: TRUE if a token was taken, else FALSE.
+ *
+ * NOTE
+ * A caller that goes on to sleep must sleep on @seen, so that
+ * any unlock after this call is noticed.
+ */
+bool msem_counter_trylock(struct msem_counter *c, pid_t self, int32_t *seen)
+{
+        int32_t v = __atomic_load_n(&c->value, __ATOMIC_SEQ_CST);
+
+        while (v > 0) {
+                if (__atomic_compare_exchange_n(&c->value, &v, v - 1, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+                        __atomic_store_n(&c->pid, self, __ATOMIC_RELAXED);
+                        __atomic_store_n(&c->otime, (int64_t)time(NULL), __ATOMIC_RELAXED);
+                        msem_changed(&c->changes, c->futex_flags);
+                        return true;
+                }
+        }
+
+        *seen = v;
+
+        return false;
+}
+
+
+
+/**
+ * msem_counter_relax
+ * ``````````````````
+ * Release everyone waiting on a counter.
+ *
+ * @c    : Counter.
+ * @self : PID to record as the last to change the value.
+ * Return: 1.
+ *
+ * NOTE
+ * Waiters in msem_counter_await are woken exactly (see
+ * msem_gen_bump), and so are those in msem_counter_set, which
+ * sleep on the generation too: each goes through as if it had
+ * been given a token and taken it, and the value is left alone.
+ * A waiter which times out, or dies, before it is woken takes
+ * nothing, so no token is ever left over.
+ */
+int msem_counter_relax(struct msem_counter *c, pid_t self)
+{
+        msem_gen_bump(&c->gen, &c->gwait, &c->seq, c->futex_flags);
+
+        __atomic_store_n(&c->pid, self, __ATOMIC_RELAXED);
+        __atomic_store_n(&c->otime, (int64_t)time(NULL), __ATOMIC_RELAXED);
+        msem_changes_relax(&c->changes, c->futex_flags);
+
+        return 1;
+}
+
+
+int msem_counter_await(struct msem_counter *c, int ms)
+{
+        return msem_gen_wait(&c->gen, &c->gwait, c->futex_flags, ms);
+}
+
+
+int64_t msem_counter_next(struct msem_counter *c, int64_t after, int ms)
+{
+        return msem_gen_next(&c->gen, &c->gwait, &c->seq, c->futex_flags, after, ms);
+}
+
+
+
+/******************************************************************************
+ * GENERATIONS
+ *
+ * A generation is a word which moves on at every relax. To wait
+ * for the next relax, read it and sleep until it changes: since
+ * the kernel will not put a waiter to sleep if the word no longer
+ * holds the value it read, no relax can be missed, and since every
+ * relax wakes every sleeper, exactly the waiters present at the
+ * relax are woken, and no token is left over for anyone else.
+ *
+ * Beside the generation is a sequence number, which also moves on
+ * at every relax but is 64 bits wide and never wraps, so a caller
+ * can say which relax it last saw (see msem_gen_next). A futex
+ * word is 32 bits, so the generation is still what sleepers wait
+ * on.
+ *
+ ******************************************************************************/
+
+/**
+ * msem_gen_bump
+ * `````````````
+ * Move a generation on, waking everyone waiting for it to move.
+ *
+ * @gen  : Generation word.
+ * @gwait: # of waiters on @gen.
+ * @seq  : Sequence number, moved on first.
+ * @flags: As for futex_wait.
+ * Return: Nothing.
+ */
+void msem_gen_bump(uint32_t *gen, uint32_t *gwait, uint64_t *seq, int flags)
+{
+        __atomic_add_fetch(seq, 1, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(gen, 1, __ATOMIC_SEQ_CST);
+
+        if (__atomic_load_n(gwait, __ATOMIC_SEQ_CST) > 0) {
+                futex_wake(gen, INT_MAX, flags);
+        }
+}
+
+
+/**
+ * msem_gen_wait
+ * `````````````
+ * Wait for a generation to move on.
+ *
+ * @gen  : Generation word.
+ * @gwait: # of waiters on @gen.
+ * @flags: As for futex_wait.
+ * @ms   : Milliseconds before timeout.
+ * Return: -1 on error (errno EAGAIN on timeout), else 1.
+ */
+int msem_gen_wait(uint32_t *gen, uint32_t *gwait, int flags, int ms)
+{
+        struct timespec timeout;
+        struct timespec deadline;
+        struct timespec left;
+        uint32_t seen;
+        int r = 1;
+
+        if (msem_timeout(ms, &timeout) != NULL) {
+                msem_deadline(&timeout, &deadline);
+        }
+
+        __atomic_add_fetch(gwait, 1, __ATOMIC_SEQ_CST);
+
+        seen = __atomic_load_n(gen, __ATOMIC_SEQ_CST);
+
+        while (__atomic_load_n(gen, __ATOMIC_SEQ_CST) == seen) {
+                if (ms > 0 && !msem_remaining(&deadline, &left)) {
+                        errno = EAGAIN;
+                        r = -1;
+                        break;
+                }
+                if (futex_wait(gen, seen, (ms > 0) ? &left : NULL, flags) == -1) {
+                        if (errno == EINTR && ms <= 0) {
+                                r = -1;
+                                break;
+                        }
+                }
+        }
+
+        __atomic_sub_fetch(gwait, 1, __ATOMIC_SEQ_CST);
+
+        return r;
+}
+
+
+
+/**
+ * msem_gen_next
+ * `````````````
+ * Wait for a sequence number to differ from one already seen.
+ *
+ * @gen  : Generation word.
+ * @gwait: # of waiters on @gen.
+ * @seq  : Sequence number.
+ * @flags: As for futex_wait.
+ * @after: Sequence number the caller last saw.
+ * @ms   : Milliseconds before timeout.
+ * Return: The new sequence number, or -1 on error (errno EAGAIN
+ *         on timeout).
+ *
+ * NOTE
+ * The generation is read before the sequence number, and
+ * msem_gen_bump moves them in the opposite order, so a relax
+ * which the sequence number does not yet show will still find
+ * the generation unmoved, and the kernel will not let us sleep.
+ */
+int64_t msem_gen_next(uint32_t *gen, uint32_t *gwait, uint64_t *seq, int flags, int64_t after, int ms)
+{
+        struct timespec timeout;
+        struct timespec deadline;
+        struct timespec left;
+        uint32_t seen;
+        int64_t r;
+
+        if (msem_timeout(ms, &timeout) != NULL) {
+                msem_deadline(&timeout, &deadline);
+        }
+
+        __atomic_add_fetch(gwait, 1, __ATOMIC_SEQ_CST);
+
+        for (;;) {
+                seen = __atomic_load_n(gen, __ATOMIC_SEQ_CST);
+
+                if ((r = (int64_t)__atomic_load_n(seq, __ATOMIC_SEQ_CST)) != after) {
+                        break;
+                }
+                if (ms > 0 && !msem_remaining(&deadline, &left)) {
+                        errno = EAGAIN;
+                        r = -1;
+                        break;
+                }
+                if (futex_wait(gen, seen, (ms > 0) ? &left : NULL, flags) == -1) {
+                        if (errno == EINTR && ms <= 0) {
+                                r = -1;
+                                break;
+                        }
+                }
+        }
+
+        __atomic_sub_fetch(gwait, 1, __ATOMIC_SEQ_CST);
+
+        return r;
+}
+
+
+
+/**
+ * msem_gen_post
+ * `````````````
+ * Move a word on, waking up to @n of those sleeping on it.
+ *
+ * @word : Futex word.
+ * @nwait: # of those sleeping on @word.
+ * @n    : Most to wake.
+ * @flags: As for futex_wait.
+ * Return: Nothing.
+ */
+void msem_gen_post(uint32_t *word, uint32_t *nwait, int n, int flags)
+{
+        __atomic_add_fetch(word, 1, __ATOMIC_SEQ_CST);
+
+        if (__atomic_load_n(nwait, __ATOMIC_SEQ_CST) > 0) {
+                futex_wake(word, n, flags);
+        }
+}
+
+
+/**
+ * msem_gen_sleep
+ * ``````````````
+ * Sleep until a word moves past @seen, or a generation past @gseen.
+ *
+ * @word    : Futex word.
+ * @seen    : Value of @word to sleep on.
+ * @gen     : Generation word.
+ * @gseen   : Value of @gen to sleep on, read before @seen.
+ * @flags   : As for futex_wait.
+ * @deadline: Absolute CLOCK_MONOTONIC deadline, or NULL for none.
+ * Return   : -1 on error (errno EAGAIN on timeout, EINTR), else 0.
+ *
+ * NOTE
+ * The caller counts itself in the waiters of @gen first, so that
+ * msem_gen_bump wakes it. One futex_waitv(2) sleeps on both.
+ */
+int msem_gen_sleep(uint32_t *word, uint32_t seen, uint32_t *gen, uint32_t gseen, int flags, const struct timespec *deadline)
+{
+        struct futex_waitv waiters[2];
+        struct __kernel_timespec ts;
+
+        waiters[0].val        = seen;
+        waiters[0].uaddr      = (uintptr_t)word;
+        waiters[0].flags      = FUTEX_32 | (flags & FUTEX_PRIVATE_FLAG);
+        waiters[0].__reserved = 0;
+
+        waiters[1].val        = gseen;
+        waiters[1].uaddr      = (uintptr_t)gen;
+        waiters[1].flags      = FUTEX_32 | (flags & FUTEX_PRIVATE_FLAG);
+        waiters[1].__reserved = 0;
+
+        if (deadline != NULL) {
+                ts.tv_sec  = deadline->tv_sec;
+                ts.tv_nsec = deadline->tv_nsec;
+        }
+
+        if (syscall(SYS_futex_waitv, waiters, 2, 0, (deadline != NULL) ? &ts : NULL, CLOCK_MONOTONIC) == -1) {
+                if (errno == ETIMEDOUT) {
+                        errno = EAGAIN;
+                        return -1;
+                }
+                if (errno == EINTR) {
+                        return -1;
+                }
+                /* EAGAIN: one of them had already moved. */
+        }
+
+        return 0;
+}
+
+
+
+/******************************************************************************
+ * CHANGES
+ *
+ * Like a generation, but moved on at every change rather than at
+ * every relax, and waited on by monitors rather than by waiters.
+ * Nothing sleeps on it unless someone is watching, so moving it
+ * on costs one atomic add and one load.
+ *
+ ******************************************************************************/
+
+/**
+ * msem_changed
+ * ````````````
+ * Note a change, waking every monitor.
+ *
+ * @ch   : Change word.
+ * @flags: As for futex_wait.
+ * Return: Nothing.
+ */
+void msem_changed(struct msem_changes *ch, int flags)
+{
+        __atomic_add_fetch(&ch->count, 1, __ATOMIC_SEQ_CST);
+
+        if (__atomic_load_n(&ch->nwatch, __ATOMIC_SEQ_CST) > 0) {
+                futex_wake(&ch->count, INT_MAX, flags);
+        }
+}
+
+
+/**
+ * msem_changes_wait
+ * `````````````````
+ * Sleep until a change word moves past @seen.
+ *
+ * @ch   : Change word.
+ * @seen : Count read before the state was looked at.
+ * @flags: As for futex_wait.
+ * @ms   : Milliseconds before timeout.
+ * Return: -1 on error (errno EAGAIN on timeout), else 1.
+ */
+int msem_changes_wait(struct msem_changes *ch, uint32_t seen, int flags, int ms)
+{
+        struct timespec timeout;
+        int r = 1;
+
+        __atomic_add_fetch(&ch->nwatch, 1, __ATOMIC_SEQ_CST);
+
+        if (__atomic_load_n(&ch->count, __ATOMIC_SEQ_CST) == seen) {
+                if (futex_wait(&ch->count, seen, msem_timeout(ms, &timeout), flags) == -1) {
+                        if (errno == ETIMEDOUT) {
+                                errno = EAGAIN;
+                                r = -1;
+                        } else if (errno == EINTR) {
+                                r = -1;
+                        }
+                }
+        }
+
+        __atomic_sub_fetch(&ch->nwatch, 1, __ATOMIC_SEQ_CST);
+
+        return r;
+}
+
+
+/**
+ * msem_changes_waitv
+ * ``````````````````
+ * Sleep until any of several change words moves past what was
+ * seen of it.
+ *
+ * @chs     : Change words.
+ * @seen    : Count read from each before its state was looked at.
+ * @flags   : Futex flags of each, as for futex_wait.
+ * @n       : Number of words (at most FUTEX_WAITV_MAX).
+ * @deadline: Absolute CLOCK_MONOTONIC deadline, or NULL for none.
+ * Return   : -1 on error (errno EAGAIN on timeout), else 1.
+ *
+ * NOTE
+ * One futex_waitv(2) sleeps on them all (Linux 5.16 or later).
+ */
+int msem_changes_waitv(struct msem_changes **chs, const uint32_t *seen, const int *flags, int n, const struct timespec *deadline)
+{
+        struct futex_waitv waiters[FUTEX_WAITV_MAX];
+        struct __kernel_timespec ts;
+        bool moved = false;
+        int r = 1;
+        int i;
+
+        if (n <= 0 || n > FUTEX_WAITV_MAX) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        for (i=0; i<n; i++) {
+                __atomic_add_fetch(&chs[i]->nwatch, 1, __ATOMIC_SEQ_CST);
+
+                waiters[i].val        = seen[i];
+                waiters[i].uaddr      = (uintptr_t)&chs[i]->count;
+                waiters[i].flags      = FUTEX_32 | (flags[i] & FUTEX_PRIVATE_FLAG);
+                waiters[i].__reserved = 0;
+        }
+
+        for (i=0; i<n && !moved; i++) {
+                moved = (__atomic_load_n(&chs[i]->count, __ATOMIC_SEQ_CST) != seen[i]);
+        }
+
+        if (!moved) {
+                if (deadline != NULL) {
+                        ts.tv_sec  = deadline->tv_sec;
+                        ts.tv_nsec = deadline->tv_nsec;
+                }
+                if (syscall(SYS_futex_waitv, waiters, n, 0, (deadline != NULL) ? &ts : NULL, CLOCK_MONOTONIC) == -1) {
+                        if (errno == ETIMEDOUT) {
+                                errno = EAGAIN;
+                                r = -1;
+                        } else if (errno != EAGAIN) {
+                                r = -1;
+                        }
+                }
+        }
+
+        for (i=0; i<n; i++) {
+                __atomic_sub_fetch(&chs[i]->nwatch, 1, __ATOMIC_SEQ_CST);
+        }
+
+        return r;
+}
+
+
+/**
+ * msem_selectors
+ * ``````````````
+ * The number of selectors waiting to lock, to be counted among
+ * the waiters of a semaphore.
+ *
+ * @ch   : Change word.
+ * Return: Number of selectors.
+ */
+int msem_selectors(struct msem_changes *ch)
+{
+        return (int)__atomic_load_n(&ch->nselect, __ATOMIC_SEQ_CST);
+}
+
+
+/**
+ * msem_changes_relax
+ * ``````````````````
+ * Note a relax, waking every monitor and selector.
+ *
+ * @ch   : Change word.
+ * @flags: As for futex_wait.
+ * Return: Nothing.
+ *
+ * NOTE
+ * A selector (see msem_select) which saw @relaxes before the
+ * relax is released by it, as the engine's own waiters are.
+ */
+void msem_changes_relax(struct msem_changes *ch, int flags)
+{
+        __atomic_add_fetch(&ch->relaxes, 1, __ATOMIC_SEQ_CST);
+
+        msem_changed(ch, flags);
+}
+
+
+/*
+ * The burst word holds the end of the burst, in CLOCK_MONOTONIC
+ * nanoseconds, with its two low bits taken for these flags.
+ */
+#define BURST_OWED  1   /* A relax was merged, and is still to be made */
+#define BURST_DONE  2   /* The relax owed was made by a waiter         */
+#define BURST_FLAGS 3
+
+
+/**
+ * msem_changes_now
+ * ````````````````
+ * Return: CLOCK_MONOTONIC in nanoseconds.
+ */
+static int64_t msem_changes_now(void)
+{
+        struct timespec now;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        return (int64_t)now.tv_sec * MS_TO_NS(SEC_IN_MS) + now.tv_nsec;
+}
+
+
+/**
+ * msem_changes_merge
+ * ``````````````````
+ * Merge a relax into the burst under way, if the semaphore has a
+ * coalescing window (see msem_coalesce).
+ *
+ * @ch   : Change word.
+ * Return: TRUE if the relax was merged into one still to come, and
+ *         must not be made; FALSE if the caller is to make it.
+ *
+ * NOTE
+ * A relax made while no burst is open opens one and is made at
+ * once. Every relax made while it is open is merged, and leaves
+ * one relax owed at its end. Nobody sleeps for it: the owed relax
+ * is made by the first relax after the window, which this one
+ * opens anew, or by a waiter still waiting when the window closes
+ * (see msem_changes_due). A publisher which dies meanwhile thus
+ * loses nothing.
+ */
+bool msem_changes_merge(struct msem_changes *ch)
+{
+        int64_t window;
+        int64_t burst;
+        int64_t ns;
+
+        if ((window = __atomic_load_n(&ch->window, __ATOMIC_SEQ_CST)) <= 0) {
+                return false;
+        }
+
+        ns    = msem_changes_now();
+        burst = __atomic_load_n(&ch->burst, __ATOMIC_SEQ_CST);
+
+        for (;;) {
+                if (ns < (burst & ~BURST_FLAGS)) {
+                        if ((burst & BURST_OWED) || __atomic_compare_exchange_n(&ch->burst, &burst, burst | BURST_OWED, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+                                return true;
+                        }
+                } else if (__atomic_compare_exchange_n(&ch->burst, &burst, (ns + MS_TO_NS(window)) & ~BURST_FLAGS, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+                        return false;
+                }
+        }
+}
+
+
+/**
+ * msem_changes_due
+ * ````````````````
+ * Find how long a waiter may sleep before the burst under way
+ * closes, and with it the chance to make the relax it may owe.
+ *
+ * @ch   : Change word.
+ * @burst: Filled in with the burst word, for msem_changes_done.
+ * Return: Milliseconds until the burst closes (at least 1), or 0
+ *         if none is open.
+ */
+int msem_changes_due(struct msem_changes *ch, int64_t *burst)
+{
+        int64_t ns;
+
+        if (__atomic_load_n(&ch->window, __ATOMIC_SEQ_CST) <= 0) {
+                return 0;
+        }
+
+        ns     = msem_changes_now();
+        *burst = __atomic_load_n(&ch->burst, __ATOMIC_SEQ_CST);
+
+        if (ns >= (*burst & ~BURST_FLAGS)) {
+                return 0;
+        }
+
+        return (int)(((*burst & ~BURST_FLAGS) - ns) / MS_TO_NS(1)) + 1;
+}
+
+
+/**
+ * msem_changes_done
+ * `````````````````
+ * Settle the burst a waiter slept to the end of.
+ *
+ * @ch   : Change word.
+ * @burst: Burst word read by msem_changes_due.
+ * Return: 1 if the caller is to make the relax owed (it is then
+ *         counted as released by it), 0 if it was released by
+ *         another's, or -1 if it was owed none and is to go on
+ *         waiting.
+ *
+ * NOTE
+ * Everyone still waiting when a burst closes is served by the one
+ * relax owed. A waiter which wakes to settle it is not waiting
+ * when that relax is made, so it is counted as released whoever
+ * makes it; likewise if a relax has since opened another burst.
+ */
+int msem_changes_done(struct msem_changes *ch, int64_t burst)
+{
+        int64_t now = __atomic_load_n(&ch->burst, __ATOMIC_SEQ_CST);
+
+        for (;;) {
+                if ((now & ~BURST_FLAGS) != (burst & ~BURST_FLAGS) || (now & BURST_DONE)) {
+                        return 0;
+                }
+                if (!(now & BURST_OWED)) {
+                        return -1;
+                }
+                if (__atomic_compare_exchange_n(&ch->burst, &now, (now & ~BURST_OWED) | BURST_DONE, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+                        return 1;
+                }
+        }
+}
+
+
+
+/******************************************************************************
+ * ENGINE OPERATIONS
+ ******************************************************************************/
+
+/**
+ * futex_open
+ * ``````````
+ * Create or attach the shared segment for @path:@tag.
+ *
+ * @path : Filesystem path to the semaphore.
+ * @tag  : Tag (character) indicating the region of the file at @path.
+ * @init : Initial value to set the semaphore if it is created.
+ * @excl : Fail with EEXIST if the semaphore already exists.
+ * @flags: MSEM_ flags for the semaphore if it is created.
+ * Return: Private state, or NULL on error.
+ */
+static void *futex_open(char *path, char *tag, int init, bool excl, int flags)
+{
+        struct msem_futex *sem;
+        bool created = true;
+        int ready = 1;
+        key_t key;
+        void *addr;
+        int shmid;
+
+        if ((key = msem_key(path, (unsigned char)tag[0] | FUTEX_KEY_BIT, true)) == -1) {
+                ERROR("Could not fetch key for file %s[%c]\n", path, tag[0]);
+                return NULL;
+        }
+
+        /*
+         * Whoever manages to create the segment initializes it.
+         * Everyone else waits for the ready flag, and one of them
+         * initializes it instead if the creator dies first.
+         */
+again:
+        if ((shmid = shmget(key, sizeof(struct msem_counter), 0777|IPC_CREAT|IPC_EXCL)) == -1) {
+                if (errno != EEXIST || excl) {
+                        return NULL;
+                }
+                if ((shmid = shmget(key, sizeof(struct msem_counter), 0777)) == -1) {
+                        ERROR("Still could not open segment\n");
+                        return NULL;
+                }
+                created = false;
+        }
+
+        if ((addr = shmat(shmid, NULL, 0)) == (void *)-1) {
+                ERROR("(%d) Could not attach segment %d\n", errno, shmid);
+                return NULL;
+        }
+
+        if ((sem = malloc(sizeof(struct msem_futex))) == NULL) {
+                shmdt(addr);
+                return NULL;
+        }
+
+        sem->shmid = shmid;
+        sem->self  = getpid();
+        sem->shm   = addr;
+
+        if (!created && (ready = msem_ready_wait(&sem->shm->ready, shmid)) == -1) {
+                shmdt(addr);
+                free(sem);
+                if (errno == EIDRM) {
+                        /* Removed by its last user as we came: make a new one. */
+                        goto again;
+                }
+                ERROR("Segment %d was never initialized\n", shmid);
+                errno = ETIMEDOUT;
+                return NULL;
+        }
+
+        if (created || ready == 0) {
+                DEBUG("Created new semaphore %s[%c] with value %d\n", path, tag[0], init);
+                sem->shm->value = init;
+                sem->shm->flags = flags;
+                sem->shm->ctime = (int64_t)time(NULL);
+                msem_ready_set(&sem->shm->ready);
+        }
+
+        return sem;
+}
+
+
+/**
+ * futex_close
+ * ```````````
+ * Detach from the shared segment, removing it if this
+ * was the last process attached.
+ *
+ * @sem  : Private state.
+ * Return: Number of processes still attached, or -1 on error.
+ *
+ * NOTE
+ * Reading the attach count and removing the segment cannot be
+ * one step, and a process attaching in between would be left on
+ * a removed counter, which never fails with EIDRM to tell it so.
+ * The last user therefore marks the ready flag gone first, and
+ * reads the count again. Whoever attaches after the mark sees it
+ * in msem_ready_wait, and waits; whoever attached before it is
+ * in the second count, and the flag is put back for them. The
+ * kernel drops a process that exits without closing from the
+ * count, so it never keeps a segment alive.
+ */
+static int futex_close(void *sem)
+{
+        struct msem_futex *f = sem;
+        struct shmid_ds ds;
+        uint32_t ready = 1;
+        int r;
+
+        if (shmctl(f->shmid, IPC_STAT, &ds) == -1) {
+                ERROR("IPC_STAT failed.\n");
+                r = -1;
+        } else if ((r = (int)ds.shm_nattch - 1) == 0
+                && __atomic_compare_exchange_n(&f->shm->ready, &ready, READY_GONE | (uint32_t)getpid(), false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+                if (shmctl(f->shmid, IPC_STAT, &ds) == -1) {
+                        r = -1;
+                } else {
+                        r = (int)ds.shm_nattch - 1;
+                }
+                if (r == 0) {
+                        WARN("Last process using semaphore. Removing semaphore.\n");
+                        shmctl(f->shmid, IPC_RMID, NULL);
+                } else {
+                        __atomic_store_n(&f->shm->ready, 1, __ATOMIC_RELEASE);
+                }
+                futex_wake(&f->shm->ready, INT_MAX, 0);
+        }
+
+        shmdt(f->shm);
+        free(f);
+
+        return r;
+}
+
+
+/**
+ * futex_remove
+ * ````````````
+ * Mark the shared segment for removal.
+ *
+ * @sem  : Private state.
+ * Return: TRUE on success, else -1.
+ */
+static int futex_remove(void *sem)
+{
+        if (shmctl(((struct msem_futex *)sem)->shmid, IPC_RMID, NULL) == -1) {
+                WARN("Failed to remove semaphore.\n");
+                return -1;
+        }
+
+        return 1;
+}
+
+
+/**
+ * futex_exists
+ * ````````````
+ * @path : Filesystem path to the semaphore.
+ * @tag  : Tag (character) indicating the region of the file at @path.
+ * Return: TRUE if a segment exists for @path:@tag, else FALSE.
+ */
+static bool futex_exists(char *path, char *tag)
+{
+        key_t key;
+
+        if ((key = ftok(path, (unsigned char)tag[0] | FUTEX_KEY_BIT)) == -1) {
+                return false;
+        }
+
+        return (shmget(key, 0, 0) != -1);
+}
+
+
+/**
+ * futex_query
+ * ```````````
+ * Answer one of the msem_query() codes.
+ *
+ * @sem  : Private state.
+ * @code : Query code.
+ * Return: Answer, or -1 on error.
+ */
+static int futex_query(void *sem, char code)
+{
+        return msem_counter_query(((struct msem_futex *)sem)->shm, code);
+}
+
+
+/**
+ * futex_set
+ * `````````
+ * Alter a semaphore's value by some amount.
+ *
+ * @sem  : Private state.
+ * @value: Value to move semaphore.
+ * @ms   : Milliseconds before timeout.
+ * @undo : Ignored (see above).
+ * Return: -1 on error (errno EAGAIN on timeout), else 1.
+ */
+static int futex_set(void *sem, int value, int ms, bool undo)
+{
+        struct msem_futex *f = sem;
+
+        return msem_counter_set(f->shm, f->self, value, ms);
+}
+
+
+static struct msem_counter *futex_counter(void *sem)
+{
+        return ((struct msem_futex *)sem)->shm;
+}
+
+
+static int futex_relax(void *sem)
+{
+        struct msem_futex *f = sem;
+
+        return msem_counter_relax(f->shm, f->self);
+}
+
+
+static int futex_await(void *sem, int ms)
+{
+        return msem_counter_await(((struct msem_futex *)sem)->shm, ms);
+}
+
+
+static int64_t futex_next(void *sem, int64_t after, int ms)
+{
+        return msem_counter_next(((struct msem_futex *)sem)->shm, after, ms);
+}
+
+
+static struct msem_changes *futex_changes(void *sem, int *flags)
+{
+        *flags = 0;
+
+        return &((struct msem_futex *)sem)->shm->changes;
+}
+
+
+static struct msem_queue *futex_queue(void *sem, int *flags)
+{
+        *flags = 0;
+
+        return &((struct msem_futex *)sem)->shm->queue;
+}
+
+
+static struct msem_holders *futex_holders(void *sem)
+{
+        return &((struct msem_futex *)sem)->shm->holders;
+}
+
+
+static int futex_trylock(void *sem, bool undo)
+{
+        struct msem_futex *f = sem;
+        int32_t seen;
+
+        return (msem_counter_trylock(f->shm, f->self, &seen)) ? 1 : 0;
+}
+
+
+const struct msem_engine msem_futex_engine = {
+        .name   = "futex",
+        .open   = futex_open,
+        .close  = futex_close,
+        .remove = futex_remove,
+        .exists = futex_exists,
+        .query  = futex_query,
+        .set    = futex_set,
+        .counter = futex_counter,
+        .relax  = futex_relax,
+        .await  = futex_await,
+        .next   = futex_next,
+        .changes = futex_changes,
+        .trylock = futex_trylock,
+        .queue  = futex_queue,
+        .holders = futex_holders
+};
@@ -0,0 +1,632 @@
+#define _JDL_NO_PRINT_DEBUG
+#define _JDL_NO_PRINT_WARN
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <j/debug.h>
+#include "msem.h"
+#include "msem_engine.h"
+
+/******************************************************************************
+ * ROBUST OWNERSHIP
+ *
+ * A lock with undo ("-,") leaves it to the kernel to give the token
+ * back should the caller die holding it. Only System V keeps undo
+ * lists, they cost a lookup on every such operation, and they are
+ * capped at 16 bits (SEMAEM) per process.
+ *
+ * The holders of a robust semaphore (MSEM_ROBUST) are instead kept
+ * in a table of MSEM_HOLDER_SLOTS slots beside it, one per process,
+ * with the tokens it would have had undone. No one watches it: a
+ * lock that has to wait looks for holders which have died, and puts
+ * their tokens back before it sleeps. A holder is dead if its PID
+ * is gone, or now belongs to a process started at another time.
+ *
+ * A holder which finds the table full falls back to the engine's
+ * own undo, if it has one.
+ *
+ * A lock may instead be taken under a lease (see msem_lease), which
+ * a process that hangs rather than dies cannot keep: its holder has
+ * a slot of its own, with a deadline it must renew, and once the
+ * deadline passes its tokens are put back like those of the dead.
+ * A renewal or unlock moves a sequence number kept in the same word
+ * as the holder, so a lease cannot be reclaimed in the middle of
+ * one.
+ *
+ * NOTE
+ * A holder claims its slot before it locks, with no tokens in it
+ * (see msem_holders_claim), and writes the tokens in with one
+ * compare-and-swap as soon as the lock returns; it writes itself
+ * down just before it unlocks. One killed in between leaves a
+ * token missing rather than one too many, and the table can no
+ * longer turn out full once the lock is held.
+ *
+ ******************************************************************************/
+
+/*
+ * The word @own of a slot: tokens in bits 0-31, PID in bits 32-53
+ * (pid_max is at most 2^22), sequence number in bits 54-62, and a
+ * lease flag in bit 63.
+ */
+#define HOLDER_LEASE       ((uint64_t)1 << 63)
+#define HOLDER_SEQ         ((uint64_t)0x1FF << 54)
+#define HOLDER_PID(own)    ((pid_t)(((own) >> 32) & 0x3FFFFF))
+#define HOLDER_AMOUNT(own) ((int32_t)(uint32_t)(own))
+#define HOLDER_OWN(pid, n) (((uint64_t)(uint32_t)(pid) << 32) | (uint32_t)(int32_t)(n))
+#define HOLDER_WITH(own, n) (((own) & ~(uint64_t)0xFFFFFFFF) | (uint32_t)(int32_t)(n))
+#define HOLDER_BUMP(own)   (((own) & ~HOLDER_SEQ) | (((own) + ((uint64_t)1 << 54)) & HOLDER_SEQ))
+
+/* Whether a slot belongs to a process, as an undo or a lease holder. */
+#define HOLDER_IS(own, pid, lease) \
+        ((own) != 0 && HOLDER_PID(own) == (pid) && (((own) & HOLDER_LEASE) != 0) == (lease))
+
+
+
+/******************************************************************************
+ * UTILITY FUNCTIONS
+ ******************************************************************************/
+
+/**
+ * msem_proc_start
+ * ```````````````
+ * When a process started, in clock ticks since boot.
+ *
+ * @pid  : Process.
+ * Return: Start time, or 0 if it could not be read.
+ */
+uint64_t msem_proc_start(pid_t pid)
+{
+        unsigned long long start;
+        char buf[1024];
+        char path[64];
+        char *p;
+        ssize_t n;
+        int fd;
+        int i;
+
+        snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+
+        if ((fd = open(path, O_RDONLY|O_CLOEXEC)) == -1) {
+                return 0;
+        }
+
+        n = read(fd, buf, sizeof(buf) - 1);
+        close(fd);
+
+        if (n <= 0) {
+                return 0;
+        }
+
+        buf[n] = '\0';
+
+        /* The name (field 2) may hold anything, so count from its end. */
+        if ((p = strrchr(buf, ')')) == NULL) {
+                return 0;
+        }
+
+        /* Field 22, starttime, is the 20th after the name. */
+        for (i=0; i<20; i++) {
+                if ((p = strchr(p + 1, ' ')) == NULL) {
+                        return 0;
+                }
+        }
+
+        if (sscanf(p, " %llu", &start) != 1) {
+                return 0;
+        }
+
+        return start;
+}
+
+
+/**
+ * msem_proc_self
+ * ``````````````
+ * The caller's start time, read once per process.
+ *
+ * Return: Start time, or 0 if it could not be read.
+ */
+uint64_t msem_proc_self(void)
+{
+        static pid_t pid;
+        static uint64_t start;
+
+        if (__atomic_load_n(&pid, __ATOMIC_ACQUIRE) != getpid()) {
+                __atomic_store_n(&start, msem_proc_start(getpid()), __ATOMIC_RELAXED);
+                __atomic_store_n(&pid, getpid(), __ATOMIC_RELEASE);
+        }
+
+        return __atomic_load_n(&start, __ATOMIC_RELAXED);
+}
+
+
+/**
+ * holder_now
+ * ``````````
+ * Return: CLOCK_MONOTONIC time in nanoseconds, as lease deadlines.
+ */
+static int64_t holder_now(void)
+{
+        struct timespec now;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+
+/**
+ * holder_free
+ * ```````````
+ * Empty a slot, if it still holds what was seen.
+ *
+ * @hs   : Holders.
+ * @h    : Slot.
+ * @own  : What was seen in it (updated if it has changed).
+ * Return: TRUE if the slot was emptied.
+ */
+static bool holder_free(struct msem_holders *hs, struct msem_holder *h, uint64_t *own)
+{
+        uint64_t start;
+
+        /* Stop reapers trusting the start time of the next holder. */
+        start = __atomic_exchange_n(&h->start, 0, __ATOMIC_SEQ_CST);
+
+        if (__atomic_compare_exchange_n(&h->own, own, 0, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+                __atomic_sub_fetch(&hs->count, 1, __ATOMIC_SEQ_CST);
+                return true;
+        }
+
+        __atomic_store_n(&h->start, start, __ATOMIC_SEQ_CST);
+
+        return false;
+}
+
+
+/**
+ * msem_proc_dead
+ * ``````````````
+ * Whether a process has died.
+ *
+ * @pid  : Process.
+ * @start: When it started (see msem_proc_start), or 0 if unknown.
+ * Return: TRUE if @pid is gone, or is no longer the same process.
+ */
+bool msem_proc_dead(pid_t pid, uint64_t start)
+{
+        uint64_t now;
+
+        if (kill(pid, 0) == -1 && errno == ESRCH) {
+                return true;
+        }
+
+        /* 0 while a slot is being filled in or emptied. */
+        if (start == 0) {
+                return false;
+        }
+
+        /* If /proc cannot be read, the PID alone has to do. */
+        if ((now = msem_proc_start(pid)) == 0) {
+                return false;
+        }
+
+        return (now != start);
+}
+
+
+/**
+ * holder_dead
+ * ```````````
+ * Whether the holder of a slot has died.
+ *
+ * @h    : Slot.
+ * @pid  : Its holder.
+ * Return: TRUE if @pid is gone, or is no longer the same process.
+ */
+static bool holder_dead(struct msem_holder *h, pid_t pid)
+{
+        return msem_proc_dead(pid, __atomic_load_n(&h->start, __ATOMIC_SEQ_CST));
+}
+
+
+
+/******************************************************************************
+ * PUBLIC INTERFACE
+ ******************************************************************************/
+
+/**
+ * msem_holders_add
+ * ````````````````
+ * Add to the tokens the caller would have given back if it died.
+ *
+ * @hs    : Holders.
+ * @amount: Tokens taken (positive) or given (negative).
+ * Return: TRUE on success, FALSE (errno ENOSPC) if the table is full.
+ *
+ * NOTE
+ * The caller's slot is freed when its tokens come to 0.
+ */
+bool msem_holders_add(struct msem_holders *hs, int amount)
+{
+        struct msem_holder *h;
+        uint64_t own;
+        int64_t want;
+        pid_t pid = getpid();
+        int i;
+
+        if (amount == 0) {
+                return true;
+        }
+
+        /* Threads of one process share its slot. */
+        for (i=0; i<MSEM_HOLDER_SLOTS; i++) {
+                h   = &hs->slot[i];
+                own = __atomic_load_n(&h->own, __ATOMIC_SEQ_CST);
+
+                while (HOLDER_IS(own, pid, false)) {
+                        want = HOLDER_AMOUNT(own) + amount;
+
+                        if (want == 0) {
+                                if (holder_free(hs, h, &own)) {
+                                        return true;
+                                }
+                                continue;
+                        }
+
+                        if (__atomic_compare_exchange_n(&h->own, &own, HOLDER_WITH(own, want), false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+                                return true;
+                        }
+                }
+        }
+
+        for (i=0; i<MSEM_HOLDER_SLOTS; i++) {
+                h   = &hs->slot[i];
+                own = 0;
+
+                if (__atomic_compare_exchange_n(&h->own, &own, HOLDER_OWN(pid, amount), false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+                        __atomic_add_fetch(&hs->count, 1, __ATOMIC_SEQ_CST);
+                        __atomic_store_n(&h->start, msem_proc_self(), __ATOMIC_SEQ_CST);
+                        return true;
+                }
+        }
+
+        DEBUG("Holder table full.\n");
+        errno = ENOSPC;
+        return false;
+}
+
+
+/**
+ * msem_holders_claim
+ * ``````````````````
+ * Find or take the caller's slot, holding no tokens yet, before a
+ * lock whose tokens are to be written into it (see
+ * msem_holders_fill).
+ *
+ * @hs   : Holders.
+ * Return: Slot, or -1 (errno ENOSPC) if the table is full.
+ *
+ * NOTE
+ * An empty slot is claimed as the lease path claims one (see
+ * msem_holders_lease): no reaper takes it from a live process,
+ * and one left by a dead process has nothing to give back.
+ */
+int msem_holders_claim(struct msem_holders *hs)
+{
+        struct msem_holder *h;
+        uint64_t own;
+        pid_t pid = getpid();
+        int i;
+
+        for (i=0; i<MSEM_HOLDER_SLOTS; i++) {
+                if (HOLDER_IS(__atomic_load_n(&hs->slot[i].own, __ATOMIC_SEQ_CST), pid, false)) {
+                        return i;
+                }
+        }
+
+        for (i=0; i<MSEM_HOLDER_SLOTS; i++) {
+                h   = &hs->slot[i];
+                own = 0;
+
+                if (__atomic_compare_exchange_n(&h->own, &own, HOLDER_OWN(pid, 0), false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+                        __atomic_add_fetch(&hs->count, 1, __ATOMIC_SEQ_CST);
+                        __atomic_store_n(&h->start, msem_proc_self(), __ATOMIC_SEQ_CST);
+                        return i;
+                }
+        }
+
+        DEBUG("Holder table full.\n");
+        errno = ENOSPC;
+        return -1;
+}
+
+
+/**
+ * msem_holders_fill
+ * `````````````````
+ * Add to the tokens in a slot claimed by msem_holders_claim.
+ *
+ * @hs    : Holders.
+ * @slot  : Slot.
+ * @amount: Tokens taken (positive) or given (negative), or 0 to
+ *          give the slot up if the lock it was claimed for failed.
+ * Return : TRUE on success, FALSE (errno ENOSPC) if the slot was
+ *          freed meanwhile and the table is now full.
+ *
+ * NOTE
+ * The slot is freed when its tokens come to 0. Threads of one
+ * process share it, so another may have freed it first; the
+ * tokens then go wherever msem_holders_add puts them.
+ */
+bool msem_holders_fill(struct msem_holders *hs, int slot, int amount)
+{
+        struct msem_holder *h = &hs->slot[slot];
+        uint64_t own;
+        int64_t want;
+        pid_t pid = getpid();
+
+        own = __atomic_load_n(&h->own, __ATOMIC_SEQ_CST);
+
+        while (HOLDER_IS(own, pid, false)) {
+                if ((want = HOLDER_AMOUNT(own) + amount) == 0) {
+                        if (holder_free(hs, h, &own)) {
+                                return true;
+                        }
+                        continue;
+                }
+                if (__atomic_compare_exchange_n(&h->own, &own, HOLDER_WITH(own, want), false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+                        return true;
+                }
+        }
+
+        return msem_holders_add(hs, amount);
+}
+
+
+/**
+ * msem_holders_lease
+ * ``````````````````
+ * Take or give back tokens held by the caller under a lease.
+ *
+ * @hs      : Holders.
+ * @amount  : Tokens taken (positive) or given back (negative).
+ * @deadline: When the lease runs out, in CLOCK_MONOTONIC nanoseconds,
+ *            if tokens are taken.
+ * Return   : TRUE on success, FALSE if the table is full (errno
+ *            ENOSPC), or if giving back more than the lease holds
+ *            (errno ETIMEDOUT: it ran out, and was reclaimed).
+ *
+ * NOTE
+ * A process has one lease on a semaphore, covering every token it
+ * holds under lease, and taking more renews it to @deadline.
+ */
+bool msem_holders_lease(struct msem_holders *hs, int amount, int64_t deadline)
+{
+        struct msem_holder *h;
+        uint64_t own;
+        pid_t pid = getpid();
+        int i;
+
+        for (i=0; i<MSEM_HOLDER_SLOTS; i++) {
+                h   = &hs->slot[i];
+                own = __atomic_load_n(&h->own, __ATOMIC_SEQ_CST);
+
+                while (HOLDER_IS(own, pid, true) && HOLDER_AMOUNT(own) + amount >= 0) {
+                        if (HOLDER_AMOUNT(own) + amount == 0) {
+                                if (holder_free(hs, h, &own)) {
+                                        return true;
+                                }
+                                continue;
+                        }
+                        if (amount > 0) {
+                                __atomic_store_n(&h->lease, deadline, __ATOMIC_SEQ_CST);
+                        }
+                        if (__atomic_compare_exchange_n(&h->own, &own, HOLDER_WITH(HOLDER_BUMP(own), HOLDER_AMOUNT(own) + amount), false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+                                return true;
+                        }
+                }
+        }
+
+        if (amount <= 0) {
+                DEBUG("No lease left to give back.\n");
+                errno = ETIMEDOUT;
+                return false;
+        }
+
+        /*
+         * Claimed empty first, which no reaper takes from a live
+         * process, so that the deadline is in place before any
+         * tokens are.
+         */
+        for (i=0; i<MSEM_HOLDER_SLOTS; i++) {
+                h   = &hs->slot[i];
+                own = 0;
+
+                if (!__atomic_compare_exchange_n(&h->own, &own, HOLDER_LEASE|HOLDER_OWN(pid, 0), false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+                        continue;
+                }
+
+                __atomic_add_fetch(&hs->count, 1, __ATOMIC_SEQ_CST);
+                __atomic_store_n(&h->start, msem_proc_self(), __ATOMIC_SEQ_CST);
+                __atomic_store_n(&h->lease, deadline, __ATOMIC_SEQ_CST);
+
+                own = HOLDER_LEASE|HOLDER_OWN(pid, 0);
+
+                /* Only other threads of the caller can change it meanwhile. */
+                while (!__atomic_compare_exchange_n(&h->own, &own, HOLDER_WITH(HOLDER_BUMP(own), HOLDER_AMOUNT(own) + amount), false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+                        if (!HOLDER_IS(own, pid, true)) {
+                                return msem_holders_lease(hs, amount, deadline);
+                        }
+                }
+
+                return true;
+        }
+
+        DEBUG("Holder table full.\n");
+        errno = ENOSPC;
+        return false;
+}
+
+
+/**
+ * msem_holders_renew
+ * ``````````````````
+ * Move the deadline of the caller's lease.
+ *
+ * @hs      : Holders.
+ * @deadline: When the lease now runs out, in CLOCK_MONOTONIC
+ *            nanoseconds.
+ * Return   : TRUE on success, FALSE (errno ETIMEDOUT) if the caller
+ *            holds no tokens under lease: it ran out, and was
+ *            reclaimed.
+ */
+bool msem_holders_renew(struct msem_holders *hs, int64_t deadline)
+{
+        struct msem_holder *h;
+        uint64_t own;
+        pid_t pid = getpid();
+        bool renewed = false;
+        int i;
+
+        for (i=0; i<MSEM_HOLDER_SLOTS; i++) {
+                h   = &hs->slot[i];
+                own = __atomic_load_n(&h->own, __ATOMIC_SEQ_CST);
+
+                while (HOLDER_IS(own, pid, true) && HOLDER_AMOUNT(own) > 0) {
+                        __atomic_store_n(&h->lease, deadline, __ATOMIC_SEQ_CST);
+                        if (__atomic_compare_exchange_n(&h->own, &own, HOLDER_BUMP(own), false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+                                renewed = true;
+                                break;
+                        }
+                }
+        }
+
+        if (!renewed) {
+                DEBUG("No lease left to renew.\n");
+                errno = ETIMEDOUT;
+        }
+
+        return renewed;
+}
+
+
+/**
+ * msem_holders_reclaimed
+ * ``````````````````````
+ * @hs   : Holders.
+ * Return: # of tokens reclaimed so far from dead holders and
+ *         expired leases.
+ */
+int msem_holders_reclaimed(struct msem_holders *hs)
+{
+        return (int)(__atomic_load_n(&hs->reclaimed, __ATOMIC_SEQ_CST) & INT32_MAX);
+}
+
+
+/**
+ * msem_holders_busy
+ * `````````````````
+ * Whether anyone holds tokens in the table.
+ *
+ * @hs     : Holders.
+ * @claimed: The caller has claimed a slot (see msem_holders_claim),
+ *           which is not to count.
+ * Return  : TRUE if any other slot is in use.
+ */
+bool msem_holders_busy(struct msem_holders *hs, bool claimed)
+{
+        return __atomic_load_n(&hs->count, __ATOMIC_SEQ_CST) > (uint32_t)claimed;
+}
+
+
+/**
+ * msem_holders_room
+ * `````````````````
+ * Whether the caller has a slot, or could take one.
+ *
+ * @hs   : Holders.
+ * Return: TRUE if msem_holders_add would find room.
+ *
+ * NOTE
+ * Another process may take the last free slot in between.
+ */
+bool msem_holders_room(struct msem_holders *hs)
+{
+        uint64_t own;
+        pid_t pid = getpid();
+        int i;
+
+        for (i=0; i<MSEM_HOLDER_SLOTS; i++) {
+                own = __atomic_load_n(&hs->slot[i].own, __ATOMIC_SEQ_CST);
+                if (own == 0 || HOLDER_IS(own, pid, false)) {
+                        return true;
+                }
+        }
+
+        return false;
+}
+
+
+/**
+ * msem_holders_reap
+ * `````````````````
+ * Free the slot of one dead holder, or of one lease which has
+ * run out.
+ *
+ * @hs    : Holders.
+ * @amount: Set to the tokens it held (negative: had given).
+ * Return: TRUE if such a holder was found, else FALSE.
+ *
+ * NOTE
+ * Only one caller gets a given holder's tokens, and must put them
+ * back (or take them back) itself.
+ */
+bool msem_holders_reap(struct msem_holders *hs, int *amount)
+{
+        struct msem_holder *h;
+        uint64_t own;
+        int64_t lease;
+        int64_t now = 0;
+        bool expired;
+        int i;
+
+        for (i=0; i<MSEM_HOLDER_SLOTS; i++) {
+                h   = &hs->slot[i];
+                own = __atomic_load_n(&h->own, __ATOMIC_SEQ_CST);
+
+                if (own == 0) {
+                        continue;
+                }
+
+                /* Read after @own, so a renewal since is caught below. */
+                lease   = __atomic_load_n(&h->lease, __ATOMIC_SEQ_CST);
+                expired = false;
+
+                if ((own & HOLDER_LEASE) && HOLDER_AMOUNT(own) > 0) {
+                        if (now == 0) {
+                                now = holder_now();
+                        }
+                        expired = (now > lease);
+                }
+
+                if (!expired && !holder_dead(h, HOLDER_PID(own))) {
+                        continue;
+                }
+
+                if (holder_free(hs, h, &own)) {
+                        DEBUG("Reaped %d tokens of %s holder %d.\n", HOLDER_AMOUNT(own), (expired) ? "expired" : "dead", HOLDER_PID(own));
+                        __atomic_add_fetch(&hs->reclaimed, abs(HOLDER_AMOUNT(own)), __ATOMIC_SEQ_CST);
+                        *amount = HOLDER_AMOUNT(own);
+                        return true;
+                }
+        }
+
+        return false;
+}
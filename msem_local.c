@@ -0,0 +1,350 @@
+#define _JDL_NO_PRINT_DEBUG
+#define _JDL_NO_PRINT_WARN
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <linux/futex.h>
+#include <errno.h>
+#include <j/debug.h>
+#include "msem.h"
+#include "msem_engine.h"
+
+/******************************************************************************
+ * LOCAL ENGINE
+ *
+ * For semaphores whose users are all threads of one process.
+ * Each @path:@tag names a counter (see msem_futex.c) in private
+ * memory, found through a registry local to the process. Nothing
+ * touches the filesystem or creates a kernel object, so opening
+ * a name for the first time costs one allocation, and the futex
+ * calls made by waiters and wakers use the cheaper private forms.
+ *
+ * NOTE
+ * Nothing outlives the process, so the "with undo" operations
+ * behave exactly like the plain ones.
+ *
+ ******************************************************************************/
+
+/*
+ * A registered semaphore.
+ *
+ * @next   : Next entry in the same bucket.
+ * @users  : # of handles open on the semaphore.
+ * @removed: Unlinked from the registry by msem_remove.
+ * @self   : PID of this process.
+ * @tag    : Tag of the semaphore.
+ * @count  : The semaphore proper.
+ * @path   : Path of the semaphore.
+ */
+struct msem_local {
+        struct msem_local *next;
+        int users;
+        bool removed;
+        pid_t self;
+        char tag;
+        struct msem_counter count;
+        char path[];
+};
+
+
+/* Number of registry buckets (a power of 2). */
+#define NBUCKETS 1024
+
+static struct msem_local *registry[NBUCKETS];
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+
+/******************************************************************************
+ * REGISTRY
+ ******************************************************************************/
+
+/**
+ * local_bucket
+ * ````````````
+ * Hash @path:@tag to a registry bucket (FNV-1a).
+ *
+ * @path : Path of the semaphore.
+ * @tag  : Tag of the semaphore.
+ * Return: Bucket head.
+ */
+static struct msem_local **local_bucket(char *path, char tag)
+{
+        uint32_t h = 2166136261u;
+
+        while (*path) {
+                h = (h ^ (unsigned char)*path++) * 16777619u;
+        }
+        h = (h ^ (unsigned char)tag) * 16777619u;
+
+        return &registry[h & (NBUCKETS-1)];
+}
+
+
+/**
+ * local_find
+ * ``````````
+ * Find a registered semaphore. Call with the registry locked.
+ *
+ * @path : Path of the semaphore.
+ * @tag  : Tag of the semaphore.
+ * Return: Entry, or NULL if none is registered.
+ */
+static struct msem_local *local_find(char *path, char tag)
+{
+        struct msem_local *l;
+
+        for (l = *local_bucket(path, tag); l != NULL; l = l->next) {
+                if (l->tag == tag && !strcmp(l->path, path)) {
+                        return l;
+                }
+        }
+
+        return NULL;
+}
+
+
+/**
+ * local_unlink
+ * ````````````
+ * Take an entry out of the registry. Call with the registry locked.
+ *
+ * @l    : Entry.
+ * Return: Nothing.
+ */
+static void local_unlink(struct msem_local *l)
+{
+        struct msem_local **p;
+
+        for (p = local_bucket(l->path, l->tag); *p != NULL; p = &(*p)->next) {
+                if (*p == l) {
+                        *p = l->next;
+                        break;
+                }
+        }
+
+        l->removed = true;
+}
+
+
+
+/******************************************************************************
+ * ENGINE OPERATIONS
+ ******************************************************************************/
+
+/**
+ * local_open
+ * ``````````
+ * Find or register the semaphore at @path:@tag.
+ *
+ * @path : Name of the semaphore (need not exist on disk).
+ * @tag  : Tag (character) distinguishing semaphores with one @path.
+ * @init : Initial value to set the semaphore if it is created.
+ * @excl : Fail with EEXIST if the semaphore already exists.
+ * @flags: MSEM_ flags for the semaphore if it is created.
+ * Return: Private state, or NULL on error.
+ */
+static void *local_open(char *path, char *tag, int init, bool excl, int flags)
+{
+        struct msem_local *l;
+        struct msem_local **bucket;
+
+        pthread_mutex_lock(&registry_lock);
+
+        if ((l = local_find(path, tag[0])) != NULL) {
+                if (excl) {
+                        pthread_mutex_unlock(&registry_lock);
+                        errno = EEXIST;
+                        return NULL;
+                }
+                l->users++;
+                pthread_mutex_unlock(&registry_lock);
+                return l;
+        }
+
+        if ((l = calloc(1, sizeof(struct msem_local) + strlen(path) + 1)) == NULL) {
+                pthread_mutex_unlock(&registry_lock);
+                return NULL;
+        }
+
+        strcpy(l->path, path);
+        l->tag   = tag[0];
+        l->users = 1;
+        l->self  = getpid();
+
+        l->count.value       = init;
+        l->count.flags       = flags;
+        l->count.futex_flags = FUTEX_PRIVATE_FLAG;
+        l->count.ctime       = (int64_t)time(NULL);
+        l->count.ready       = 1;
+
+        bucket  = local_bucket(path, tag[0]);
+        l->next = *bucket;
+        *bucket = l;
+
+        pthread_mutex_unlock(&registry_lock);
+
+        DEBUG("Created new semaphore %s[%c] with value %d\n", path, tag[0], init);
+
+        return l;
+}
+
+
+/**
+ * local_close
+ * ```````````
+ * Release a handle's reference, freeing the semaphore when
+ * the last one goes.
+ *
+ * @sem  : Private state.
+ * Return: Number of handles still open.
+ */
+static int local_close(void *sem)
+{
+        struct msem_local *l = sem;
+        int r;
+
+        pthread_mutex_lock(&registry_lock);
+
+        if ((r = --l->users) == 0) {
+                if (!l->removed) {
+                        local_unlink(l);
+                }
+                free(l);
+        }
+
+        pthread_mutex_unlock(&registry_lock);
+
+        return r;
+}
+
+
+/**
+ * local_remove
+ * ````````````
+ * Unregister the semaphore. Handles already open keep working,
+ * and the next open of the same name creates a new one.
+ *
+ * @sem  : Private state.
+ * Return: TRUE.
+ */
+static int local_remove(void *sem)
+{
+        struct msem_local *l = sem;
+
+        pthread_mutex_lock(&registry_lock);
+
+        if (!l->removed) {
+                local_unlink(l);
+        }
+
+        pthread_mutex_unlock(&registry_lock);
+
+        return 1;
+}
+
+
+/**
+ * local_exists
+ * ````````````
+ * @path : Name of the semaphore.
+ * @tag  : Tag of the semaphore.
+ * Return: TRUE if @path:@tag is registered, else FALSE.
+ */
+static bool local_exists(char *path, char *tag)
+{
+        bool r;
+
+        pthread_mutex_lock(&registry_lock);
+        r = (local_find(path, tag[0]) != NULL);
+        pthread_mutex_unlock(&registry_lock);
+
+        return r;
+}
+
+
+static int local_query(void *sem, char code)
+{
+        return msem_counter_query(&((struct msem_local *)sem)->count, code);
+}
+
+
+static int local_set(void *sem, int value, int ms, bool undo)
+{
+        struct msem_local *l = sem;
+
+        return msem_counter_set(&l->count, l->self, value, ms);
+}
+
+
+static struct msem_counter *local_counter(void *sem)
+{
+        return &((struct msem_local *)sem)->count;
+}
+
+
+static int local_relax(void *sem)
+{
+        struct msem_local *l = sem;
+
+        return msem_counter_relax(&l->count, l->self);
+}
+
+
+static int local_await(void *sem, int ms)
+{
+        return msem_counter_await(&((struct msem_local *)sem)->count, ms);
+}
+
+
+static int64_t local_next(void *sem, int64_t after, int ms)
+{
+        return msem_counter_next(&((struct msem_local *)sem)->count, after, ms);
+}
+
+
+static struct msem_changes *local_changes(void *sem, int *flags)
+{
+        *flags = FUTEX_PRIVATE_FLAG;
+
+        return &((struct msem_local *)sem)->count.changes;
+}
+
+
+static struct msem_queue *local_queue(void *sem, int *flags)
+{
+        *flags = FUTEX_PRIVATE_FLAG;
+
+        return &((struct msem_local *)sem)->count.queue;
+}
+
+
+static int local_trylock(void *sem, bool undo)
+{
+        struct msem_local *l = sem;
+        int32_t seen;
+
+        return (msem_counter_trylock(&l->count, l->self, &seen)) ? 1 : 0;
+}
+
+
+const struct msem_engine msem_local_engine = {
+        .name   = "local",
+        .open   = local_open,
+        .close  = local_close,
+        .remove = local_remove,
+        .exists = local_exists,
+        .query  = local_query,
+        .set    = local_set,
+        .counter = local_counter,
+        .relax  = local_relax,
+        .await  = local_await,
+        .next   = local_next,
+        .changes = local_changes,
+        .trylock = local_trylock,
+        .queue  = local_queue
+};
@@ -0,0 +1,506 @@
+#define _JDL_NO_PRINT_DEBUG
+#define _JDL_NO_PRINT_WARN
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <j/time.h>
+#include <j/debug.h>
+#include "msem.h"
+#include "msem_engine.h"
+
+/******************************************************************************
+ * MULTIPLEXER
+ *
+ * Threads of one process which wait on the same semaphore each
+ * enter the kernel: 500 of them make a queue 500 deep, and cost
+ * 500 wakeups and context switches. Waiting through the multiplexer
+ * (msem_mux) instead, only one thread of the process, the kernel
+ * waiter, waits on each semaphore and mode. It hands what it gets
+ * to the others in userspace, each of which keeps its own timeout:
+ *
+ *      "-", "-,"  each lock it makes goes to one local waiter, and
+ *                 it stops locking when none is left wanting one
+ *      "-*"       each relax it sees wakes every local waiter
+ *
+ * The kernel waiter takes its own reference on the handle (see
+ * msem_hold), and starts with the first local waiter. It waits in
+ * slices of MUX_SLICE_MS, and is gone within one slice of the
+ * last local waiter leaving. A lock that arrives when no one is
+ * left to take it is given back.
+ *
+ * The kernel counts one waiter where there are many, so the other
+ * local lock waiters are counted with the selectors (see
+ * msem_selectors), which msem_query(semid, "n") adds to the
+ * waiters. A relax releases the local lock waiters without a
+ * token, as it does the engine's own: each takes note of the
+ * semaphore's relaxes when it starts waiting, and the kernel
+ * waiter wakes them all when it sees the count move.
+ *
+ ******************************************************************************/
+
+/* Longest single wait made by a kernel waiter. */
+#define MUX_SLICE_MS 1000
+
+/* Stack for each kernel waiter, which needs very little. */
+#define MUX_STACK (64 * 1024)
+
+/*
+ * What a kernel waiter does for its local waiters.
+ */
+enum mux_mode { MUX_LOCK, MUX_LOCK_UNDO, MUX_RELAX };
+
+/*
+ * The local waiters on one semaphore and mode.
+ *
+ * @next   : Next in the list.
+ * @semid  : Handle the local waiters wait on.
+ * @mode   : What the kernel waiter does.
+ * @hold   : The kernel waiter's reference on the handle.
+ * @running: A kernel waiter is running.
+ * @waiters: # of local waiters.
+ * @tokens : Locks made for local waiters and not yet taken.
+ * @gen    : # of relaxes seen.
+ * @seq    : Last sequence number seen, if waiting for relaxes.
+ * @error  : errno of the kernel waiter, if it gave up.
+ * @ch     : Change word behind @hold, if lock waiters are counted.
+ * @flags  : Futex flags for @ch.
+ * @counted: Local lock waiters counted among the selectors on @ch.
+ * @relaxes: Relaxes of @ch last seen by the kernel waiter.
+ * @wake   : Signalled when a lock, relax or error is handed over.
+ */
+struct msem_mux {
+        struct msem_mux *next;
+        int semid;
+        enum mux_mode mode;
+        int hold;
+        bool running;
+        int waiters;
+        int tokens;
+        uint64_t gen;
+        long long seq;
+        int error;
+        struct msem_changes *ch;
+        int flags;
+        int counted;
+        uint32_t relaxes;
+        pthread_cond_t wake;
+};
+
+static struct msem_mux *muxes;
+static pthread_mutex_t muxes_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+
+/******************************************************************************
+ * KERNEL WAITER
+ ******************************************************************************/
+
+/**
+ * mux_wanted
+ * ``````````
+ * Whether a local waiter is still waiting for the kernel waiter.
+ *
+ * @m    : Multiplexer (muxes_lock held).
+ * Return: TRUE if the kernel waiter should keep waiting.
+ */
+static bool mux_wanted(struct msem_mux *m)
+{
+        return (m->mode == MUX_RELAX) ? (m->waiters > 0) : (m->waiters > m->tokens);
+}
+
+
+/**
+ * mux_count
+ * `````````
+ * Count the local lock waiters the kernel does not see among the
+ * selectors of the semaphore.
+ *
+ * @m    : Multiplexer (muxes_lock held).
+ * Return: Nothing.
+ *
+ * NOTE
+ * The kernel waiter stands for one of those wanting a lock; the
+ * rest are counted while it runs.
+ */
+static void mux_count(struct msem_mux *m)
+{
+        int want = 0;
+
+        if (m->ch == NULL) {
+                return;
+        }
+        if (m->running && m->waiters - m->tokens > 1) {
+                want = m->waiters - m->tokens - 1;
+        }
+        if (want != m->counted) {
+                __atomic_add_fetch(&m->ch->nselect, (uint32_t)(want - m->counted), __ATOMIC_SEQ_CST);
+                m->counted = want;
+                msem_changed(m->ch, m->flags);
+        }
+}
+
+
+/**
+ * mux_free
+ * ````````
+ * Take an idle multiplexer off the list and free it.
+ *
+ * @m    : Multiplexer (muxes_lock held), with no local waiters.
+ * Return: Nothing.
+ */
+static void mux_free(struct msem_mux *m)
+{
+        struct msem_mux **p;
+
+        for (p = &muxes; *p != NULL; p = &(*p)->next) {
+                if (*p == m) {
+                        *p = m->next;
+                        break;
+                }
+        }
+
+        pthread_cond_destroy(&m->wake);
+        free(m);
+}
+
+
+/**
+ * mux_watch
+ * `````````
+ * The kernel waiter: wait on the semaphore while any local waiter
+ * wants something, and hand each event over.
+ *
+ * @arg  : Multiplexer.
+ * Return: NULL.
+ */
+static void *mux_watch(void *arg)
+{
+        struct msem_mux *m = arg;
+        long long r = -1;
+        int hold = m->hold;
+        uint32_t relaxes;
+        bool ok;
+        int err;
+
+        pthread_mutex_lock(&muxes_lock);
+
+        while (mux_wanted(m)) {
+                pthread_mutex_unlock(&muxes_lock);
+
+                switch (m->mode) {
+                case MUX_RELAX:
+                        ok = ((r = msem_next(hold, m->seq, MUX_SLICE_MS)) != -1);
+                        break;
+                default:
+                        ok = ((r = msem_take(hold, (m->mode == MUX_LOCK_UNDO), MUX_SLICE_MS)) != -1);
+                        break;
+                }
+
+                err = errno;
+
+                pthread_mutex_lock(&muxes_lock);
+
+                /* Whatever the lock did, a relax releases every local waiter. */
+                if (m->ch != NULL && (relaxes = __atomic_load_n(&m->ch->relaxes, __ATOMIC_SEQ_CST)) != m->relaxes) {
+                        m->relaxes = relaxes;
+                        pthread_cond_broadcast(&m->wake);
+                }
+
+                if (!ok) {
+                        if (err == EAGAIN || err == EINTR) {
+                                continue;
+                        }
+                        WARN("[%d] Kernel waiter giving up (%d).\n", m->semid, err);
+                        m->error = err;
+                        pthread_cond_broadcast(&m->wake);
+                        goto done;
+                }
+
+                if (m->mode == MUX_RELAX) {
+                        m->seq = r;
+                        m->gen++;
+                        pthread_cond_broadcast(&m->wake);
+                } else if (r == MSEM_RELAXED) {
+                        /* Released with nothing held, as were the local waiters. */
+                        continue;
+                } else if (mux_wanted(m)) {
+                        m->tokens++;
+                        mux_count(m);
+                        pthread_cond_signal(&m->wake);
+                } else {
+                        /* Everyone has given up meanwhile. */
+                        pthread_mutex_unlock(&muxes_lock);
+                        msem(hold, (m->mode == MUX_LOCK_UNDO) ? "+," : "+", 0);
+                        pthread_mutex_lock(&muxes_lock);
+                }
+        }
+
+done:
+        m->running = false;
+        mux_count(m);
+        m->ch = NULL;
+
+        if (m->waiters == 0) {
+                mux_free(m);
+        }
+
+        pthread_mutex_unlock(&muxes_lock);
+
+        msem_close(hold);
+
+        return NULL;
+}
+
+
+/**
+ * mux_start
+ * `````````
+ * Start a multiplexer's kernel waiter.
+ *
+ * @m    : Multiplexer (muxes_lock held).
+ * Return: 0 on success, -1 on error.
+ */
+static int mux_start(struct msem_mux *m)
+{
+        pthread_attr_t attr;
+        pthread_t thread;
+        int err;
+
+        if ((m->hold = msem_hold(m->semid)) == -1) {
+                return -1;
+        }
+        if (m->mode == MUX_RELAX && (m->seq = msem_next(m->hold, -1, 0)) == -1) {
+                err = errno;
+                msem_close(m->hold);
+                errno = err;
+                return -1;
+        }
+
+        m->ch = NULL;
+        if (m->mode != MUX_RELAX) {
+                if ((m->ch = msem_changes_of(m->hold, &m->flags)) == NULL) {
+                        DEBUG("[%d] Local lock waiters will not be counted.\n", m->semid);
+                } else {
+                        m->relaxes = __atomic_load_n(&m->ch->relaxes, __ATOMIC_SEQ_CST);
+                }
+        }
+
+        m->error   = 0;
+        m->running = true;
+
+        pthread_attr_init(&attr);
+        pthread_attr_setstacksize(&attr, MUX_STACK);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+        if ((err = pthread_create(&thread, &attr, mux_watch, m)) != 0) {
+                pthread_attr_destroy(&attr);
+                ERROR("(%d) Could not start kernel waiter.\n", err);
+                m->running = false;
+                msem_close(m->hold);
+                errno = err;
+                return -1;
+        }
+
+        pthread_attr_destroy(&attr);
+
+        return 0;
+}
+
+
+/**
+ * mux_find
+ * ````````
+ * Find the multiplexer for a semaphore and mode, or make one.
+ *
+ * @semid: Handle.
+ * @mode : What the kernel waiter does.
+ * Return: Multiplexer (muxes_lock held), or NULL on error.
+ */
+static struct msem_mux *mux_find(int semid, enum mux_mode mode)
+{
+        struct msem_mux *m;
+        pthread_condattr_t attr;
+
+        for (m = muxes; m != NULL; m = m->next) {
+                if (m->semid == semid && m->mode == mode) {
+                        return m;
+                }
+        }
+
+        if ((m = calloc(1, sizeof(struct msem_mux))) == NULL) {
+                return NULL;
+        }
+
+        m->semid = semid;
+        m->mode  = mode;
+
+        /* Deadlines are on CLOCK_MONOTONIC (see msem_deadline). */
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&m->wake, &attr);
+        pthread_condattr_destroy(&attr);
+
+        m->next = muxes;
+        muxes   = m;
+
+        return m;
+}
+
+
+
+/******************************************************************************
+ * PUBLIC INTERFACE
+ ******************************************************************************/
+
+/**
+ * msem_mux
+ * ````````
+ * Lock a semaphore, or wait for it to relax, through the process's
+ * multiplexer, so that one thread waits in the kernel for all.
+ *
+ * @semid  : Handle.
+ * @mode   : One of
+ *           "-"  lock
+ *           "-," lock, undone if the process exits
+ *           "-*" wait for the next relax
+ * @timeout: Milliseconds before this wait times out (<= 0 for no
+ *           timeout).
+ * Return  : TRUE on success, else FALSE (errno EAGAIN on timeout).
+ *
+ * NOTE
+ * A lock is the caller's as if it were made by msem(); unlock it
+ * as usual. Local waiters are served in no particular order, so
+ * the priorities of an ordered semaphore (see MSEM_ORDERED) are
+ * not kept among them.
+ *
+ * Local lock waiters are counted among the semaphore's waiters
+ * ('n'), and a relax releases each of them, as it would had they
+ * called msem().
+ *
+ * The multiplexer is per process. Threads of other processes,
+ * and threads of this one which call msem() directly, wait beside
+ * its kernel waiter as usual.
+ */
+int msem_mux(int semid, char *mode, int timeout)
+{
+        struct msem_mux *m;
+        struct msem_changes *ch = NULL;
+        struct timespec rel;
+        struct timespec deadline;
+        enum mux_mode kind;
+        uint64_t gen;
+        uint32_t relaxes = 0;
+        int flags;
+        bool ok = false;
+        int err = 0;
+
+        if (mode[0] != '-' && mode[0] != 'p') {
+                WARN("Invalid mode supplied\n");
+                errno = EINVAL;
+                return (int)false;
+        }
+
+        switch (mode[1]) {
+        case '\0':
+                kind = MUX_LOCK;
+                break;
+        case ',':
+                kind = MUX_LOCK_UNDO;
+                break;
+        case '*':
+                kind = MUX_RELAX;
+                break;
+        default:
+                WARN("Invalid mode supplied\n");
+                errno = EINVAL;
+                return (int)false;
+        }
+
+        if (msem_timeout(msem_expire(timeout), &rel) != NULL) {
+                msem_deadline(&rel, &deadline);
+        }
+
+        /* Before any lock, so that no relax from here on is missed. */
+        if (kind != MUX_RELAX && (ch = msem_changes_of(semid, &flags)) != NULL) {
+                relaxes = __atomic_load_n(&ch->relaxes, __ATOMIC_SEQ_CST);
+        }
+
+        pthread_mutex_lock(&muxes_lock);
+
+        if ((m = mux_find(semid, kind)) == NULL) {
+                pthread_mutex_unlock(&muxes_lock);
+                return (int)false;
+        }
+
+        m->waiters++;
+        gen = m->gen;
+
+        if (!m->running && mux_start(m) == -1) {
+                err = errno;
+                goto leave;
+        }
+
+        mux_count(m);
+
+        for (;;) {
+                if (kind != MUX_RELAX && m->tokens > 0) {
+                        m->tokens--;
+                        ok = true;
+                        break;
+                }
+                if (kind == MUX_RELAX && m->gen != gen) {
+                        ok = true;
+                        break;
+                }
+                if (ch != NULL && __atomic_load_n(&ch->relaxes, __ATOMIC_SEQ_CST) != relaxes) {
+                        /* Released by a relax: no token to take. */
+                        ok = true;
+                        break;
+                }
+                if (m->error != 0 && !m->running) {
+                        err = m->error;
+                        break;
+                }
+                if (!m->running) {
+                        if (mux_start(m) == -1) {
+                                err = errno;
+                                break;
+                        }
+                        mux_count(m);
+                }
+                if (timeout <= 0) {
+                        pthread_cond_wait(&m->wake, &muxes_lock);
+                } else if (pthread_cond_timedwait(&m->wake, &muxes_lock, &deadline) == ETIMEDOUT) {
+                        if (kind != MUX_RELAX && m->tokens > 0) {
+                                continue;
+                        }
+                        if (ch != NULL && __atomic_load_n(&ch->relaxes, __ATOMIC_SEQ_CST) != relaxes) {
+                                continue;
+                        }
+                        err = EAGAIN;
+                        break;
+                }
+        }
+
+leave:
+        m->waiters--;
+        mux_count(m);
+
+        if (m->waiters == 0 && !m->running) {
+                mux_free(m);
+        }
+
+        pthread_mutex_unlock(&muxes_lock);
+
+        if (!ok) {
+                errno = err;
+        }
+
+        return ok ? (int)true : (int)false;
+}
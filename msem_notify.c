@@ -0,0 +1,652 @@
+#define _JDL_NO_PRINT_DEBUG
+#define _JDL_NO_PRINT_WARN
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <linux/futex.h>
+#include <errno.h>
+#include <j/time.h>
+#include <j/debug.h>
+#include "msem.h"
+#include "msem_engine.h"
+
+/******************************************************************************
+ * NOTIFIERS
+ *
+ * Waiting on a semaphore blocks the caller, and the kernel gives
+ * no file descriptor for a System V set (or a futex) that could
+ * be handed to poll or epoll. A notifier supplies one: an eventfd
+ * which a thread of the process, the watcher, signals whenever
+ * the semaphore is unlocked or relaxed. An event loop can then
+ * wait on any number of semaphores alongside its sockets.
+ *
+ * A watcher does not wait in the engine. It sleeps on the change
+ * words of all its notifiers' semaphores at once, with one
+ * futex_waitv(2) (see msem_changes_waitv), as a selector does (see
+ * msem_select), and when any moves it looks at each notifier of
+ * that semaphore in turn. One watcher serves a process, up to
+ * NOTIFY_WORDS semaphores; a second is started for the next
+ * NOTIFY_WORDS, and so on. Each watcher also sleeps on a word of
+ * its own, moved on to make it look again when a notifier is added
+ * or closed.
+ *
+ * A lock notifier is level-triggered: it holds at most one lock not
+ * yet read from the descriptor, and takes the next only once that
+ * one has been read. While it wants a lock it is counted among the
+ * selectors, so the engine counts it among the waiters. The kernel
+ * tells no one when an eventfd is read, so while a lock is posted
+ * and unread and another token is there for the taking, the watcher
+ * looks again every NOTIFY_READ_MS; otherwise the caller's unlock,
+ * or anyone else's change, wakes it. Locks posted and not read when
+ * the notifier closes are given back.
+ *
+ * A relax notifier counts the relaxes of the semaphore, as moved
+ * on by msem_changes_relax, and takes no tokens.
+ *
+ * Each notifier takes its own reference on the handle (see
+ * msem_hold), so the handle may be closed before or after the
+ * notifier. msem_notify_close never waits for the watcher, which
+ * lets the notifier go once it wakes.
+ *
+ ******************************************************************************/
+
+/* Change words one watcher sleeps on, beside its own (see FUTEX_WAITV_MAX). */
+#define NOTIFY_WORDS 127
+
+/* How often a watcher looks to see whether a lock was read, while a token waits. */
+#define NOTIFY_READ_MS 10
+
+/* How long a watcher leaves a semaphore it could not lock (removed, say). */
+#define NOTIFY_RETRY_MS 1000
+
+/* Stack for each watcher, which needs very little. */
+#define NOTIFY_STACK (64 * 1024)
+
+struct msem_watcher;
+
+/*
+ * A notifier.
+ *
+ * @next   : Next notifier in the list.
+ * @w      : Watcher serving it.
+ * @fd     : The descriptor handed out.
+ * @efd    : The watcher's own copy of @fd.
+ * @semid  : The notifier's reference on the handle.
+ * @ch     : Change word behind @semid.
+ * @flags  : Futex flags for @ch.
+ * @relax  : Watching for relaxes ("-*") rather than locking ("-").
+ * @relaxes: Relaxes of @ch last seen.
+ * @armed  : Wanting a lock, and counted among the selectors on @ch.
+ * @posted : A lock was posted, and not yet seen to be read.
+ * @dead   : The semaphore cannot be locked; the notifier is idle.
+ * @stop   : Set when the notifier is closed.
+ */
+struct msem_notify {
+        struct msem_notify *next;
+        struct msem_watcher *w;
+        int fd;
+        int efd;
+        int semid;
+        struct msem_changes *ch;
+        int flags;
+        bool relax;
+        uint32_t relaxes;
+        bool armed;
+        bool posted;
+        bool dead;
+        bool stop;
+};
+
+/*
+ * A watcher.
+ *
+ * @next : Next watcher in the list.
+ * @users: # of notifiers it serves.
+ * @kick : Moved on to make it look again.
+ */
+struct msem_watcher {
+        struct msem_watcher *next;
+        int users;
+        struct msem_changes kick;
+};
+
+/* Both lists, and every notifier and watcher, are under notifiers_lock. */
+static struct msem_notify *notifiers;
+static struct msem_watcher *watchers;
+static pthread_mutex_t notifiers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+
+/******************************************************************************
+ * NOTIFIER STATE
+ ******************************************************************************/
+
+/**
+ * notify_post
+ * ```````````
+ * Add to a notifier's count, making it readable.
+ *
+ * @n    : Notifier.
+ * @count: Events to add.
+ * Return: Nothing.
+ */
+static void notify_post(struct msem_notify *n, uint64_t count)
+{
+        if (write(n->efd, &count, sizeof(count)) != sizeof(count)) {
+                WARN("(%d) Could not post to notifier %d.\n", errno, n->fd);
+        }
+}
+
+
+/**
+ * notify_pending
+ * ``````````````
+ * Whether a notifier has a count not yet read.
+ *
+ * @n    : Notifier.
+ * Return: TRUE if the descriptor is readable.
+ */
+static bool notify_pending(struct msem_notify *n)
+{
+        struct pollfd pfd = { .fd = n->efd, .events = POLLIN };
+
+        return poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN);
+}
+
+
+/**
+ * notify_arm
+ * ``````````
+ * Start or stop wanting a lock, as a selector does.
+ *
+ * @n    : Lock notifier.
+ * @armed: Whether it now wants one.
+ * Return: Nothing.
+ */
+static void notify_arm(struct msem_notify *n, bool armed)
+{
+        if (n->armed == armed) {
+                return;
+        }
+
+        if ((n->armed = armed)) {
+                __atomic_add_fetch(&n->ch->nselect, 1, __ATOMIC_SEQ_CST);
+                n->relaxes = __atomic_load_n(&n->ch->relaxes, __ATOMIC_SEQ_CST);
+        } else {
+                __atomic_sub_fetch(&n->ch->nselect, 1, __ATOMIC_SEQ_CST);
+        }
+
+        msem_changed(n->ch, n->flags);
+}
+
+
+/**
+ * notify_look
+ * ```````````
+ * Look at a notifier's semaphore, and post what has happened.
+ *
+ * @n    : Notifier (not stopped).
+ * Return: Milliseconds before the watcher must look again, or 0
+ *         if it need only look when the change word moves.
+ *
+ * NOTE
+ * A lock notifier released by a relax posts as if it had locked,
+ * as a lock would (see msem), though it holds no token.
+ */
+static int notify_look(struct msem_notify *n)
+{
+        uint32_t now;
+        int r;
+
+        now = __atomic_load_n(&n->ch->relaxes, __ATOMIC_SEQ_CST);
+
+        if (n->relax) {
+                if (now != n->relaxes) {
+                        notify_post(n, (uint32_t)(now - n->relaxes));
+                        n->relaxes = now;
+                }
+                return 0;
+        }
+
+        if (n->dead) {
+                return 0;
+        }
+
+        if (n->posted) {
+                if (notify_pending(n)) {
+                        return (msem_query(n->semid, "v") > 0) ? NOTIFY_READ_MS : 0;
+                }
+                n->posted = false;
+                notify_arm(n, true);
+                now = n->relaxes;
+        }
+
+        if (now != n->relaxes) {
+                r = 1;
+        } else if ((r = msem_try(n->semid)) == -1) {
+                if (errno == EBADF || errno == EOPNOTSUPP) {
+                        WARN("[%d] Notifier giving up (%d).\n", n->semid, errno);
+                        notify_arm(n, false);
+                        n->dead = true;
+                        return 0;
+                }
+                /* Perhaps removed and not yet created again. */
+                DEBUG("[%d] Notifier failed (%d), retrying.\n", n->semid, errno);
+                return NOTIFY_RETRY_MS;
+        }
+
+        if (r == 1) {
+                notify_arm(n, false);
+                notify_post(n, 1);
+                n->posted = true;
+        }
+
+        return 0;
+}
+
+
+/**
+ * notify_free
+ * ```````````
+ * Let go of a closed notifier.
+ *
+ * @n    : Notifier (stopped, and unlinked).
+ * Return: Nothing.
+ */
+static void notify_free(struct msem_notify *n)
+{
+        if (!n->relax) {
+                notify_arm(n, false);
+        }
+
+        n->w->users--;
+
+        msem_close(n->semid);
+        close(n->efd);
+        free(n);
+}
+
+
+
+/******************************************************************************
+ * WATCHER
+ ******************************************************************************/
+
+/**
+ * notify_kick
+ * ```````````
+ * Make a watcher look again.
+ *
+ * @w    : Watcher.
+ * Return: Nothing.
+ */
+static void notify_kick(struct msem_watcher *w)
+{
+        msem_changed(&w->kick, FUTEX_PRIVATE_FLAG);
+}
+
+
+/**
+ * notify_words
+ * ````````````
+ * Count the change words a watcher sleeps on.
+ *
+ * @w    : Watcher.
+ * @ch   : A change word to look for.
+ * @has  : Filled in with whether @w already sleeps on @ch.
+ * Return: Number of change words, its own aside.
+ */
+static int notify_words(struct msem_watcher *w, struct msem_changes *ch, bool *has)
+{
+        struct msem_notify *n;
+        struct msem_notify *m;
+        int words = 0;
+
+        *has = false;
+
+        for (n = notifiers; n != NULL; n = n->next) {
+                if (n->w != w || n->stop) {
+                        continue;
+                }
+                if (n->ch == ch) {
+                        *has = true;
+                }
+                for (m = notifiers; m != n && (m->w != w || m->stop || m->ch != n->ch); m = m->next);
+                if (m == n) {
+                        words++;
+                }
+        }
+
+        return words;
+}
+
+
+/**
+ * notify_gather
+ * `````````````
+ * Look at every notifier a watcher serves, and gather the change
+ * words it is to sleep on.
+ *
+ * @w    : Watcher.
+ * @chs  : Filled in with the change words, its own first.
+ * @seen : Filled in with the count read from each.
+ * @flags: Filled in with the futex flags of each.
+ * @ms   : Filled in with the longest it may sleep, or 0 for ever.
+ * Return: Number of change words.
+ *
+ * NOTE
+ * Each count is read before the notifiers on that word are looked
+ * at, so a change made in between cuts the sleep short. Closed
+ * notifiers are let go here.
+ */
+static int notify_gather(struct msem_watcher *w, struct msem_changes **chs, uint32_t *seen, int *flags, int *ms)
+{
+        struct msem_notify **p;
+        struct msem_notify *n;
+        int k = 1;
+        int i;
+        int r;
+
+        chs[0]   = &w->kick;
+        seen[0]  = __atomic_load_n(&w->kick.count, __ATOMIC_SEQ_CST);
+        flags[0] = FUTEX_PRIVATE_FLAG;
+        *ms      = 0;
+
+        for (p = &notifiers; (n = *p) != NULL; ) {
+                if (n->w != w) {
+                        p = &n->next;
+                        continue;
+                }
+                if (n->stop) {
+                        *p = n->next;
+                        notify_free(n);
+                        continue;
+                }
+
+                for (i = 1; i < k && chs[i] != n->ch; i++);
+                if (i == k && k <= NOTIFY_WORDS) {
+                        chs[k]   = n->ch;
+                        seen[k]  = __atomic_load_n(&n->ch->count, __ATOMIC_SEQ_CST);
+                        flags[k] = n->flags;
+                        k++;
+                }
+
+                if ((r = notify_look(n)) > 0 && (*ms == 0 || r < *ms)) {
+                        *ms = r;
+                }
+                p = &n->next;
+        }
+
+        return k;
+}
+
+
+/**
+ * notify_watch
+ * ````````````
+ * The watcher: sleep on the change words of its notifiers' semaphores
+ * until it serves none.
+ *
+ * @arg  : Watcher.
+ * Return: NULL.
+ */
+static void *notify_watch(void *arg)
+{
+        struct msem_watcher *w = arg;
+        struct msem_watcher **p;
+        struct msem_changes *chs[NOTIFY_WORDS + 1];
+        uint32_t seen[NOTIFY_WORDS + 1];
+        int flags[NOTIFY_WORDS + 1];
+        struct timespec rel;
+        struct timespec deadline;
+        int ms;
+        int k;
+
+        pthread_mutex_lock(&notifiers_lock);
+
+        for (;;) {
+                k = notify_gather(w, chs, seen, flags, &ms);
+
+                if (w->users == 0) {
+                        break;
+                }
+
+                pthread_mutex_unlock(&notifiers_lock);
+
+                if (ms > 0) {
+                        msem_timeout(ms, &rel);
+                        msem_deadline(&rel, &deadline);
+                }
+                if (msem_changes_waitv(chs, seen, flags, k, (ms > 0) ? &deadline : NULL) == -1) {
+                        if (errno != EAGAIN && errno != EINTR) {
+                                WARN("(%d) Watcher could not wait.\n", errno);
+                                sleep_ms(NOTIFY_RETRY_MS);
+                        }
+                }
+
+                pthread_mutex_lock(&notifiers_lock);
+        }
+
+        for (p = &watchers; *p != NULL; p = &(*p)->next) {
+                if (*p == w) {
+                        *p = w->next;
+                        break;
+                }
+        }
+
+        pthread_mutex_unlock(&notifiers_lock);
+
+        free(w);
+
+        return NULL;
+}
+
+
+/**
+ * notify_watcher
+ * ``````````````
+ * Find a watcher to serve a new notifier, starting one if need be.
+ *
+ * @ch   : Change word of the notifier's semaphore.
+ * Return: Watcher, or NULL on error. Call with notifiers_lock held.
+ */
+static struct msem_watcher *notify_watcher(struct msem_changes *ch)
+{
+        struct msem_watcher *w;
+        struct msem_watcher *room = NULL;
+        pthread_attr_t attr;
+        pthread_t thread;
+        bool has;
+        int words;
+        int err;
+
+        for (w = watchers; w != NULL; w = w->next) {
+                words = notify_words(w, ch, &has);
+                if (has) {
+                        return w;
+                }
+                if (room == NULL && words < NOTIFY_WORDS) {
+                        room = w;
+                }
+        }
+        if (room != NULL) {
+                return room;
+        }
+
+        if ((w = calloc(1, sizeof(struct msem_watcher))) == NULL) {
+                return NULL;
+        }
+
+        pthread_attr_init(&attr);
+        pthread_attr_setstacksize(&attr, NOTIFY_STACK);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+        /* It waits on notifiers_lock until its first user is in place. */
+        if ((err = pthread_create(&thread, &attr, notify_watch, w)) != 0) {
+                pthread_attr_destroy(&attr);
+                ERROR("(%d) Could not start watcher.\n", err);
+                free(w);
+                errno = err;
+                return NULL;
+        }
+
+        pthread_attr_destroy(&attr);
+
+        w->next  = watchers;
+        watchers = w;
+
+        return w;
+}
+
+
+
+/******************************************************************************
+ * PUBLIC INTERFACE
+ ******************************************************************************/
+
+/**
+ * msem_notify
+ * ```````````
+ * Get a file descriptor which becomes readable when a semaphore
+ * is unlocked or relaxed.
+ *
+ * @semid: Handle.
+ * @mode : One of
+ *         "-"  lock: each unlock or relax that reaches this
+ *              notifier locks the semaphore on the caller's behalf
+ *         "-*" each relax, without taking a token (as msem -p+)
+ * Return: Non-blocking eventfd, or -1 on error (errno EOPNOTSUPP
+ *         if the engine cannot be selected, see msem_select).
+ *
+ * NOTE
+ * Reading the descriptor (8 bytes, as eventfd(2)) returns the
+ * number of events since it was last read, and makes it not
+ * readable until the next. In "-" mode, that is the number of
+ * locks now held by the caller, to be unlocked as usual: always 1,
+ * since the next lock is not taken until the last has been read.
+ *
+ * Close the descriptor with msem_notify_close, not close(2); locks
+ * not yet read are then given back.
+ */
+int msem_notify(int semid, char *mode)
+{
+        struct msem_notify *n;
+        int err;
+
+        if (mode[0] != '-' && mode[0] != 'p') {
+                WARN("Invalid mode supplied\n");
+                errno = EINVAL;
+                return -1;
+        }
+
+        if ((n = calloc(1, sizeof(struct msem_notify))) == NULL) {
+                return -1;
+        }
+
+        n->relax = (mode[1] == '*');
+
+        if ((n->semid = msem_hold(semid)) == -1) {
+                free(n);
+                return -1;
+        }
+        if ((n->ch = msem_changes_of(n->semid, &n->flags)) == NULL) {
+                err = errno;
+                goto fail;
+        }
+        if ((n->fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC)) == -1) {
+                err = errno;
+                goto fail;
+        }
+        if ((n->efd = fcntl(n->fd, F_DUPFD_CLOEXEC, 0)) == -1) {
+                err = errno;
+                close(n->fd);
+                goto fail;
+        }
+
+        pthread_mutex_lock(&notifiers_lock);
+
+        if ((n->w = notify_watcher(n->ch)) == NULL) {
+                err = errno;
+                pthread_mutex_unlock(&notifiers_lock);
+                close(n->efd);
+                close(n->fd);
+                goto fail;
+        }
+
+        if (n->relax) {
+                n->relaxes = __atomic_load_n(&n->ch->relaxes, __ATOMIC_SEQ_CST);
+        } else {
+                notify_arm(n, true);
+        }
+
+        n->w->users++;
+        n->next   = notifiers;
+        notifiers = n;
+
+        notify_kick(n->w);
+
+        pthread_mutex_unlock(&notifiers_lock);
+
+        return n->fd;
+
+fail:
+        msem_close(n->semid);
+        free(n);
+        errno = err;
+        return -1;
+}
+
+
+/**
+ * msem_notify_close
+ * `````````````````
+ * Close a notifier.
+ *
+ * @fd   : Descriptor from msem_notify.
+ * Return: 0 on success, -1 (errno EBADF) if @fd is not a notifier.
+ *
+ * NOTE
+ * @fd is closed at once. Remove it from any epoll set first: the
+ * watcher's copy keeps it registered until the watcher lets the
+ * notifier go, as soon as it wakes.
+ */
+int msem_notify_close(int fd)
+{
+        struct msem_notify *n;
+        uint64_t unread;
+
+        pthread_mutex_lock(&notifiers_lock);
+
+        for (n = notifiers; n != NULL && (n->fd != fd || n->stop); n = n->next);
+
+        if (n == NULL) {
+                pthread_mutex_unlock(&notifiers_lock);
+                errno = EBADF;
+                return -1;
+        }
+
+        /* Give back the locks posted and not read. */
+        if (!n->relax && read(fd, &unread, sizeof(unread)) == sizeof(unread)) {
+                DEBUG("[%d] Giving back %llu unread locks.\n", n->semid, (unsigned long long)unread);
+                while (unread-- > 0) {
+                        msem(n->semid, "+", 0);
+                }
+        }
+
+        /* The watcher lets @n go once it sees this. */
+        n->stop = true;
+        notify_kick(n->w);
+
+        pthread_mutex_unlock(&notifiers_lock);
+
+        close(fd);
+
+        return 0;
+}
@@ -0,0 +1,722 @@
+#define _GNU_SOURCE             /* semtimedop() */
+#define _JDL_NO_PRINT_DEBUG
+#define _JDL_NO_PRINT_WARN
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/ipc.h>
+#include <sys/sem.h>
+#include <sys/shm.h>
+#include <errno.h>
+#include <j/time.h>
+#include <j/debug.h>
+#include "msem.h"
+#include "msem_engine.h"
+
+/******************************************************************************
+ * POOL ENGINE
+ *
+ * Every semaphore is one member (a slot) of a large System V set,
+ * shared with many other semaphores. The sets are created as they
+ * are needed and never removed, so a machine with thousands of
+ * semaphores uses a handful of kernel objects instead of one set
+ * each, and opening a new semaphore usually creates nothing at all.
+ *
+ * Which slot belongs to which @path:@tag is kept in a directory,
+ * a hash table (keyed by msem_key) in a shared memory segment. The
+ * directory is guarded by a one-member set used as a lock, with
+ * SEM_UNDO so that a process dying while it holds the lock does not
+ * leave it locked. The directory and its lock are found through
+ * the pool file (see MSEM_POOL).
+ *
+ * Slots are handed out lowest first from a bitmap in the directory,
+ * so the sets fill one at a time, and a slot is recycled when the
+ * last handle on it is closed. Slot n is member (n % POOL_SLOTS) of
+ * set (n / POOL_SLOTS).
+ *
+ * NOTE
+ * The kernel keeps one pair of operation and change times per set,
+ * so msem_query() 'o' and 'c' answer for the whole set.
+ *
+ * A process which exits without closing its handles leaves their
+ * slots allocated until the semaphore is removed (msem -d).
+ *
+ ******************************************************************************/
+
+/* Number of semaphores in each pooled set. */
+#define POOL_SLOTS 250
+
+/* Most pooled sets. */
+#define POOL_SETS 128
+
+/* Slots in the whole pool. */
+#define POOL_SIZE (POOL_SLOTS * POOL_SETS)      /* (a multiple of 64) */
+
+/* Pool file, unless MSEM_POOL names another. */
+#define POOL_PATH "/tmp/msem.pool"
+
+/* Tag of the pool's key within the pool file. */
+#define POOL_TAG 'P'
+
+
+/*
+ * A directory entry.
+ *
+ * @state: One of the ENTRY_ states below.
+ * @key  : Key of the semaphore.
+ * @slot : Slot holding the semaphore.
+ * @users: # of handles open on the semaphore.
+ * @flags: MSEM_ flags given when the semaphore was created.
+ * @changes: Moved on at every operation (see msem_watch).
+ */
+struct pool_entry {
+        uint32_t state;
+        key_t    key;
+        int32_t  slot;
+        uint32_t users;
+        int32_t  flags;
+        struct msem_changes changes;
+};
+
+#define ENTRY_FREE    0 /* Never used; ends a probe.                      */
+#define ENTRY_USED    1 /* Names a semaphore.                             */
+#define ENTRY_REMOVED 2 /* Semaphore removed, but still open somewhere.   */
+#define ENTRY_DEAD    3 /* Was used; free to reuse, but not a probe end.  */
+
+/*
+ * The directory.
+ *
+ * @semid: ID+1 of each pooled set, or 0 if not yet created (a
+ *         fresh segment is all zero, and needs no initialization).
+ * @taken: Bitmap of slots in use.
+ * @entry: The hash table, from key to entry.
+ */
+struct pool_dir {
+        int semid[POOL_SETS];
+        uint64_t taken[POOL_SIZE / 64];
+        struct pool_entry entry[POOL_SIZE];
+};
+
+/*
+ * Argument to semctl (see msem_sysv.c).
+ */
+union semun {
+        int             val;
+        struct semid_ds *buf;
+        unsigned short  *array;
+};
+
+/*
+ * The private state of an open semaphore.
+ */
+struct msem_pool {
+        int entry;
+        int semid;
+        unsigned short num;
+};
+
+
+/*
+ * The directory and its lock, once attached. Attached at most
+ * once per process, and never detached.
+ */
+static struct pool_dir *pool;
+static int pool_lockid = -1;
+static pthread_mutex_t pool_attach_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+
+/******************************************************************************
+ * DIRECTORY
+ ******************************************************************************/
+
+/*
+ * LOCK
+ * 0. Wait for the lock to be 0 (unlocked).
+ * 1. Increment it to 1 (lock).
+ */
+static const struct sembuf pool_op_lock[2] = {
+        {0, 0, 0},
+        {0, 1, SEM_UNDO}
+};
+
+/*
+ * UNLOCK
+ * 0. Decrement the lock to 0 (unlock).
+ */
+static const struct sembuf pool_op_unlock[1] = {
+        {0, -1, SEM_UNDO}
+};
+
+
+static int pool_lock(void)
+{
+        struct sembuf sops[2];
+
+        memcpy(sops, pool_op_lock, sizeof(sops));
+
+        return msem_operation(pool_lockid, sops, 2, NULL);
+}
+
+
+static void pool_unlock(void)
+{
+        struct sembuf sops[1];
+
+        memcpy(sops, pool_op_unlock, sizeof(sops));
+
+        msem_operation(pool_lockid, sops, 1, NULL);
+}
+
+
+/**
+ * pool_attach
+ * ```````````
+ * Find (or create) the directory and its lock.
+ *
+ * Return: TRUE once attached, else FALSE.
+ *
+ * NOTE
+ * A new segment and a new lock are both all zero, which is
+ * exactly their initial state, so creating them races with
+ * nothing.
+ */
+static bool pool_attach(void)
+{
+        char *path;
+        key_t key;
+        int shmid;
+        void *addr;
+        bool r = true;
+
+        pthread_mutex_lock(&pool_attach_lock);
+
+        if (pool != NULL) {
+                goto done;
+        }
+
+        if ((path = getenv("MSEM_POOL")) == NULL || *path == '\0') {
+                path = POOL_PATH;
+        }
+
+        if ((key = msem_key(path, POOL_TAG, true)) == -1) {
+                ERROR("Could not fetch key for pool %s\n", path);
+                r = false;
+                goto done;
+        }
+        if ((pool_lockid = semget(key, 1, 0777|IPC_CREAT)) == -1) {
+                ERROR("(%d) Could not open pool lock\n", errno);
+                r = false;
+                goto done;
+        }
+        if ((shmid = shmget(key, sizeof(struct pool_dir), 0777|IPC_CREAT)) == -1) {
+                ERROR("(%d) Could not open pool directory\n", errno);
+                r = false;
+                goto done;
+        }
+        if ((addr = shmat(shmid, NULL, 0)) == (void *)-1) {
+                ERROR("(%d) Could not attach pool directory\n", errno);
+                r = false;
+                goto done;
+        }
+
+        __atomic_store_n(&pool, addr, __ATOMIC_RELEASE);
+
+done:
+        pthread_mutex_unlock(&pool_attach_lock);
+        return r;
+}
+
+
+/**
+ * pool_hash
+ * `````````
+ * @key  : Key of a semaphore.
+ * Return: Where its probe starts in the directory.
+ */
+static int pool_hash(key_t key)
+{
+        uint32_t h = (uint32_t)key;
+
+        h ^= h >> 16;
+        h *= 0x45d9f3bu;
+        h ^= h >> 16;
+
+        return (int)(h % POOL_SIZE);
+}
+
+
+/**
+ * pool_find
+ * `````````
+ * Find a semaphore in the directory. Call with the pool locked.
+ *
+ * @key  : Key of the semaphore.
+ * @spare: First reusable entry on the probe (filled in), or -1.
+ * Return: Entry, or -1 if @key is not in the directory.
+ */
+static int pool_find(key_t key, int *spare)
+{
+        struct pool_entry *e;
+        int i;
+        int n;
+
+        *spare = -1;
+
+        for (n=0, i=pool_hash(key); n<POOL_SIZE; n++, i=(i+1) % POOL_SIZE) {
+                e = &pool->entry[i];
+
+                switch (e->state) {
+                case ENTRY_FREE:
+                        if (*spare == -1) {
+                                *spare = i;
+                        }
+                        return -1;
+                case ENTRY_DEAD:
+                        if (*spare == -1) {
+                                *spare = i;
+                        }
+                        break;
+                case ENTRY_USED:
+                        if (e->key == key) {
+                                return i;
+                        }
+                        break;
+                }
+        }
+
+        return -1;
+}
+
+
+/**
+ * pool_take
+ * `````````
+ * Allocate the lowest free slot. Call with the pool locked.
+ *
+ * Return: Slot, or -1 (errno ENOSPC) if the pool is full.
+ */
+static int pool_take(void)
+{
+        int i;
+        int b;
+
+        for (i=0; i<POOL_SIZE/64; i++) {
+                if (~pool->taken[i] != 0) {
+                        b = __builtin_ctzll(~pool->taken[i]);
+                        pool->taken[i] |= (1ULL << b);
+                        return (i * 64) + b;
+                }
+        }
+
+        ERROR("Semaphore pool is full.\n");
+        errno = ENOSPC;
+
+        return -1;
+}
+
+
+static void pool_give(int slot)
+{
+        pool->taken[slot / 64] &= ~(1ULL << (slot % 64));
+}
+
+
+/**
+ * pool_set
+ * ````````
+ * The set holding a slot, created if this is its first use.
+ * Call with the pool locked.
+ *
+ * @slot : Slot.
+ * Return: Semaphore set ID, or -1 on error.
+ */
+static int pool_set(int slot)
+{
+        int *id = &pool->semid[slot / POOL_SLOTS];
+
+        if (*id == 0) {
+                if ((*id = semget(IPC_PRIVATE, POOL_SLOTS, 0777)) == -1) {
+                        ERROR("(%d) Could not create pooled set\n", errno);
+                        *id = 0;
+                        return -1;
+                }
+                DEBUG("Created pooled set %d\n", *id);
+                *id += 1;
+        }
+
+        return *id - 1;
+}
+
+
+/**
+ * pool_release
+ * ````````````
+ * Drop one user of an entry, freeing it and its slot with
+ * the last. Call with the pool locked.
+ *
+ * @entry: Entry.
+ * Return: Number of users left.
+ */
+static int pool_release(int entry)
+{
+        struct pool_entry *e = &pool->entry[entry];
+
+        if (e->users > 0) {
+                e->users--;
+        }
+        if (e->users == 0) {
+                pool_give(e->slot);
+                e->state = ENTRY_DEAD;
+                e->key   = 0;
+        }
+
+        return (int)e->users;
+}
+
+
+
+/******************************************************************************
+ * ENGINE OPERATIONS
+ ******************************************************************************/
+
+/**
+ * pool_open
+ * `````````
+ * Find the slot for @path:@tag, allocating one if needed.
+ *
+ * @path : Filesystem path to the semaphore.
+ * @tag  : Tag (character) indicating the region of the file at @path.
+ * @init : Initial value to set the semaphore if it is created.
+ * @excl : Fail with EEXIST if the semaphore already exists.
+ * @flags: MSEM_ flags for the semaphore if it is created.
+ * Return: Private state, or NULL on error.
+ */
+static void *pool_open(char *path, char *tag, int init, bool excl, int flags)
+{
+        struct msem_pool *p;
+        union semun control;
+        key_t key;
+        int entry;
+        int slot;
+        int spare;
+        int semid;
+
+        if (!pool_attach()) {
+                return NULL;
+        }
+        if ((key = msem_key(path, tag[0], true)) == -1) {
+                ERROR("Could not fetch key for file %s[%c]\n", path, tag[0]);
+                return NULL;
+        }
+        if ((p = malloc(sizeof(struct msem_pool))) == NULL) {
+                return NULL;
+        }
+        if (pool_lock() == -1) {
+                free(p);
+                return NULL;
+        }
+
+        if ((entry = pool_find(key, &spare)) != -1) {
+                if (excl) {
+                        errno = EEXIST;
+                        goto fail;
+                }
+                slot = pool->entry[entry].slot;
+                if ((semid = pool_set(slot)) == -1) {
+                        goto fail;
+                }
+                pool->entry[entry].users++;
+        } else {
+                if ((entry = spare) == -1 || (slot = pool_take()) == -1) {
+                        errno = ENOSPC;
+                        goto fail;
+                }
+                if ((semid = pool_set(slot)) == -1) {
+                        pool_give(slot);
+                        goto fail;
+                }
+
+                /* Also clears any undo left on the member by its last user. */
+                control.val = init;
+                if (semctl(semid, slot % POOL_SLOTS, SETVAL, control) == -1) {
+                        ERROR("Failed to set initial value.\n");
+                        pool_give(slot);
+                        goto fail;
+                }
+
+                pool->entry[entry].state = ENTRY_USED;
+                pool->entry[entry].key   = key;
+                pool->entry[entry].slot  = slot;
+                pool->entry[entry].users = 1;
+                pool->entry[entry].flags = flags;
+
+                DEBUG("Created new semaphore %s[%c] in slot %d with value %d\n", path, tag[0], slot, init);
+        }
+
+        pool_unlock();
+
+        p->entry = entry;
+        p->semid = semid;
+        p->num   = slot % POOL_SLOTS;
+
+        return p;
+
+fail:
+        pool_unlock();
+        free(p);
+        return NULL;
+}
+
+
+/**
+ * pool_close
+ * ``````````
+ * Release a handle's reference, recycling the slot when the
+ * last one goes.
+ *
+ * @sem  : Private state.
+ * Return: Number of handles still open, or -1 on error.
+ */
+static int pool_close(void *sem)
+{
+        struct msem_pool *p = sem;
+        int r = -1;
+
+        if (pool_lock() == 0) {
+                r = pool_release(p->entry);
+                pool_unlock();
+        }
+
+        free(p);
+
+        return r;
+}
+
+
+/**
+ * pool_remove
+ * ```````````
+ * Take the semaphore out of the directory. Handles already open
+ * keep working, and the next open of the same name gets a new slot.
+ *
+ * @sem  : Private state.
+ * Return: TRUE on success, else -1.
+ */
+static int pool_remove(void *sem)
+{
+        struct msem_pool *p = sem;
+
+        if (pool_lock() == -1) {
+                return -1;
+        }
+
+        if (pool->entry[p->entry].state == ENTRY_USED) {
+                pool->entry[p->entry].state = ENTRY_REMOVED;
+        }
+
+        pool_unlock();
+
+        return 1;
+}
+
+
+/**
+ * pool_exists
+ * ```````````
+ * @path : Filesystem path to the semaphore.
+ * @tag  : Tag (character) indicating the region of the file at @path.
+ * Return: TRUE if @path:@tag has a slot, else FALSE.
+ */
+static bool pool_exists(char *path, char *tag)
+{
+        key_t key;
+        int spare;
+        int entry;
+
+        if (!pool_attach() || (key = msem_key(path, tag[0], false)) == -1) {
+                return false;
+        }
+        if (pool_lock() == -1) {
+                return false;
+        }
+
+        entry = pool_find(key, &spare);
+
+        pool_unlock();
+
+        return (entry != -1);
+}
+
+
+/**
+ * pool_query
+ * ``````````
+ * Answer one of the msem_query() codes.
+ *
+ * @sem  : Private state.
+ * @code : Query code.
+ * Return: Answer, or -1 on error.
+ */
+static int pool_query(void *sem, char code)
+{
+        struct msem_pool *p = sem;
+        struct semid_ds ds;
+        union semun control;
+        int r;
+
+        control.val = 0;
+
+        switch (code) {
+        case 'v':
+                return semctl(p->semid, p->num, GETVAL, control);
+        case 'p':
+                return semctl(p->semid, p->num, GETPID, control);
+        case 'n':
+                if ((r = semctl(p->semid, p->num, GETNCNT, control)) == -1) {
+                        return -1;
+                }
+                return r + msem_selectors(&pool->entry[p->entry].changes);
+        case 'z':
+                return semctl(p->semid, p->num, GETZCNT, control);
+        case 'o':
+        case 'c':
+                control.buf = &ds;
+                if (semctl(p->semid, 0, IPC_STAT, control) == -1) {
+                        WARN("IPC_STAT failed.\n");
+                        return -1;
+                }
+                return (code == 'o') ? (int)ds.sem_otime : (int)ds.sem_ctime;
+        case 'f':
+                return (int)pool->entry[p->entry].flags;
+        default:
+                WARN("Invalid query_code\n");
+                return -1;
+        }
+}
+
+
+/**
+ * pool_set_value
+ * ``````````````
+ * Alter a semaphore's value by some amount.
+ *
+ * @sem  : Private state.
+ * @value: Value to move semaphore.
+ * @ms   : Milliseconds before timeout.
+ * @undo : Undo the change if the process exits.
+ * Return: -1 on error (errno EAGAIN on timeout), MSEM_RELAXED if
+ *         the lock completed across a relax (see sysv_set), else 1.
+ */
+static int pool_set_value(void *sem, int value, int ms, bool undo)
+{
+        struct msem_pool *p = sem;
+        struct msem_changes *ch = &pool->entry[p->entry].changes;
+        struct timespec timeout;
+        struct sembuf op;
+        uint32_t relaxes;
+        int r;
+
+        if (value == 0) {
+                WARN("Semaphore operation value 0 not permitted.\n");
+                return -1;
+        }
+        if (value < -MSEM_SEMVMX) {
+                WARN("Cannot take %d tokens at once.\n", -value);
+                errno = ERANGE;
+                return -1;
+        }
+        if (value > 0) {
+                r = msem_semop_give(p->semid, p->num, value, undo);
+                msem_changed(&pool->entry[p->entry].changes, 0);
+                return (r < value) ? -1 : 1;
+        }
+
+        op.sem_num = p->num;
+        op.sem_op  = value;
+        op.sem_flg = (undo) ? SEM_UNDO : 0;
+
+        relaxes = __atomic_load_n(&ch->relaxes, __ATOMIC_SEQ_CST);
+
+        /* A lock may be about to wait, which changes the waiter count. */
+        if (value < 0) {
+                msem_changed(ch, 0);
+        }
+
+        r = msem_operation(p->semid, &op, 1, msem_timeout(ms, &timeout));
+
+        msem_changed(ch, 0);
+
+        if (r == -1) {
+                return -1;
+        }
+
+        return (value < 0 && __atomic_load_n(&ch->relaxes, __ATOMIC_SEQ_CST) != relaxes) ? MSEM_RELAXED : 1;
+}
+
+
+/**
+ * pool_trylock
+ * ````````````
+ * Take one token if there is one, without waiting.
+ *
+ * @sem  : Private state.
+ * @undo : Undo the change if the process exits.
+ * Return: 1 if a token was taken, 0 if there was none, -1 on error.
+ */
+static int pool_trylock(void *sem, bool undo)
+{
+        struct msem_pool *p = sem;
+        struct sembuf op;
+
+        op.sem_num = p->num;
+        op.sem_op  = -1;
+        op.sem_flg = IPC_NOWAIT | ((undo) ? SEM_UNDO : 0);
+
+        if (semop(p->semid, &op, 1) == -1) {
+                if (errno == EAGAIN) {
+                        return 0;
+                }
+                WARN("(%d) Semaphore operation failed.\n", errno);
+                return -1;
+        }
+
+        msem_changed(&pool->entry[p->entry].changes, 0);
+
+        return 1;
+}
+
+
+static struct msem_changes *pool_changes(void *sem, int *flags)
+{
+        *flags = 0;
+
+        return &pool->entry[((struct msem_pool *)sem)->entry].changes;
+}
+
+
+static int pool_member(void *sem, unsigned short *num)
+{
+        *num = ((struct msem_pool *)sem)->num;
+
+        return ((struct msem_pool *)sem)->semid;
+}
+
+
+const struct msem_engine msem_pool_engine = {
+        .name   = "pool",
+        .open   = pool_open,
+        .close  = pool_close,
+        .remove = pool_remove,
+        .exists = pool_exists,
+        .query  = pool_query,
+        .set    = pool_set_value,
+        .member = pool_member,
+        .changes = pool_changes,
+        .trylock = pool_trylock
+};
@@ -0,0 +1,576 @@
+#define _JDL_NO_PRINT_DEBUG
+#define _JDL_NO_PRINT_WARN
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <semaphore.h>
+#include <sys/types.h>
+#include <sys/ipc.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <j/time.h>
+#include <j/debug.h>
+#include "msem.h"
+#include "msem_engine.h"
+
+/******************************************************************************
+ * POSIX ENGINE
+ *
+ * The semaphore is a POSIX named semaphore (see sem_overview(7)),
+ * named after the same key the System V engine would use, so a
+ * given @path:@tag maps to one name on every process.
+ *
+ * POSIX semaphores only report their value. The rest of what
+ * msem_query() answers is kept in a small POSIX shared memory
+ * object of the same name beside the semaphore, and so is what a
+ * relax needs: lock waiters sleep there with a futex, on a word
+ * which every unlock moves on and on the generation, rather than
+ * in sem_wait(), so that a relax can release them without tokens.
+ *
+ * NOTE
+ * There is no kernel undo for POSIX semaphores, so the "with undo"
+ * operations behave exactly like the plain ones.
+ *
+ * POSIX semaphores keep no count of the processes using them, and
+ * persist until they are removed (msem -d), like files.
+ *
+ ******************************************************************************/
+
+/*
+ * The shared information object.
+ *
+ * @nwait: # of lock waiters sleeping on @posts or @gen.
+ * @posts: Moved on at every unlock (futex).
+ * @pid  : PID of the last process to change the value.
+ * @otime: Time of the last change to the value.
+ * @ctime: Time the semaphore was created.
+ * @gen  : Generation, counting relaxes (see msem_gen_bump).
+ * @gwait: # of waiters sleeping until @gen moves.
+ * @seq  : Sequence number, counting relaxes (see msem_gen_next).
+ * @flags: MSEM_ flags given when the semaphore was created.
+ * @changes: Moved on at every change (see msem_watch).
+ * @queue: Waiters, if the semaphore is ordered (MSEM_ORDERED).
+ * @holders: Holders, if the semaphore is robust (MSEM_ROBUST).
+ */
+struct msem_posix_info {
+        uint32_t nwait;
+        uint32_t posts;
+        pid_t    pid;
+        int64_t  otime;
+        int64_t  ctime;
+        uint32_t gen;
+        uint32_t gwait;
+        uint64_t seq;
+        int32_t  flags;
+        struct msem_changes changes;
+        struct msem_queue queue;
+        struct msem_holders holders;
+};
+
+/*
+ * The private state of an open semaphore.
+ */
+struct msem_posix {
+        char name[32];
+        pid_t self;
+        sem_t *sem;
+        struct msem_posix_info *info;
+};
+
+
+
+/******************************************************************************
+ * UTILITY FUNCTIONS
+ ******************************************************************************/
+
+/**
+ * posix_name
+ * ``````````
+ * Name the semaphore for @path:@tag.
+ *
+ * @name  : Buffer for the name (at least 32 bytes).
+ * @path  : Filesystem path to the semaphore.
+ * @tag   : Tag (character) indicating the region of the file at @path.
+ * @create: Create file at @path if none exists.
+ * Return : TRUE on success, else FALSE.
+ */
+static bool posix_name(char *name, char *path, char *tag, bool create)
+{
+        key_t key;
+
+        if ((key = msem_key(path, tag[0], create)) == -1) {
+                return false;
+        }
+
+        snprintf(name, 32, "/msem.%08x", (unsigned)key);
+
+        return true;
+}
+
+
+/**
+ * posix_info
+ * ``````````
+ * Map the information object beside a semaphore.
+ *
+ * @name : Name of the semaphore.
+ * Return: Mapped object, or NULL on error.
+ *
+ * NOTE
+ * Every opener sizes the object before mapping it, so that
+ * no one can map it while it is still empty. Resizing it to
+ * the size it already has leaves the contents alone.
+ */
+static struct msem_posix_info *posix_info(char *name)
+{
+        struct msem_posix_info *info;
+        int fd;
+
+        if ((fd = shm_open(name, O_RDWR|O_CREAT, 0777)) == -1) {
+                ERROR("(%d) Could not open %s\n", errno, name);
+                return NULL;
+        }
+
+        if (ftruncate(fd, sizeof(struct msem_posix_info)) == -1) {
+                ERROR("(%d) Could not size %s\n", errno, name);
+                close(fd);
+                return NULL;
+        }
+
+        info = mmap(NULL, sizeof(struct msem_posix_info), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+
+        return (info == MAP_FAILED) ? NULL : info;
+}
+
+
+
+/******************************************************************************
+ * ENGINE OPERATIONS
+ ******************************************************************************/
+
+/**
+ * posix_open
+ * ``````````
+ * Create or open the named semaphore for @path:@tag.
+ *
+ * @path : Filesystem path to the semaphore.
+ * @tag  : Tag (character) indicating the region of the file at @path.
+ * @init : Initial value to set the semaphore if it is created.
+ * @excl : Fail with EEXIST if the semaphore already exists.
+ * @flags: MSEM_ flags for the semaphore if it is created.
+ * Return: Private state, or NULL on error.
+ */
+static void *posix_open(char *path, char *tag, int init, bool excl, int flags)
+{
+        struct msem_posix *p;
+        bool created = true;
+
+        if ((p = calloc(1, sizeof(struct msem_posix))) == NULL) {
+                return NULL;
+        }
+
+        if (!posix_name(p->name, path, tag, true)) {
+                ERROR("Could not fetch key for file %s[%c]\n", path, tag[0]);
+                goto fail;
+        }
+
+        if ((p->sem = sem_open(p->name, O_CREAT|O_EXCL, 0777, init)) == SEM_FAILED) {
+                if (errno != EEXIST || excl) {
+                        goto fail;
+                }
+                if ((p->sem = sem_open(p->name, 0)) == SEM_FAILED) {
+                        ERROR("Still could not open semaphore\n");
+                        goto fail;
+                }
+                created = false;
+        }
+
+        if ((p->info = posix_info(p->name)) == NULL) {
+                sem_close(p->sem);
+                goto fail;
+        }
+
+        if (created) {
+                DEBUG("Created new semaphore %s[%c] with value %d\n", path, tag[0], init);
+                p->info->ctime = (int64_t)time(NULL);
+                p->info->flags = flags;
+        }
+
+        p->self = getpid();
+
+        return p;
+
+fail:
+        free(p);
+        return NULL;
+}
+
+
+/**
+ * posix_close
+ * ```````````
+ * Close the semaphore and unmap its information.
+ *
+ * @sem  : Private state.
+ * Return: 1 (the semaphore persists), or -1 on error.
+ */
+static int posix_close(void *sem)
+{
+        struct msem_posix *p = sem;
+        int r = 1;
+
+        if (sem_close(p->sem) == -1) {
+                ERROR("Failed to close semaphore.\n");
+                r = -1;
+        }
+
+        munmap(p->info, sizeof(struct msem_posix_info));
+        free(p);
+
+        return r;
+}
+
+
+/**
+ * posix_remove
+ * ````````````
+ * Unlink the semaphore and its information object.
+ *
+ * @sem  : Private state.
+ * Return: TRUE on success, else -1.
+ */
+static int posix_remove(void *sem)
+{
+        struct msem_posix *p = sem;
+
+        shm_unlink(p->name);
+
+        if (sem_unlink(p->name) == -1) {
+                WARN("Failed to remove semaphore.\n");
+                return -1;
+        }
+
+        return 1;
+}
+
+
+/**
+ * posix_exists
+ * ````````````
+ * @path : Filesystem path to the semaphore.
+ * @tag  : Tag (character) indicating the region of the file at @path.
+ * Return: TRUE if a named semaphore exists for @path:@tag.
+ */
+static bool posix_exists(char *path, char *tag)
+{
+        char name[32];
+        sem_t *sem;
+
+        if (!posix_name(name, path, tag, false)) {
+                return false;
+        }
+        if ((sem = sem_open(name, 0)) == SEM_FAILED) {
+                return false;
+        }
+
+        sem_close(sem);
+
+        return true;
+}
+
+
+/**
+ * posix_query
+ * ```````````
+ * Answer one of the msem_query() codes.
+ *
+ * @sem  : Private state.
+ * @code : Query code.
+ * Return: Answer, or -1 on error.
+ *
+ * NOTE
+ * Nothing waits for the value to reach zero, so 'z' is always 0,
+ * and there are no control operations after creation, so 'c' is
+ * the time the semaphore was created.
+ */
+static int posix_query(void *sem, char code)
+{
+        struct msem_posix *p = sem;
+        int value;
+
+        switch (code) {
+        case 'v':
+                if (sem_getvalue(p->sem, &value) == -1) {
+                        WARN("sem_getvalue failed.\n");
+                        return -1;
+                }
+                return value;
+        case 'p':
+                return (int)__atomic_load_n(&p->info->pid, __ATOMIC_RELAXED);
+        case 'n':
+                return (int)__atomic_load_n(&p->info->nwait, __ATOMIC_RELAXED) + msem_selectors(&p->info->changes);
+        case 'z':
+                return 0;
+        case 'o':
+                return (int)__atomic_load_n(&p->info->otime, __ATOMIC_RELAXED);
+        case 'c':
+                return (int)__atomic_load_n(&p->info->ctime, __ATOMIC_RELAXED);
+        case 'f':
+                return (int)p->info->flags;
+        default:
+                WARN("Invalid query_code\n");
+                return -1;
+        }
+}
+
+
+/**
+ * posix_post
+ * ``````````
+ * Give tokens, waking lock waiters.
+ *
+ * @p    : Private state.
+ * @n    : Tokens to give.
+ * Return: -1 on error, else 0.
+ */
+static int posix_post(struct msem_posix *p, int n)
+{
+        int i;
+
+        for (i=0; i<n; i++) {
+                if (sem_post(p->sem) == -1) {
+                        WARN("Semaphore operation failed.\n");
+                        return -1;
+                }
+        }
+
+        msem_gen_post(&p->info->posts, &p->info->nwait, n, 0);
+
+        return 0;
+}
+
+
+/**
+ * posix_set
+ * `````````
+ * Alter a semaphore's value by some amount.
+ *
+ * @sem  : Private state.
+ * @value: Value to move semaphore.
+ * @ms   : Milliseconds before timeout.
+ * @undo : Ignored (see above).
+ * Return: -1 on error (errno EAGAIN on timeout), MSEM_RELAXED if
+ *         a relax released the lock, else 1.
+ *
+ * NOTE
+ * POSIX semaphores move by one, so a larger @value is applied
+ * one token at a time, and what was taken is given back if the
+ * rest cannot be had. Between tokens, a lock sleeps on @posts and
+ * on the generation, read before the value (see msem_gen_sleep);
+ * a relax made since lets it through without a token.
+ */
+static int posix_set(void *sem, int value, int ms, bool undo)
+{
+        struct msem_posix *p = sem;
+        struct timespec timeout;
+        struct timespec deadline;
+        struct timespec left;
+        uint32_t posts;
+        uint32_t gen;
+        int err = 0;
+        int r;
+        int i = 0;
+
+        if (value == 0) {
+                WARN("Semaphore operation value 0 not permitted.\n");
+                return -1;
+        }
+
+        if (value > 0) {
+                if (posix_post(p, value) == -1) {
+                        return -1;
+                }
+                goto done;
+        }
+
+        if (msem_timeout(ms, &timeout) != NULL) {
+                msem_deadline(&timeout, &deadline);
+        }
+
+        gen = __atomic_load_n(&p->info->gen, __ATOMIC_SEQ_CST);
+
+        while (i < -value) {
+                posts = __atomic_load_n(&p->info->posts, __ATOMIC_SEQ_CST);
+
+                if (sem_trywait(p->sem) == 0) {
+                        i++;
+                        continue;
+                }
+                if (errno != EAGAIN) {
+                        err = errno;
+                        break;
+                }
+                if (__atomic_load_n(&p->info->gen, __ATOMIC_SEQ_CST) != gen) {
+                        err = -1;
+                        break;
+                }
+                if (ms > 0 && !msem_remaining(&deadline, &left)) {
+                        err = EAGAIN;
+                        break;
+                }
+
+                __atomic_add_fetch(&p->info->nwait, 1, __ATOMIC_SEQ_CST);
+                __atomic_add_fetch(&p->info->gwait, 1, __ATOMIC_SEQ_CST);
+                msem_changed(&p->info->changes, 0);
+
+                r = msem_gen_sleep(&p->info->posts, posts, &p->info->gen, gen, 0, (ms > 0) ? &deadline : NULL);
+
+                __atomic_sub_fetch(&p->info->gwait, 1, __ATOMIC_SEQ_CST);
+                __atomic_sub_fetch(&p->info->nwait, 1, __ATOMIC_SEQ_CST);
+                msem_changed(&p->info->changes, 0);
+
+                if (r == -1 && errno == EINTR && ms <= 0) {
+                        err = EINTR;
+                        break;
+                }
+        }
+
+        if (err != 0) {
+                /* Give back whatever was taken before the failure. */
+                if (i > 0) {
+                        posix_post(p, i);
+                }
+                if (err == -1) {
+                        return MSEM_RELAXED;
+                }
+                DEBUG("Semaphore operation failed (%d).\n", err);
+                errno = err;
+                return -1;
+        }
+
+done:
+        __atomic_store_n(&p->info->pid, p->self, __ATOMIC_RELAXED);
+        __atomic_store_n(&p->info->otime, (int64_t)time(NULL), __ATOMIC_RELAXED);
+        msem_changed(&p->info->changes, 0);
+
+        return 1;
+}
+
+
+/**
+ * posix_trylock
+ * `````````````
+ * Take one token if there is one, without waiting.
+ *
+ * @sem  : Private state.
+ * @undo : Ignored (see above).
+ * Return: 1 if a token was taken, 0 if there was none, -1 on error.
+ */
+static int posix_trylock(void *sem, bool undo)
+{
+        struct msem_posix *p = sem;
+
+        if (sem_trywait(p->sem) == -1) {
+                if (errno == EAGAIN) {
+                        return 0;
+                }
+                WARN("Semaphore operation failed.\n");
+                return -1;
+        }
+
+        __atomic_store_n(&p->info->pid, p->self, __ATOMIC_RELAXED);
+        __atomic_store_n(&p->info->otime, (int64_t)time(NULL), __ATOMIC_RELAXED);
+        msem_changed(&p->info->changes, 0);
+
+        return 1;
+}
+
+
+/**
+ * posix_relax
+ * ```````````
+ * Release everyone waiting on the semaphore.
+ *
+ * @sem  : Private state.
+ * Return: 1.
+ *
+ * NOTE
+ * The generation lives in the information object, which is shared
+ * memory like any other, so waiters in posix_await sleep on it
+ * with a futex, exactly as the futex engine's do, and so do lock
+ * waiters in posix_set, which go through without a token. The
+ * value is left alone, so a waiter which times out or dies before
+ * it is woken leaves nothing behind.
+ */
+static int posix_relax(void *sem)
+{
+        struct msem_posix *p = sem;
+
+        msem_gen_bump(&p->info->gen, &p->info->gwait, &p->info->seq, 0);
+
+        __atomic_store_n(&p->info->pid, p->self, __ATOMIC_RELAXED);
+        __atomic_store_n(&p->info->otime, (int64_t)time(NULL), __ATOMIC_RELAXED);
+        msem_changes_relax(&p->info->changes, 0);
+
+        return 1;
+}
+
+
+static int posix_await(void *sem, int ms)
+{
+        struct msem_posix *p = sem;
+
+        return msem_gen_wait(&p->info->gen, &p->info->gwait, 0, ms);
+}
+
+
+static int64_t posix_next(void *sem, int64_t after, int ms)
+{
+        struct msem_posix *p = sem;
+
+        return msem_gen_next(&p->info->gen, &p->info->gwait, &p->info->seq, 0, after, ms);
+}
+
+
+static struct msem_changes *posix_changes(void *sem, int *flags)
+{
+        *flags = 0;
+
+        return &((struct msem_posix *)sem)->info->changes;
+}
+
+
+static struct msem_queue *posix_queue(void *sem, int *flags)
+{
+        *flags = 0;
+
+        return &((struct msem_posix *)sem)->info->queue;
+}
+
+
+static struct msem_holders *posix_holders(void *sem)
+{
+        return &((struct msem_posix *)sem)->info->holders;
+}
+
+
+const struct msem_engine msem_posix_engine = {
+        .name   = "posix",
+        .open   = posix_open,
+        .close  = posix_close,
+        .remove = posix_remove,
+        .exists = posix_exists,
+        .query  = posix_query,
+        .set    = posix_set,
+        .relax  = posix_relax,
+        .await  = posix_await,
+        .next   = posix_next,
+        .changes = posix_changes,
+        .trylock = posix_trylock,
+        .queue  = posix_queue,
+        .holders = posix_holders
+};
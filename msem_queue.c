@@ -0,0 +1,605 @@
+#define _JDL_NO_PRINT_DEBUG
+#define _JDL_NO_PRINT_WARN
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <errno.h>
+#include <j/time.h>
+#include <j/debug.h>
+#include "msem.h"
+#include "msem_engine.h"
+
+/******************************************************************************
+ * ORDERED QUEUES
+ *
+ * The kernel wakes the waiters of a semaphore in an order of its
+ * own choosing. The waiters of an ordered semaphore (MSEM_ORDERED)
+ * queue instead in a table of MSEM_QUEUE_SLOTS slots beside it, and
+ * an unlock hands its token straight to the best of them: highest
+ * priority first, then nearest deadline, then first to arrive.
+ * Each waiter sleeps on its own slot, so only the chosen one wakes.
+ *
+ * A waiter for more than one token is handed all of them at once,
+ * once that many are to be had (those given, topped up from the
+ * value), and never holds some while it waits for the rest. Until
+ * then, tokens go to the value, as the kernel would leave them.
+ *
+ * A token goes into the value only when no one is queued. A waiter
+ * queues itself before it looks at the value, and an unlocker that
+ * put a token in the value looks at the queue again afterwards, and
+ * takes the token back for anyone it finds. So either the unlocker
+ * sees the waiter, or the waiter sees the token.
+ *
+ * The waiters of an edge-triggered semaphore (MSEM_EDGE) queue in
+ * the same way, so that an unlock hands its tokens to them and never
+ * to the value: one who leaves before it is handed one takes nothing
+ * with it and leaves nothing behind. With no one queued, an unlock of
+ * one gives only as many tokens as there are waiters outside the
+ * table, and nothing if there are none.
+ *
+ * Waiters who find the table full wait in the engine as usual, and
+ * are served once the table is empty. A slot whose process has died
+ * (see msem_proc_dead) is reclaimed: a waiting one by the next
+ * unlock that would have chosen it, and one claimed or granted a
+ * token by the next waiter to queue or to sleep a whole slice. A
+ * token granted to the dead is passed on.
+ *
+ * NOTE
+ * Tokens handed over in the table never pass through the kernel,
+ * so a lock with undo ("-,") is undone at exit only if its token
+ * came from the value.
+ *
+ ******************************************************************************/
+
+#define SLOT_FREE    0 /* Unused.                                   */
+#define SLOT_CLAIMED 1 /* Being filled in by its waiter.            */
+#define SLOT_WAITING 2 /* Waiting for a token.                      */
+#define SLOT_GRANTED 3 /* Handed a token, not yet collected.        */
+#define SLOT_REAPING 4 /* Being reclaimed from a dead process.      */
+
+/*
+ * Longest a waiter sleeps before looking at the value again, for
+ * tokens that reach it without an unlock (an undo at exit, say).
+ */
+#define QUEUE_SLICE_MS 1000
+
+
+
+/******************************************************************************
+ * UTILITY FUNCTIONS
+ ******************************************************************************/
+
+static int queue_sleep(uint32_t *addr, uint32_t val, const struct timespec *timeout, int flags)
+{
+        return syscall(SYS_futex, addr, FUTEX_WAIT|flags, val, timeout, NULL, 0);
+}
+
+
+static void queue_wake(uint32_t *addr, int flags)
+{
+        syscall(SYS_futex, addr, FUTEX_WAKE|flags, 1, NULL, NULL, 0);
+}
+
+
+/**
+ * queue_before
+ * ````````````
+ * Whether one waiter is to be served before another.
+ *
+ * @a    : Waiter.
+ * @b    : Waiter.
+ * Return: TRUE if @a comes first.
+ */
+static bool queue_before(struct msem_waiter *a, struct msem_waiter *b)
+{
+        if (a->priority != b->priority) {
+                return (a->priority > b->priority);
+        }
+        if (a->deadline != b->deadline) {
+                return (a->deadline < b->deadline);
+        }
+
+        return (a->ticket < b->ticket);
+}
+
+
+/**
+ * queue_reap
+ * ``````````
+ * Reclaim a slot if its process has died.
+ *
+ * @w    : Slot.
+ * @state: State it was seen in.
+ * Return: TRUE if the slot was reclaimed, and is now free.
+ *
+ * NOTE
+ * A slot is emptied (@pid set to 0) before it is freed, so one
+ * freed and taken again since @pid was read no longer shows it,
+ * and is put back as it was found.
+ */
+static bool queue_reap(struct msem_waiter *w, uint32_t state)
+{
+        pid_t pid;
+        uint32_t seen = state;
+
+        if ((pid = __atomic_load_n(&w->pid, __ATOMIC_SEQ_CST)) == 0) {
+                return false;
+        }
+        if (!msem_proc_dead(pid, __atomic_load_n(&w->start, __ATOMIC_SEQ_CST))) {
+                return false;
+        }
+        if (!__atomic_compare_exchange_n(&w->state, &seen, SLOT_REAPING, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+                return false;
+        }
+        if (__atomic_load_n(&w->pid, __ATOMIC_SEQ_CST) != pid) {
+                seen = SLOT_REAPING;
+                __atomic_compare_exchange_n(&w->state, &seen, state, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+                return false;
+        }
+
+        DEBUG("Reclaiming slot of dead waiter %d.\n", pid);
+
+        __atomic_store_n(&w->pid, 0, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&w->start, 0, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&w->state, SLOT_FREE, __ATOMIC_SEQ_CST);
+
+        return true;
+}
+
+
+/**
+ * queue_sweep
+ * ```````````
+ * Reclaim the slots of dead processes which are claimed, or were
+ * granted tokens (waiting slots are left to queue_best).
+ *
+ * @q    : Queue.
+ * Return: Number of tokens granted to the dead, to be passed on.
+ */
+static int queue_sweep(struct msem_queue *q)
+{
+        uint32_t state;
+        int orphans = 0;
+        int amount;
+        int i;
+
+        for (i=0; i<MSEM_QUEUE_SLOTS; i++) {
+                state = __atomic_load_n(&q->slot[i].state, __ATOMIC_SEQ_CST);
+                if (state != SLOT_CLAIMED && state != SLOT_GRANTED) {
+                        continue;
+                }
+                amount = __atomic_load_n(&q->slot[i].amount, __ATOMIC_SEQ_CST);
+                if (queue_reap(&q->slot[i], state) && state == SLOT_GRANTED) {
+                        orphans += amount;
+                }
+        }
+
+        return orphans;
+}
+
+
+/**
+ * queue_best
+ * ``````````
+ * Find the waiter to serve next, reclaiming the slots of any dead
+ * waiters found on the way.
+ *
+ * @q    : Queue.
+ * Return: Slot of the best waiter, or -1 if no one is waiting.
+ */
+static int queue_best(struct msem_queue *q)
+{
+        struct msem_waiter *w;
+        int best;
+        int i;
+
+        for (;;) {
+                best = -1;
+
+                for (i=0; i<MSEM_QUEUE_SLOTS; i++) {
+                        w = &q->slot[i];
+                        if (__atomic_load_n(&w->state, __ATOMIC_SEQ_CST) != SLOT_WAITING) {
+                                continue;
+                        }
+                        if (best == -1 || queue_before(w, &q->slot[best])) {
+                                best = i;
+                        }
+                }
+
+                if (best == -1 || !queue_reap(&q->slot[best], SLOT_WAITING)) {
+                        return best;
+                }
+        }
+}
+
+
+/**
+ * queue_trytake
+ * `````````````
+ * Take tokens from the value, all of them or none, without ever
+ * sleeping.
+ *
+ * @engine: Engine of the semaphore.
+ * @sem   : Engine's private state.
+ * @amount: Tokens wanted.
+ * @undo  : Undo the change if the process exits.
+ * Return : Number of tokens taken: @amount, or 0; -1 on error.
+ *
+ * NOTE
+ * The engine takes one token at a time, so those taken short of
+ * @amount are put straight back.
+ */
+static int queue_trytake(const struct msem_engine *engine, void *sem, int amount, bool undo)
+{
+        int err;
+        int r = 1;
+        int i;
+
+        for (i=0; i<amount && (r = engine->trylock(sem, undo)) == 1; i++);
+
+        if (i == amount) {
+                return amount;
+        }
+        if (i > 0) {
+                err = errno;
+                engine->set(sem, i, 0, undo);
+                errno = err;
+        }
+
+        return (r == -1) ? -1 : 0;
+}
+
+
+/**
+ * queue_grant
+ * ```````````
+ * Hand the best waiter all the tokens it waits for, if there are
+ * enough of them: those in hand, topped up from the value.
+ *
+ * @engine: Engine of the semaphore.
+ * @sem   : Engine's private state.
+ * @q     : Queue.
+ * @flags : Futex flags of @q.
+ * @hand  : Tokens in hand; less those handed over.
+ * Return : TRUE if a waiter was served, FALSE if no one is waiting,
+ *          or the best waiter wants more than there are.
+ */
+static bool queue_grant(const struct msem_engine *engine, void *sem, struct msem_queue *q, int flags, int *hand)
+{
+        struct msem_waiter *w;
+        uint32_t waiting;
+        int need;
+        int have;
+        int more;
+        int i;
+
+        while ((i = queue_best(q)) != -1) {
+                w    = &q->slot[i];
+                need = __atomic_load_n(&w->amount, __ATOMIC_SEQ_CST);
+                have = (*hand < need) ? *hand : need;
+                more = 0;
+
+                if (have < need && (more = queue_trytake(engine, sem, need - have, false)) <= 0) {
+                        return false;
+                }
+
+                waiting = SLOT_WAITING;
+                if (__atomic_compare_exchange_n(&w->state, &waiting, SLOT_GRANTED, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+                        queue_wake(&w->state, flags);
+                        *hand -= have;
+                        return true;
+                }
+
+                /* It left (or was served) meanwhile. */
+                if (more > 0) {
+                        engine->set(sem, more, 0, false);
+                }
+        }
+
+        return false;
+}
+
+
+/**
+ * queue_leave
+ * ```````````
+ * Give up a slot.
+ *
+ * @w    : The caller's slot.
+ * Return: TRUE if the slot had been granted a token, which the
+ *         caller now holds.
+ *
+ * NOTE
+ * A reaper which mistook the slot for another's puts it back at
+ * once (see queue_reap), so the caller waits for that.
+ */
+static bool queue_leave(struct msem_waiter *w)
+{
+        uint32_t state;
+
+        __atomic_store_n(&w->pid, 0, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&w->start, 0, __ATOMIC_SEQ_CST);
+
+        for (;;) {
+                state = SLOT_WAITING;
+                if (__atomic_compare_exchange_n(&w->state, &state, SLOT_FREE, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+                        return false;
+                }
+                if (state == SLOT_GRANTED && __atomic_compare_exchange_n(&w->state, &state, SLOT_FREE, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+                        return true;
+                }
+                sched_yield();
+        }
+}
+
+
+static void queue_changed(const struct msem_engine *engine, void *sem)
+{
+        struct msem_changes *ch;
+        int flags;
+
+        if (engine->changes != NULL) {
+                ch = engine->changes(sem, &flags);
+                msem_changed(ch, flags);
+        }
+}
+
+
+/**
+ * queue_take
+ * ``````````
+ * Wait in the queue for tokens, all at once.
+ *
+ * @engine  : Engine of the semaphore.
+ * @sem     : Engine's private state.
+ * @amount  : Tokens to take.
+ * @priority: Priority of the waiter.
+ * @deadline: Absolute CLOCK_MONOTONIC deadline, or NULL for none.
+ * @undo    : Undo the change if the process exits.
+ * Return   : -1 on error (errno EAGAIN on timeout), else 1.
+ */
+static int queue_take(const struct msem_engine *engine, void *sem, int amount, int priority, const struct timespec *deadline, bool undo)
+{
+        struct msem_queue *q;
+        struct msem_waiter *w = NULL;
+        struct timespec left;
+        struct timespec slice;
+        uint32_t unused;
+        int orphans;
+        int flags;
+        int err;
+        int r;
+        int i;
+
+        q = engine->queue(sem, &flags);
+
+        if ((orphans = queue_sweep(q)) > 0) {
+                msem_queue_give(engine, sem, orphans, false);
+        }
+
+        for (i=0; i<MSEM_QUEUE_SLOTS && w == NULL; i++) {
+                unused = SLOT_FREE;
+                if (__atomic_compare_exchange_n(&q->slot[i].state, &unused, SLOT_CLAIMED, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+                        w = &q->slot[i];
+                }
+        }
+
+        if (w == NULL) {
+                DEBUG("Queue full, waiting in the engine.\n");
+                if (deadline != NULL && !msem_remaining(deadline, &left)) {
+                        errno = EAGAIN;
+                        return -1;
+                }
+                return engine->set(sem, -amount, (deadline != NULL) ? (int)(left.tv_sec * SEC_IN_MS + left.tv_nsec / NANO_IN_MILLI) + 1 : 0, undo);
+        }
+
+        w->priority = priority;
+        w->amount   = amount;
+        w->start    = msem_proc_self();
+        w->pid      = getpid();
+        w->deadline = (deadline != NULL) ? (int64_t)deadline->tv_sec * 1000000000 + deadline->tv_nsec : INT64_MAX;
+        w->ticket   = __atomic_fetch_add(&q->ticket, 1, __ATOMIC_SEQ_CST);
+
+        __atomic_store_n(&w->state, SLOT_WAITING, __ATOMIC_SEQ_CST);
+        queue_changed(engine, sem);
+
+        for (;;) {
+                if (__atomic_load_n(&w->state, __ATOMIC_SEQ_CST) == SLOT_GRANTED) {
+                        queue_leave(w);
+                        r = 1;
+                        break;
+                }
+
+                if ((r = queue_trytake(engine, sem, amount, undo)) == amount) {
+                        if (queue_leave(w)) {
+                                /* Handed them as well: pass them on. */
+                                msem_queue_give(engine, sem, amount, false);
+                        }
+                        r = 1;
+                        break;
+                }
+
+                if (r == -1 || (deadline != NULL && !msem_remaining(deadline, &left))) {
+                        err = (r == -1) ? errno : EAGAIN;
+                        if (queue_leave(w)) {
+                                r = 1;
+                                break;
+                        }
+                        queue_changed(engine, sem);
+                        errno = err;
+                        return -1;
+                }
+
+                msem_timeout(QUEUE_SLICE_MS, &slice);
+                if (deadline != NULL && (left.tv_sec < slice.tv_sec || (left.tv_sec == slice.tv_sec && left.tv_nsec < slice.tv_nsec))) {
+                        slice = left;
+                }
+
+                if (queue_sleep(&w->state, SLOT_WAITING, &slice, flags) == -1 && errno == ETIMEDOUT) {
+                        if ((orphans = queue_sweep(q)) > 0) {
+                                msem_queue_give(engine, sem, orphans, false);
+                        }
+                }
+        }
+
+        queue_changed(engine, sem);
+
+        return r;
+}
+
+
+
+/******************************************************************************
+ * QUEUE OPERATIONS
+ ******************************************************************************/
+
+/**
+ * msem_queue_lock
+ * ```````````````
+ * Lock an ordered semaphore, waiting in its queue.
+ *
+ * @engine  : Engine of the semaphore.
+ * @sem     : Engine's private state.
+ * @amount  : Tokens to take.
+ * @priority: Priority of the waiter (higher first).
+ * @ms      : Milliseconds before timeout (<= 0 for none), which
+ *            is also the waiter's deadline.
+ * @undo    : Undo the change if the process exits.
+ * Return   : -1 on error (errno EAGAIN on timeout), else 1.
+ *
+ * NOTE
+ * All @amount tokens are handed over at once (see queue_grant), so
+ * a waiter never holds some of them while it waits for the rest.
+ */
+int msem_queue_lock(const struct msem_engine *engine, void *sem, int amount, int priority, int ms, bool undo)
+{
+        struct timespec timeout;
+        struct timespec deadline;
+        struct timespec *dl = NULL;
+
+        if (msem_timeout(ms, &timeout) != NULL) {
+                msem_deadline(&timeout, &deadline);
+                dl = &deadline;
+        }
+
+        return queue_take(engine, sem, amount, priority, dl, undo);
+}
+
+
+/**
+ * msem_queue_give
+ * ```````````````
+ * Unlock a queued semaphore, handing the tokens to the best
+ * waiters in its queue while there are enough for each, and the
+ * rest to the value.
+ *
+ * @engine: Engine of the semaphore.
+ * @sem   : Engine's private state.
+ * @amount: Tokens to give.
+ * @undo  : Undo the change if the process exits.
+ * Return : -1 on error, else 1.
+ *
+ * NOTE
+ * If the semaphore is edge-triggered (MSEM_EDGE), the tokens left
+ * once the queue is empty go to the value only as far as there are
+ * waiters outside the table (the engine's 'n') to take them.
+ */
+int msem_queue_give(const struct msem_engine *engine, void *sem, int amount, bool undo)
+{
+        struct msem_queue *q;
+        int flags;
+        int n;
+
+        q = engine->queue(sem, &flags);
+
+        while (amount > 0 && queue_grant(engine, sem, q, flags, &amount));
+
+        if (amount > 0 && (engine->query(sem, 'f') & MSEM_EDGE) && queue_best(q) == -1) {
+                /* No one queued: only those outside the table. */
+                if ((n = engine->query(sem, 'n')) < amount) {
+                        amount = (n > 0) ? n : 0;
+                }
+        }
+
+        if (amount > 0) {
+                if (engine->set(sem, amount, 0, undo) == -1) {
+                        return -1;
+                }
+                /* Anyone who queued meanwhile may have missed them. */
+                amount = 0;
+                while (queue_grant(engine, sem, q, flags, &amount));
+        }
+
+        queue_changed(engine, sem);
+
+        return 1;
+}
+
+
+/**
+ * msem_queue_relax
+ * ````````````````
+ * Hand one token to every waiter in the queue of an ordered
+ * semaphore.
+ *
+ * @engine: Engine of the semaphore.
+ * @sem   : Engine's private state.
+ * Return : Number of waiters given a token.
+ *
+ * NOTE
+ * Each slot is looked at once, so waiters who queue during the
+ * relax may or may not be served by it, as with the kernel's own
+ * queue. The order does not matter, since everyone gets a token.
+ */
+int msem_queue_relax(const struct msem_engine *engine, void *sem)
+{
+        struct msem_queue *q;
+        uint32_t waiting;
+        int flags;
+        int n = 0;
+        int i;
+
+        q = engine->queue(sem, &flags);
+
+        for (i=0; i<MSEM_QUEUE_SLOTS; i++) {
+                waiting = SLOT_WAITING;
+                if (__atomic_compare_exchange_n(&q->slot[i].state, &waiting, SLOT_GRANTED, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+                        queue_wake(&q->slot[i].state, flags);
+                        n++;
+                }
+        }
+
+        if (n > 0) {
+                queue_changed(engine, sem);
+        }
+
+        return n;
+}
+
+
+/**
+ * msem_queue_count
+ * ````````````````
+ * The number of waiters in a queue.
+ *
+ * @q    : Queue.
+ * Return: Number of waiters.
+ */
+int msem_queue_count(struct msem_queue *q)
+{
+        int n = 0;
+        int i;
+
+        for (i=0; i<MSEM_QUEUE_SLOTS; i++) {
+                if (__atomic_load_n(&q->slot[i].state, __ATOMIC_SEQ_CST) == SLOT_WAITING) {
+                        n++;
+                }
+        }
+
+        return n;
+}
@@ -0,0 +1,737 @@
+#define _JDL_NO_PRINT_DEBUG
+#define _JDL_NO_PRINT_WARN
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <linux/futex.h>
+#include <errno.h>
+#include <j/time.h>
+#include <j/debug.h>
+#include "msem.h"
+#include "msem_engine.h"
+
+/******************************************************************************
+ * WAIT RINGS
+ *
+ * A ring lets one thread wait to lock any number of semaphores at
+ * once, without a thread (or process) per wait. Each wait is an
+ * io_uring FUTEX_WAITV on the semaphore's counter and generation,
+ * linked to a LINK_TIMEOUT if it has a timeout. Waits are queued as they are
+ * added and submitted together in a single system call when the
+ * ring is next reaped; wakeups come back as completions.
+ *
+ * Only engines which keep a counter (futex, local) can be waited
+ * on this way.
+ *
+ * A relax moves the generation on, and releases each wait made
+ * before it without a token, as it does the engine's own waiters
+ * (see msem_counter_relax).
+ *
+ * Requires Linux 6.7 or later (IORING_OP_FUTEX_WAITV).
+ *
+ ******************************************************************************/
+
+/* Not yet in every copy of the uapi headers. */
+#ifndef IORING_OP_FUTEX_WAITV
+#define IORING_OP_FUTEX_WAITV 53
+#endif
+
+/*
+ * The low bit of a completion's user_data is set for the
+ * LINK_TIMEOUT half of a wait (struct msem_ring_wait is aligned).
+ */
+#define TIMEOUT_BIT 1UL
+
+
+/*
+ * One outstanding wait.
+ *
+ * @next   : Next wait on the ring's live or ready list.
+ * @prev   : Previous wait on the live list.
+ * @c      : Counter being waited on.
+ * @gen    : Generation of @c when the wait was made.
+ * @fv     : The value and generation words, as read by the kernel.
+ * @semid  : Handle being waited on.
+ * @data   : Caller's pointer.
+ * @ms     : Timeout given (<= 0 for none).
+ * @deadline: Absolute CLOCK_MONOTONIC deadline, if @ms > 0.
+ * @ts     : Relative timeout read by the kernel at submission.
+ * @pending: # of completions still to come from the kernel.
+ * @armed  : Counted in the counter's @nwait and @gwait.
+ * @result : 1 if locked or relaxed, 0 if timed out, -1 on error,
+ *           once done.
+ * @error  : errno, if @result is -1.
+ * @done   : @result is final (the wait is on the ready list).
+ */
+struct msem_ring_wait {
+        struct msem_ring_wait *next;
+        struct msem_ring_wait *prev;
+        struct msem_counter *c;
+        uint32_t gen;
+        struct futex_waitv fv[2];
+        int semid;
+        void *data;
+        int ms;
+        struct timespec deadline;
+        struct __kernel_timespec ts;
+        int pending;
+        bool armed;
+        int result;
+        int error;
+        bool done;
+};
+
+
+/*
+ * A ring and its mappings.
+ */
+struct msem_ring {
+        int fd;
+        pid_t self;
+        unsigned entries;
+        unsigned queued;
+
+        unsigned *sq_head;
+        unsigned *sq_tail;
+        unsigned *sq_mask;
+        unsigned *sq_array;
+        struct io_uring_sqe *sqes;
+
+        unsigned *cq_head;
+        unsigned *cq_tail;
+        unsigned *cq_mask;
+        struct io_uring_cqe *cqes;
+
+        void  *sq_map;
+        size_t sq_len;
+        void  *cq_map;
+        size_t cq_len;
+        size_t sqes_len;
+
+        struct msem_ring_wait *live;
+        struct msem_ring_wait *ready;
+        struct msem_ring_wait *ready_tail;
+};
+
+
+
+/******************************************************************************
+ * UTILITY FUNCTIONS
+ ******************************************************************************/
+
+static int ring_setup(unsigned entries, struct io_uring_params *p)
+{
+        return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int ring_enter(int fd, unsigned submit, unsigned wait, unsigned flags, void *arg, size_t argsz)
+{
+        return syscall(__NR_io_uring_enter, fd, submit, wait, flags, arg, argsz);
+}
+
+static int ring_register(int fd, unsigned op, void *arg, unsigned nargs)
+{
+        return syscall(__NR_io_uring_register, fd, op, arg, nargs);
+}
+
+
+/**
+ * ring_supported
+ * ``````````````
+ * Ask the kernel whether it can wait on futexes through a ring.
+ *
+ * @fd   : Ring file descriptor.
+ * Return: TRUE if IORING_OP_FUTEX_WAITV is supported.
+ */
+static bool ring_supported(int fd)
+{
+        struct io_uring_probe *probe;
+        size_t len;
+        bool r = false;
+
+        len   = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+        probe = calloc(1, len);
+
+        if (probe != NULL && ring_register(fd, IORING_REGISTER_PROBE, probe, 256) == 0) {
+                r = (probe->last_op >= IORING_OP_FUTEX_WAITV
+                 && (probe->ops[IORING_OP_FUTEX_WAITV].flags & IO_URING_OP_SUPPORTED));
+        }
+
+        free(probe);
+
+        return r;
+}
+
+
+/**
+ * ring_submit
+ * ```````````
+ * Hand every queued submission to the kernel, and optionally
+ * wait for completions.
+ *
+ * @ring   : Ring.
+ * @wait   : Minimum number of completions to wait for.
+ * @timeout: Longest time to wait, or NULL for no limit.
+ * Return  : -1 on error (errno ETIME if @timeout expired), else 0.
+ */
+static int ring_submit(struct msem_ring *ring, unsigned wait, const struct timespec *timeout)
+{
+        struct io_uring_getevents_arg arg;
+        struct __kernel_timespec ts;
+        unsigned flags = 0;
+        int r;
+
+        memset(&arg, 0, sizeof(arg));
+
+        if (wait > 0) {
+                flags |= IORING_ENTER_GETEVENTS;
+        }
+        if (timeout != NULL) {
+                ts.tv_sec  = timeout->tv_sec;
+                ts.tv_nsec = timeout->tv_nsec;
+                arg.ts     = (uint64_t)(uintptr_t)&ts;
+                flags     |= IORING_ENTER_EXT_ARG;
+        }
+
+        r = ring_enter(ring->fd, ring->queued, wait, flags, (timeout) ? (void *)&arg : NULL, (timeout) ? sizeof(arg) : 0);
+
+        if (r > 0) {
+                ring->queued -= (unsigned)r;
+        }
+
+        return (r < 0) ? -1 : 0;
+}
+
+
+/**
+ * ring_sqes
+ * `````````
+ * Reserve consecutive submission queue entries.
+ *
+ * @ring : Ring.
+ * @n    : Number of entries wanted.
+ * Return: First entry (zeroed), or NULL if the queue stays full.
+ *
+ * NOTE
+ * The entries are published by ring_publish once filled in. A
+ * full queue is flushed to the kernel to make room.
+ */
+static struct io_uring_sqe *ring_sqes(struct msem_ring *ring, unsigned n)
+{
+        unsigned head;
+        unsigned tail = *ring->sq_tail;
+        unsigned i;
+
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+        if (tail - head + n > ring->entries) {
+                ring_submit(ring, 0, NULL);
+                head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+                if (tail - head + n > ring->entries) {
+                        errno = EBUSY;
+                        return NULL;
+                }
+        }
+
+        for (i=0; i<n; i++) {
+                ring->sq_array[(tail + i) & *ring->sq_mask] = (tail + i) & *ring->sq_mask;
+                memset(&ring->sqes[(tail + i) & *ring->sq_mask], 0, sizeof(struct io_uring_sqe));
+        }
+
+        return &ring->sqes[tail & *ring->sq_mask];
+}
+
+
+static struct io_uring_sqe *ring_sqe_at(struct msem_ring *ring, unsigned i)
+{
+        return &ring->sqes[(*ring->sq_tail + i) & *ring->sq_mask];
+}
+
+
+static void ring_publish(struct msem_ring *ring, unsigned n)
+{
+        __atomic_store_n(ring->sq_tail, *ring->sq_tail + n, __ATOMIC_RELEASE);
+        ring->queued += n;
+}
+
+
+/**
+ * ring_arm
+ * ````````
+ * Queue a FUTEX_WAITV for a wait, on the counter's value and
+ * generation, linked to a LINK_TIMEOUT if the wait has a deadline.
+ *
+ * @ring : Ring.
+ * @w    : Wait.
+ * @seen : Counter value to sleep on.
+ * Return: -1 on error, else 0.
+ */
+static int ring_arm(struct msem_ring *ring, struct msem_ring_wait *w, int32_t seen)
+{
+        struct io_uring_sqe *sqe;
+        struct timespec left;
+        unsigned n = (w->ms > 0) ? 2 : 1;
+
+        if ((sqe = ring_sqes(ring, n)) == NULL) {
+                return -1;
+        }
+
+        w->fv[0].val        = (uint32_t)seen;
+        w->fv[0].uaddr      = (uint64_t)(uintptr_t)&w->c->value;
+        w->fv[0].flags      = FUTEX_32 | (w->c->futex_flags & FUTEX_PRIVATE_FLAG);
+        w->fv[0].__reserved = 0;
+
+        w->fv[1].val        = w->gen;
+        w->fv[1].uaddr      = (uint64_t)(uintptr_t)&w->c->gen;
+        w->fv[1].flags      = FUTEX_32 | (w->c->futex_flags & FUTEX_PRIVATE_FLAG);
+        w->fv[1].__reserved = 0;
+
+        sqe->opcode    = IORING_OP_FUTEX_WAITV;
+        sqe->addr      = (uint64_t)(uintptr_t)w->fv;
+        sqe->len       = 2;
+        sqe->user_data = (uint64_t)(uintptr_t)w;
+
+        if (w->ms > 0) {
+                msem_remaining(&w->deadline, &left);
+                w->ts.tv_sec  = left.tv_sec;
+                w->ts.tv_nsec = left.tv_nsec;
+
+                sqe->flags |= IOSQE_IO_LINK;
+
+                sqe = ring_sqe_at(ring, 1);
+                sqe->opcode    = IORING_OP_LINK_TIMEOUT;
+                sqe->fd        = -1;
+                sqe->addr      = (uint64_t)(uintptr_t)&w->ts;
+                sqe->len       = 1;
+                sqe->user_data = (uint64_t)(uintptr_t)w | TIMEOUT_BIT;
+        }
+
+        ring_publish(ring, n);
+
+        w->pending += n;
+
+        if (!w->armed) {
+                __atomic_add_fetch(&w->c->nwait, 1, __ATOMIC_SEQ_CST);
+                __atomic_add_fetch(&w->c->gwait, 1, __ATOMIC_SEQ_CST);
+                msem_changed(&w->c->changes, w->c->futex_flags);
+                w->armed = true;
+        }
+
+        return 0;
+}
+
+
+/**
+ * ring_finish
+ * ```````````
+ * Give a wait its result and move it to the ready list.
+ *
+ * @ring  : Ring.
+ * @w     : Wait.
+ * @result: 1 if locked or relaxed, 0 if timed out, -1 on error.
+ * @error : errno, if @result is -1.
+ * Return : Nothing.
+ */
+static void ring_finish(struct msem_ring *ring, struct msem_ring_wait *w, int result, int error)
+{
+        if (w->armed) {
+                __atomic_sub_fetch(&w->c->gwait, 1, __ATOMIC_SEQ_CST);
+                __atomic_sub_fetch(&w->c->nwait, 1, __ATOMIC_SEQ_CST);
+                msem_changed(&w->c->changes, w->c->futex_flags);
+                w->armed = false;
+        }
+
+        w->result = result;
+        w->error  = error;
+        w->done   = true;
+
+        /* Off the live list... */
+        if (w->prev) {
+                w->prev->next = w->next;
+        } else {
+                ring->live = w->next;
+        }
+        if (w->next) {
+                w->next->prev = w->prev;
+        }
+
+        /* ...and onto the end of the ready list. */
+        w->next = NULL;
+        w->prev = NULL;
+        if (ring->ready_tail) {
+                ring->ready_tail->next = w;
+        } else {
+                ring->ready = w;
+        }
+        ring->ready_tail = w;
+}
+
+
+/**
+ * ring_try
+ * ````````
+ * Try to lock for a wait; if there is no token, re-arm it, and
+ * if time is up, time it out. A relax since the wait was made
+ * finishes it without a token.
+ *
+ * @ring   : Ring.
+ * @w      : Wait.
+ * @expired: The kernel cancelled the wait at its deadline.
+ * Return  : Nothing.
+ */
+static void ring_try(struct msem_ring *ring, struct msem_ring_wait *w, bool expired)
+{
+        struct timespec left;
+        int32_t seen;
+
+        if (msem_counter_trylock(w->c, ring->self, &seen)) {
+                ring_finish(ring, w, 1, 0);
+                return;
+        }
+        if (__atomic_load_n(&w->c->gen, __ATOMIC_SEQ_CST) != w->gen) {
+                ring_finish(ring, w, 1, 0);
+                return;
+        }
+        if (expired || (w->ms > 0 && !msem_remaining(&w->deadline, &left))) {
+                ring_finish(ring, w, 0, 0);
+                return;
+        }
+        if (ring_arm(ring, w, seen) == -1) {
+                ring_finish(ring, w, -1, errno);
+        }
+}
+
+
+/**
+ * ring_reap_cqes
+ * ``````````````
+ * Consume every completion the kernel has posted.
+ *
+ * @ring : Ring.
+ * Return: Nothing.
+ */
+static void ring_reap_cqes(struct msem_ring *ring)
+{
+        struct msem_ring_wait *w;
+        struct io_uring_cqe *cqe;
+        unsigned head = *ring->cq_head;
+        unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+        for (; head != tail; head++) {
+                cqe = &ring->cqes[head & *ring->cq_mask];
+                w   = (struct msem_ring_wait *)(uintptr_t)(cqe->user_data & ~TIMEOUT_BIT);
+
+                w->pending--;
+
+                if (cqe->user_data & TIMEOUT_BIT) {
+                        /* The timeout half; the futex half says what happened. */
+                } else if (!w->done) {
+                        switch (cqe->res) {
+                        case -EAGAIN:         /* A word moved before sleeping */
+                        case -EINTR:
+                                ring_try(ring, w, false);
+                                break;
+                        case -ECANCELED:      /* LINK_TIMEOUT fired */
+                                ring_try(ring, w, true);
+                                break;
+                        default:
+                                if (cqe->res >= 0) {
+                                        /* Woken: the index of the word that moved */
+                                        ring_try(ring, w, false);
+                                } else {
+                                        ring_finish(ring, w, -1, -cqe->res);
+                                }
+                                break;
+                        }
+                }
+
+                if (w->done && w->pending == 0 && w->result == 2) {
+                        free(w);
+                }
+        }
+
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+
+/**
+ * ring_deliver
+ * ````````````
+ * Copy finished waits from the ready list to the caller.
+ *
+ * @ring  : Ring.
+ * @events: Caller's array.
+ * @max   : Size of @events.
+ * Return : Number of events delivered.
+ *
+ * NOTE
+ * A delivered wait may still have a completion to come from the
+ * kernel (the cancelled half of a linked pair). It is marked as
+ * delivered (result 2) and freed when that completion arrives.
+ */
+static int ring_deliver(struct msem_ring *ring, struct msem_ring_event *events, int max)
+{
+        struct msem_ring_wait *w;
+        int n = 0;
+
+        while (n < max && (w = ring->ready) != NULL) {
+                if ((ring->ready = w->next) == NULL) {
+                        ring->ready_tail = NULL;
+                }
+
+                events[n].semid  = w->semid;
+                events[n].data   = w->data;
+                events[n].result = w->result;
+                events[n].error  = w->error;
+                n++;
+
+                if (w->pending == 0) {
+                        free(w);
+                } else {
+                        w->result = 2;
+                }
+        }
+
+        return n;
+}
+
+
+
+/******************************************************************************
+ * PUBLIC INTERFACE
+ ******************************************************************************/
+
+/**
+ * msem_ring_open
+ * ``````````````
+ * Create a wait ring.
+ *
+ * @entries: Submission queue size: the most waits that can be
+ *           queued between two calls to msem_ring_reap (each wait
+ *           with a timeout takes two entries). There is no limit
+ *           on the number of waits outstanding.
+ * Return  : Ring, or NULL on error (errno EOPNOTSUPP if the kernel
+ *           cannot wait on futexes through io_uring).
+ */
+struct msem_ring *msem_ring_open(unsigned entries)
+{
+        struct io_uring_params p;
+        struct msem_ring *ring;
+
+        if ((ring = calloc(1, sizeof(struct msem_ring))) == NULL) {
+                return NULL;
+        }
+
+        memset(&p, 0, sizeof(p));
+
+        if ((ring->fd = ring_setup(entries, &p)) == -1) {
+                ERROR("(%d) Could not set up io_uring.\n", errno);
+                free(ring);
+                return NULL;
+        }
+
+        if (!ring_supported(ring->fd) || !(p.features & IORING_FEAT_EXT_ARG)) {
+                ERROR("Kernel cannot wait on futexes through io_uring.\n");
+                close(ring->fd);
+                free(ring);
+                errno = EOPNOTSUPP;
+                return NULL;
+        }
+
+        ring->self    = getpid();
+        ring->entries = p.sq_entries;
+
+        ring->sq_len   = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        ring->cq_len   = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+        ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+        ring->sq_map = mmap(NULL, ring->sq_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+        ring->cq_map = mmap(NULL, ring->cq_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        ring->sqes   = mmap(NULL, ring->sqes_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+
+        if (ring->sq_map == MAP_FAILED || ring->cq_map == MAP_FAILED || ring->sqes == MAP_FAILED) {
+                ERROR("(%d) Could not map io_uring.\n", errno);
+                msem_ring_close(ring);
+                return NULL;
+        }
+
+        ring->sq_head  = (unsigned *)((char *)ring->sq_map + p.sq_off.head);
+        ring->sq_tail  = (unsigned *)((char *)ring->sq_map + p.sq_off.tail);
+        ring->sq_mask  = (unsigned *)((char *)ring->sq_map + p.sq_off.ring_mask);
+        ring->sq_array = (unsigned *)((char *)ring->sq_map + p.sq_off.array);
+
+        ring->cq_head  = (unsigned *)((char *)ring->cq_map + p.cq_off.head);
+        ring->cq_tail  = (unsigned *)((char *)ring->cq_map + p.cq_off.tail);
+        ring->cq_mask  = (unsigned *)((char *)ring->cq_map + p.cq_off.ring_mask);
+        ring->cqes     = (struct io_uring_cqe *)((char *)ring->cq_map + p.cq_off.cqes);
+
+        return ring;
+}
+
+
+/**
+ * msem_ring_wait
+ * ``````````````
+ * Start waiting to lock a semaphore.
+ *
+ * @ring   : Ring.
+ * @semid  : Handle to lock (futex or local engine).
+ * @timeout: Milliseconds before the wait times out (<= 0 for none).
+ * @data   : Caller's pointer, returned with the event.
+ * Return  : -1 on error, else 0.
+ *
+ * NOTE
+ * If the semaphore can be locked at once, no wait is queued and
+ * the event is delivered by the next msem_ring_reap. Otherwise
+ * the wait is queued, and only reaches the kernel -- together
+ * with every other queued wait -- when the ring is next reaped.
+ */
+int msem_ring_wait(struct msem_ring *ring, int semid, int timeout, void *data)
+{
+        struct msem_ring_wait *w;
+        struct timespec rel;
+        struct msem_counter *c;
+        int32_t seen;
+
+        if ((c = msem_counter_of(semid)) == NULL) {
+                return -1;
+        }
+        if ((w = calloc(1, sizeof(struct msem_ring_wait))) == NULL) {
+                return -1;
+        }
+
+        w->c     = c;
+        w->gen   = __atomic_load_n(&c->gen, __ATOMIC_SEQ_CST);
+        w->semid = semid;
+        w->data  = data;
+        w->ms    = msem_expire(timeout);
+
+        if (msem_timeout(w->ms, &rel) != NULL) {
+                msem_deadline(&rel, &w->deadline);
+        }
+
+        if (!msem_counter_trylock(c, ring->self, &seen) && ring_arm(ring, w, seen) == -1) {
+                free(w);
+                return -1;
+        }
+
+        /* Live until finished. */
+        if ((w->next = ring->live) != NULL) {
+                ring->live->prev = w;
+        }
+        ring->live = w;
+
+        if (w->pending == 0) {
+                ring_finish(ring, w, 1, 0);
+        }
+
+        return 0;
+}
+
+
+/**
+ * msem_ring_reap
+ * ``````````````
+ * Submit queued waits, and collect finished ones.
+ *
+ * @ring   : Ring.
+ * @events : Array to fill with finished waits.
+ * @max    : Size of @events.
+ * @timeout: Milliseconds to wait for one to finish: -1 waits
+ *           indefinitely, 0 does not wait at all (as epoll_wait).
+ * Return  : Number of events, 0 if none finished in time, or -1
+ *           on error.
+ *
+ * NOTE
+ * In each event, result is 1 if the semaphore was locked (or
+ * relaxed, which leaves no token to unlock), 0 if the wait timed
+ * out, and -1 (with error set) if it failed.
+ */
+int msem_ring_reap(struct msem_ring *ring, struct msem_ring_event *events, int max, int timeout)
+{
+        struct timespec rel;
+        struct timespec deadline;
+        struct timespec left;
+        int n;
+
+        if (timeout > 0) {
+                msem_deadline(msem_timeout(timeout, &rel), &deadline);
+        }
+
+        for (;;) {
+                ring_reap_cqes(ring);
+
+                if ((n = ring_deliver(ring, events, max)) > 0 || timeout == 0) {
+                        /* Don't leave re-armed waits sitting in the queue. */
+                        if (ring->queued > 0) {
+                                ring_submit(ring, 0, NULL);
+                        }
+                        return n;
+                }
+
+                if (timeout > 0 && !msem_remaining(&deadline, &left)) {
+                        if (ring->queued > 0) {
+                                ring_submit(ring, 0, NULL);
+                        }
+                        return 0;
+                }
+
+                if (ring_submit(ring, 1, (timeout > 0) ? &left : NULL) == -1) {
+                        if (errno != ETIME && errno != EINTR) {
+                                return -1;
+                        }
+                }
+        }
+}
+
+
+/**
+ * msem_ring_close
+ * ```````````````
+ * Abandon every outstanding wait and destroy the ring.
+ *
+ * @ring : Ring.
+ * Return: Nothing.
+ */
+void msem_ring_close(struct msem_ring *ring)
+{
+        struct msem_ring_wait *w;
+        struct msem_ring_wait *next;
+
+        for (w = ring->live; w != NULL; w = next) {
+                next = w->next;
+                if (w->armed) {
+                        __atomic_sub_fetch(&w->c->gwait, 1, __ATOMIC_SEQ_CST);
+                        __atomic_sub_fetch(&w->c->nwait, 1, __ATOMIC_SEQ_CST);
+                }
+                free(w);
+        }
+        for (w = ring->ready; w != NULL; w = next) {
+                next = w->next;
+                free(w);
+        }
+
+        /*
+         * A delivered wait whose cancelled half never completed is
+         * on neither list, and is lost here (rare, and small).
+         */
+        if (ring->sqes != NULL && ring->sqes != MAP_FAILED) {
+                munmap(ring->sqes, ring->sqes_len);
+        }
+        if (ring->cq_map != NULL && ring->cq_map != MAP_FAILED) {
+                munmap(ring->cq_map, ring->cq_len);
+        }
+        if (ring->sq_map != NULL && ring->sq_map != MAP_FAILED) {
+                munmap(ring->sq_map, ring->sq_len);
+        }
+
+        close(ring->fd);
+        free(ring);
+}
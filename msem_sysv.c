@@ -0,0 +1,1399 @@
+//#define _JDL_NO_PRINT_LOCATION
+#define _GNU_SOURCE             /* semtimedop() */
+#define _JDL_NO_PRINT_DEBUG
+#define _JDL_NO_PRINT_WARN
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/ipc.h>
+#include <sys/sem.h>
+#include <sys/shm.h>
+#include <errno.h>
+#include <j/time.h>
+#include <j/file.h>
+#include <j/shell.h>
+#include <j/debug.h>
+#include "msem.h"
+#include "msem_engine.h"
+
+/*
+ * Each semaphore is a System V set of five members:
+ */
+
+        /* [0]: The actual semaphore value. */
+        #define SEMAPHORE 0
+        /* [1]: The generation, counting relaxes (modulo GEN_MAX). */
+        #define GENERATION 1
+        /* [2]: The gate for even generations. */
+        #define GATE_EVEN 2
+        /* [3]: The gate for odd generations. */
+        #define GATE_ODD 3
+        /* [4]: GEN_MAX-1 less the generation. */
+        #define COGENERATION 4
+
+/*
+ * [1] to [3] make relax a broadcast. A process waiting for the next
+ * relax reads the generation, then waits for that generation's gate
+ * to be 0. The current generation's gate is held at 1, and the other
+ * at 0. A relax is one semop() which drops the current gate to 0,
+ * which wakes everyone waiting on it, raises the other gate to 1,
+ * and moves on the generation (see msem_sysv_relax).
+ *
+ * [4] moves opposite to [1], so that a waiter can require in its
+ * semop() that the generation is still the one it read: the kernel
+ * can test a member against a lower bound, but not an upper one
+ * (see msem_sysv_next).
+ */
+
+/* Generations run from 0 to GEN_MAX-1 (even, so parity alternates). */
+#define GEN_MAX 32766
+
+#define GATE(gen) (((gen) % 2) ? GATE_ODD : GATE_EVEN)
+
+/*
+ * Beside the set, under the same key, is a small shared memory
+ * segment: the header. The header holds the ID of the set, so
+ * that an opener need never call semget(), and the kernel's
+ * count of the processes attached to the header is the count of
+ * processes using the semaphore.
+ *
+ * Attaching and detaching are single system calls that take no
+ * lock, so openers never wait for one another, and the kernel
+ * detaches a process which exits without closing, so no undo is
+ * needed to keep the count right.
+ */
+
+/* Number of semaphores in the semaphore set. */
+#define NSEMS 5
+
+/*
+ * The header.
+ *
+ * @ready: 0 until the creator has stored @semid, then 1 (futex, see
+ *         msem_ready_wait, which may take it over).
+ * @semid: ID of the semaphore set.
+ * @seq  : Sequence number, counting relaxes (see msem_sysv_next).
+ * @flags: MSEM_ flags given when the semaphore was created.
+ * @changes: Moved on at every operation (see msem_watch).
+ * @queue: Waiters, if the semaphore is ordered (MSEM_ORDERED).
+ * @holders: Holders, if the semaphore is robust (MSEM_ROBUST).
+ */
+struct msem_sysv_header {
+        uint32_t ready;
+        int32_t  semid;
+        uint64_t seq;
+        int32_t  flags;
+        struct msem_changes changes;
+        struct msem_queue queue;
+        struct msem_holders holders;
+};
+
+/*
+ * The private state of an open semaphore.
+ */
+struct msem_sysv {
+        int semid;
+        int shmid;
+        struct msem_sysv_header *hdr;
+};
+
+
+
+/******************************************************************************
+ * OPERATIONS
+ *
+ * System V's semop() will perform operations on arrays of 
+ * type struct sembuf, combining the sequence of operations 
+ * into atomic ones.
+ *
+ * In some of these operations, the flag SEM_UNDO is set, which
+ * causes the relevant operation to be undone in the event of
+ * the process abnormally terminating.
+ *
+ *      struct sembuf {
+ *              short sem_num   Semaphore number
+ *              short sem_op    Semaphore operation
+ *              short sem_flg   Operation flags
+ *      }
+ *
+ ******************************************************************************/
+
+/*
+ * SAFE SEMAPHORE OPERATION (WITH UNDO)
+ * 0. Decrement or increment SEMAPHORE by 99.
+ * NOTE
+ * This is a template. It is copied into a buffer on the
+ * caller's stack, where the 99 is set to the actual amount
+ * to add or subtract (positive or negative), so that any
+ * number of threads may operate at once.
+ */
+#define nops_sem 1
+static const struct sembuf op_sem[nops_sem] = {
+        {SEMAPHORE, 99, SEM_UNDO}
+};
+
+
+/*
+ * UNSAFE SEMAPHORE OPERATION (NO UNDO)
+ * 0. Decrement or increment SEMAPHORE by 99.
+ * NOTE
+ * This is a template; see op_sem above.
+ */
+#define nops_raw 1
+static const struct sembuf op_raw[nops_raw] = {
+        {SEMAPHORE, 99, 0}
+};
+
+
+/*
+ * PEEK (WAIT FOR TOKENS WITHOUT TAKING THEM)
+ * 0. Decrement SEMAPHORE by 99, waiting until it can.
+ * 1. Increment SEMAPHORE by 99 again.
+ * NOTE
+ * This is a template; see op_sem above. The caller counts
+ * as a waiter (semncnt) while it sleeps, but the pair leaves
+ * the value as it was.
+ */
+#define nops_peek 2
+static const struct sembuf op_peek[nops_peek] = {
+        {SEMAPHORE, -99, 0},
+        {SEMAPHORE,  99, 0}
+};
+
+
+/******************************************************************************
+ * SEMAPHORE CONTROL UNION 
+ *
+ * Filled in by semctl during certain calls, and while
+ * optional, should be provided each time. For more info
+ * about it, see man(3) semctl.
+ *
+ * Each caller declares its own, so that concurrent queries
+ * from different threads never share a buffer.
+ * 
+ ******************************************************************************/
+union semun {
+        int             val;     /* Semaphore value */
+        struct semid_ds *buf;    /* Semaphore status struct */
+        unsigned short  *array;  /* Used to set multiple semvals. */
+};
+
+
+
+/******************************************************************************
+ * UTILITY FUNCTIONS 
+ ******************************************************************************/
+
+/**
+ * msem_operation 
+ * ``````````````
+ * Wrap the System V semaphore function semtimedop().
+ *
+ * @semid  : Semaphore ID
+ * @sops   : Semaphore operation array
+ * @nsops  : Number of operations in @sops
+ * @timeout: Relative timeout, or NULL to wait indefinitely.
+ * Return  : -1 on error, else 0.
+ *
+ * NOTE
+ * This is intended to provide debugging assistance.
+ *
+ * A timed operation that is interrupted by a signal is restarted
+ * with whatever time remains before the original deadline, so the
+ * caller never needs a timer or a signal handler of its own. When
+ * the timeout expires, errno is EAGAIN.
+ */
+int msem_operation(int semid, struct sembuf *sops, size_t nsops, const struct timespec *timeout)
+{
+        struct timespec deadline;
+        struct timespec left;
+
+        if (timeout != NULL) {
+                msem_deadline(timeout, &deadline);
+                left = *timeout;
+        }
+
+        for (;;) {
+                if (semtimedop(semid, sops, nsops, (timeout) ? &left : NULL) == 0) {
+                        return 0;
+                }
+                if (errno != EINTR || timeout == NULL) {
+                        break;
+                }
+                if (!msem_remaining(&deadline, &left)) {
+                        errno = EAGAIN;
+                        break;
+                }
+                DEBUG("[%d] Interrupted, restarting with %ld.%09lds left\n", semid, (long)left.tv_sec, left.tv_nsec);
+        }
+        
+        switch (errno) {
+        case E2BIG: 
+                ERROR("[E2BIG] The value of nsops is greater than the system-imposed maximum\n");
+                break;
+        case EACCES:
+                ERROR("[EACCES] Permission is denied to the calling process\n");
+                break;
+        case EAGAIN:
+                if (timeout != NULL) {
+                        DEBUG("[%d] Operation timed out\n", semid);
+                } else {
+                        ERROR("[EAGAIN] Would suspend calling process but &IPC_NOWAIT is non-zero\n");
+                }
+                break;
+        case EFBIG:
+                ERROR("[EFBIG] sem_num is less than 0 or >= #semaphores in this set\n");
+                break;
+        case EIDRM:
+                ERROR("[EIDRM] Semaphore ID %d has been removed from system\n", semid);
+                break;
+        case EINTR:
+                ERROR("[EINTR] Operation was interrupted by a signal\n");
+                break;
+        case EINVAL:
+                ERROR("[EINVAL] Not a valid semaphore ID, or SEM_UNDO exceeds system limit\n");
+                break;
+        case ENOSPC:
+                ERROR("[ENOSPC] Limit on processes requiring SEM_UNDO would be exceeded\n");
+                break;
+        case ERANGE:
+                ERROR("[ERANGE] Operation would cause a semval or semadj to overflow\n");
+                break;
+        }
+
+        return -1;
+}
+
+
+/******************************************************************************
+ * ACCESSOR FUNCTIONS 
+ * 
+ * Retreive information about an operating semaphore.
+ * None of these functions require the caller to
+ * lock the semaphore being investigated.
+ *
+ ******************************************************************************/
+
+
+
+        
+/**
+ * msem_value
+ * ``````````
+ * Current value of the semaphore
+ *
+ * @semid: Semaphore ID.
+ * Return: Value, -1 on error
+ */
+int msem_value(int semid)
+{
+        union semun control;
+        register int semval;
+
+        control.val = 0;
+        if ((semval = semctl(semid, SEMAPHORE, GETVAL, control)) < 0) {
+                WARN("GETVAL failed.\n");
+                return -1;
+        }
+
+        return semval;
+}
+
+
+/**
+ * msem_pid
+ * ````````
+ * PID of the last process to modify the semaphore.
+ *
+ * @semid: Semaphore ID
+ * Return: PID value, -1 on error
+ */
+pid_t msem_pid(int semid)
+{
+        union semun control;
+        register pid_t sempid;
+
+        control.val = 0;
+        if ((sempid = semctl(semid, SEMAPHORE, GETPID, control)) == -1) {
+                WARN("GETPID failed.\n");
+                return -1;
+        }
+
+        return sempid;
+}
+
+
+/**
+ * msem_ncount
+ * ```````````
+ * # of processes waiting for semaphore value to be greater than current value
+ *
+ * @semid: Semaphore ID
+ * Return: Process count, -1 on error
+ */
+int msem_ncount(int semid)
+{
+        union semun control;
+        register int semncnt;
+
+        control.val = 0;
+        if ((semncnt = semctl(semid, SEMAPHORE, GETNCNT, control)) == -1) {
+                WARN("GETNCNT failed.\n");
+                return -1;
+        }
+
+        return semncnt;
+}
+
+
+/**
+ * msem_zcount
+ * ```````````
+ * # of processes waiting for semaphore value to be 0
+ *
+ * @semid: Semaphore ID.
+ * Return: Process count, -1 on error 
+ */
+int msem_zcount(int semid)
+{
+        union semun control;
+        register int semzcnt;
+
+        control.val = 0;
+        if ((semzcnt = semctl(semid, SEMAPHORE, GETZCNT, control)) == -1) {
+                WARN("GETZCNT failed.\n");
+                return -1;
+        }
+
+        return semzcnt;
+}
+
+
+/**
+ * msem_otime
+ * ``````````
+ * Time (sec. since UNIX epoch) of last semaphore operation
+ *
+ * @semid: Semaphore ID.
+ * Return: UNIX time, -1 on error 
+ */
+int msem_otime(int semid)
+{
+        struct semid_ds ds;
+        union semun control;
+
+        control.buf = &ds;
+
+        if ((semctl(semid, SEMAPHORE, IPC_STAT, control)) == -1) {
+                WARN("IPC_STAT failed.\n");
+                return -1;
+        }
+
+        return (int)ds.sem_otime;
+}
+
+
+/**
+ * msem_ctime
+ * ``````````
+ * Time (sec. since UNIX epoch) of last semaphore control operation
+ *
+ * @semid: Semaphore ID.
+ * Return: UNIX time, -1 on error 
+ */
+int msem_ctime(int semid)
+{
+        struct semid_ds ds;
+        union semun control;
+
+        control.buf = &ds;
+
+        if ((semctl(semid, SEMAPHORE, IPC_STAT, control)) < 0) {
+                WARN("IPC_STAT failed.\n");
+                return -1;
+        }
+
+        return (int)ds.sem_ctime;
+}
+
+
+
+int msem_sysv_query(int semid, char *query_code)
+{
+        char code = query_code[0];
+
+        switch (code) {
+        case 'v':
+                return msem_value(semid); 
+        case 'p':
+                return (int)msem_pid(semid);
+        case 'n':
+                return msem_ncount(semid);
+        case 'z':
+                return msem_zcount(semid);
+        case 'o':
+                return (int)msem_otime(semid);
+        case 'c':
+                return (int)msem_ctime(semid);
+        default:
+                WARN("Invalid query_code\n");
+                return -1;
+        }
+}
+
+
+/******************************************************************************
+ * FILE RECORD AND STATE HANDLING
+ ******************************************************************************/
+
+struct msem_data {
+        struct {
+                char tag;
+                key_t key;
+                int semid;
+        } row[CHAR_MAX];
+};
+
+
+
+/**
+ * msem_scan()
+ * ```````````
+ * Read the next record from a semaphore file.
+ *
+ * @file : Semaphore file, positioned at the next record.
+ * @tag  : Tag of the record (filled in).
+ * @key  : Key of the record (filled in).
+ * @semid: Semaphore ID of the record (filled in).
+ * Return: TRUE if a record was read, FALSE at end of file.
+ *
+ * NOTE
+ * The only state kept between calls is the position of @file,
+ * which belongs to the caller, so several files (or threads)
+ * may be scanned at once.
+ */
+bool msem_scan(FILE *file, char *tag, key_t *key, int *semid)
+{
+        return (fscanf(file, " %c %d %d", tag, key, semid) == 3);
+}
+
+/**
+ * msem_record()
+ * `````````````
+ * Write the semaphore ID to the file associated with it.
+ */
+int msem_record(char *path, char tag, key_t key, int id)
+{
+        FILE *file;
+        if ((file = fopen(path, "a+"))) {
+                fprintf(file, "%c %d %d\n", tag, key, id);
+        } else {
+                return -1;
+        }
+        fclose(file);
+        return 1;
+}
+
+
+
+/******************************************************************************
+ * LOW-LEVEL FUNCTIONS 
+ *
+ * msem_sysv_open
+ * msem_sysv_close
+ * msem_sysv_remove 
+ * msem_sysv_exists
+ *
+ ******************************************************************************/
+
+/**
+ * msem_sysv_init
+ * ``````````````
+ * Create the set behind a new header.
+ *
+ * @key  : Key of the semaphore.
+ * @hdr  : Header, just created by the caller.
+ * @init : Initial value of the semaphore.
+ * @flags: MSEM_ flags for the semaphore.
+ * Return: Semaphore set ID, or -1 on error.
+ *
+ * NOTE
+ * Only the creator of the header gets here, or the one opener who
+ * took over from a creator that died (see msem_ready_wait), so
+ * nothing else can be initializing the set at the same time. A set
+ * left by an older header (whose last user crashed), or by the dead
+ * creator, is reused.
+ */
+static int msem_sysv_init(key_t key, struct msem_sysv_header *hdr, int init, int flags)
+{
+        unsigned short values[NSEMS];
+        union semun control;
+        int id;
+
+        if ((id = semget(key, NSEMS, 0777|IPC_CREAT)) == -1) {
+                ERROR("(%d) Could not create semaphore set.\n", errno);
+                return -1;
+        }
+
+        values[SEMAPHORE]    = init;
+        values[GENERATION]   = 0;
+        values[GATE_EVEN]    = 1;
+        values[GATE_ODD]     = 0;
+        values[COGENERATION] = GEN_MAX - 1;
+
+        control.array = values;
+        if (semctl(id, 0, SETALL, control) == -1) {
+                ERROR("Failed to set initial value.\n");
+                return -1;
+        }
+
+        hdr->semid = id;
+        hdr->flags = flags;
+        msem_ready_set(&hdr->ready);
+
+        return id;
+}
+
+
+/**
+ * msem_sysv_open
+ * ``````````````
+ * Convert a semaphore (path,uid) tuple to an open semaphore.
+ *
+ * @path : Filesystem path to the semaphore.
+ * @tag  : Tag (character) indicating the region of the file at @path.
+ * @init : Initial value to set the semaphore if it is created.
+ * @excl : Fail with EEXIST if the semaphore already exists.
+ * @flags: MSEM_ flags for the semaphore if it is created.
+ * Return: Private state on success, NULL on error.
+ *
+ * NOTE
+ * Whoever creates the header creates the set; everyone else
+ * reads the set's ID from the header once it is ready, unless the
+ * creator dies first, when one of them creates it instead.
+ */
+struct msem_sysv *msem_sysv_open(char *path, char *tags, int init, bool excl, int flags)
+{
+        struct msem_sysv *sem;
+        bool created = true;
+        key_t key;
+        void *addr;
+        int shmid;
+        char tag;
+
+        tag = (char)*tags;
+
+        if ((key = msem_key(path, tag, true)) == -1) {
+                ERROR("Could not fetch key for file %s[%c]\n", path, tag);
+                return NULL;
+        }
+
+        if ((shmid = shmget(key, sizeof(struct msem_sysv_header), 0777|IPC_CREAT|IPC_EXCL)) == -1) {
+                if (errno != EEXIST || excl) {
+                        return NULL;
+                }
+                DEBUG("Semaphore already exists\n");
+                if ((shmid = shmget(key, sizeof(struct msem_sysv_header), 0777)) == -1) {
+                        ERROR("Still could not open semaphore\n");
+                        return NULL;
+                }
+                created = false;
+        }
+
+        if ((addr = shmat(shmid, NULL, 0)) == (void *)-1) {
+                ERROR("(%d) Could not attach header %d\n", errno, shmid);
+                return NULL;
+        }
+
+        if ((sem = malloc(sizeof(struct msem_sysv))) == NULL) {
+                shmdt(addr);
+                return NULL;
+        }
+
+        sem->shmid = shmid;
+        sem->hdr   = addr;
+
+        if (created) {
+                if ((sem->semid = msem_sysv_init(key, sem->hdr, init, flags)) == -1) {
+                        shmctl(shmid, IPC_RMID, NULL);
+                        goto fail;
+                }
+                DEBUG("Created new semaphore %s[%c] with value %d\n", path, tag, init);
+                msem_record(path, tag, key, sem->semid);
+        } else {
+                switch (msem_ready_wait(&sem->hdr->ready, shmid)) {
+                case -1:
+                        ERROR("Header %d was never initialized\n", shmid);
+                        errno = ETIMEDOUT;
+                        goto fail;
+                case 0:
+                        /* Its creator died first: finish the job. */
+                        if ((sem->semid = msem_sysv_init(key, sem->hdr, init, flags)) == -1) {
+                                shmctl(shmid, IPC_RMID, NULL);
+                                goto fail;
+                        }
+                        msem_record(path, tag, key, sem->semid);
+                        break;
+                default:
+                        sem->semid = sem->hdr->semid;
+                        break;
+                }
+        }
+
+        return sem;
+
+fail:
+        shmdt(addr);
+        free(sem);
+        return NULL;
+}
+
+
+/**
+ * msem_sysv_remove
+ * ````````````````
+ * Remove a semaphore and its header from shared memory.
+ *
+ * @sem  : Open semaphore.
+ * Return: TRUE on success, else -1.
+ */
+int msem_sysv_remove(struct msem_sysv *sem)
+{
+        union semun control;
+
+        shmctl(sem->shmid, IPC_RMID, NULL);
+
+        control.val = 0;
+        if (semctl(sem->semid, SEMAPHORE, IPC_RMID, control) == -1) {
+                WARN("Failed to remove semaphore.\n");
+                return -1;
+        }
+
+        return 1;
+} 
+
+
+/**
+ * msem_sysv_close
+ * ```````````````
+ * Close a semaphore, removing it if this was the last process
+ * using it.
+ *
+ * @sem  : Open semaphore (freed).
+ * Return: Number of processes still using it, or -1 on error.
+ *
+ * NOTE
+ * The header is detached first, and the count read after. When
+ * two processes close at once, both may see 0 and both remove
+ * the semaphore, which is harmless. A process opening it just
+ * as it is removed finds it gone at its first operation, and
+ * opens it again (see HANDLE CACHE in msem.c).
+ *
+ * That is two system calls, not one. The count has to be read
+ * after this process has gone: a count read at open is stale by
+ * now, and a count kept in the header would never see a process
+ * that was killed without closing, which the kernel detaches
+ * (and so drops from shm_nattch) itself.
+ */
+int msem_sysv_close(struct msem_sysv *sem)
+{
+        struct shmid_ds ds;
+        int r;
+
+        shmdt(sem->hdr);
+
+        if (shmctl(sem->shmid, IPC_STAT, &ds) == -1) {
+                /* Already removed. */
+                r = 0;
+        } else if ((r = (int)ds.shm_nattch) == 0) {
+                WARN("Last process using semaphore. Removing semaphore.\n");
+                msem_sysv_remove(sem);
+        }
+
+        free(sem);
+
+        return r;
+}
+
+/**
+ * msem_sysv_exists()
+ * ``````````````````
+ * @path : Filesystem path to the semaphore.
+ * @tag  : Tag (character) indicating the region of the file at @path.
+ * Return: TRUE if semaphore exists at @path:@tag, else FALSE
+ */
+int msem_sysv_exists(char *path, char *tags)
+{
+        key_t key;
+        int id;
+        char tag;
+
+        tag = (char)*tags;
+
+        if ((key = ftok(path, tag)) == -1) {
+                return false;
+        }
+        if ((id = semget(key, 0, 0777)) == -1) {
+                return false;
+        }
+        if (shell("ipcs -s | awk '{print $2}' | grep -q %d", id)) {
+                return false;
+        }
+        return true;
+}
+ 
+
+
+/******************************************************************************
+ * SEMAPHORE OPERATIONS 
+ ******************************************************************************/
+
+/**
+ * msem_semop_give
+ * ```````````````
+ * Add any number of tokens to a member of a set.
+ *
+ * @semid: Semaphore ID.
+ * @num  : Member number.
+ * @value: Tokens to add (> 0).
+ * @undo : Undo the change if the process exits.
+ * Return: Number of tokens given; fewer than @value on error
+ *         (errno ERANGE if the value cannot hold them all).
+ *
+ * NOTE
+ * A semaphore holds at most MSEM_SEMVMX, and an operation moves it
+ * by at most that much, however many processes are waiting. The
+ * kernel performs the locks of waiters as part of the operation
+ * that wakes them, though, so tokens given in pieces, each no more
+ * than the value has room for, are taken as they go, and any
+ * number of waiters can be served.
+ *
+ * The whole amount is tried first, so that an ordinary unlock
+ * costs one semop(). Tokens already given when it fails cannot be
+ * taken back, since waiters may have taken them, so the caller is
+ * told how many there were.
+ * With @undo, the kernel also limits the total a process has
+ * given (its semadj) to MSEM_SEMVMX.
+ */
+int msem_semop_give(int semid, unsigned short num, int value, bool undo)
+{
+        struct sembuf op;
+        union semun control;
+        bool measured = false;
+        int room = MSEM_SEMVMX;
+        int given = 0;
+        int semval;
+
+        op.sem_num = num;
+        op.sem_flg = (undo) ? SEM_UNDO : 0;
+
+        while (given < value) {
+                op.sem_op = (value - given < room) ? value - given : room;
+
+                if (semop(semid, &op, 1) == 0) {
+                        given   += op.sem_op;
+                        room     = MSEM_SEMVMX;
+                        measured = false;
+                        continue;
+                }
+                if (errno != ERANGE) {
+                        WARN("(%d) Semaphore operation failed.\n", errno);
+                        break;
+                }
+
+                /*
+                 * Only as many as there is room for. If there was
+                 * room already, it is the semadj that is full.
+                 */
+                control.val = 0;
+                if ((semval = semctl(semid, num, GETVAL, control)) == -1) {
+                        break;
+                }
+                if ((room = MSEM_SEMVMX - semval) <= 0 || (measured && room >= op.sem_op)) {
+                        DEBUG("[%d] No room for %d more tokens.\n", semid, value - given);
+                        errno = ERANGE;
+                        break;
+                }
+                measured = true;
+        }
+
+        if (given > 0 && given < value) {
+                WARN("[%d] Gave %d of %d tokens.\n", semid, given, value);
+        }
+
+        return given;
+}
+
+
+/**
+ * msem_set_once
+ * `````````````
+ * Alter a semaphore's value by some amount.
+ *
+ * @semid: Semaphore ID
+ * @value: Value to move semaphore.
+ * @ms   : Milliseconds before timeout.
+ * Return: -1 on error, return value of semop on success.
+ *
+ * NOTE
+ * If the value of @ms is <= 0, no timeout will be
+ * set. 
+ *
+ * Any number of tokens can be given (see msem_semop_give),
+ * but no more than MSEM_SEMVMX taken at once.
+ */
+int msem_set_once(int semid, int value, int ms)
+{
+        struct sembuf sops[nops_raw];
+        struct timespec timeout;
+        pid_t pid = 1;
+
+        memcpy(sops, op_raw, sizeof(sops));
+
+        /*
+         * No operation is defined for value 0, so
+         * we have to prevent this being argued.
+         */
+
+        if (value == 0) {
+                WARN("Semaphore operation value 0 not permitted.\n");
+                return -1;
+        }
+        if (value < -MSEM_SEMVMX) {
+                WARN("Cannot take %d tokens at once.\n", -value);
+                errno = ERANGE;
+                return -1;
+        }
+        if (value > 0) {
+                return (msem_semop_give(semid, SEMAPHORE, value, false) < value) ? -1 : pid;
+        }
+
+        sops[0].sem_op = value;
+
+        /*
+         * If the operation returns with EAGAIN and a timeout
+         * was given, the operation timed out.
+         */
+
+        if ((msem_operation(semid, &sops[0], nops_raw, msem_timeout(ms, &timeout))) == -1) {
+                if (errno == EAGAIN && ms > 0) {
+                        DEBUG("[%d] Timed out after %dms.\n", semid, ms);
+                        return -1;
+                } else {
+                        WARN("Semaphore operation failed.\n");
+                        return -1;
+                }
+        }
+
+        return pid;
+}
+
+
+/**
+ * msem_set_take
+ * `````````````
+ * Lower a semaphore's value, taking the tokens in the caller's
+ * own system call.
+ *
+ * @semid: Semaphore ID
+ * @value: Value to move semaphore (negative).
+ * @ms   : Milliseconds before timeout.
+ * Return: -1 on error, else 1.
+ *
+ * NOTE
+ * A blocked semop() is completed for the waiter by whoever wakes
+ * it, before it runs again, so a waiter killed in between has
+ * taken tokens without ever knowing. Robust semaphores (see
+ * msem_holders.c) must know, so they wait with op_peek, which
+ * changes nothing, and then take without waiting, in turn.
+ */
+int msem_set_take(int semid, int value, int ms)
+{
+        struct sembuf peek[nops_peek];
+        struct sembuf take = { SEMAPHORE, value, IPC_NOWAIT };
+        struct timespec timeout;
+        struct timespec deadline;
+        struct timespec *left = NULL;
+
+        if (value >= 0 || value < -MSEM_SEMVMX) {
+                WARN("Cannot take %d tokens.\n", -value);
+                errno = ERANGE;
+                return -1;
+        }
+
+        memcpy(peek, op_peek, sizeof(peek));
+
+        peek[0].sem_op = value;
+        peek[1].sem_op = -value;
+
+        if (msem_timeout(ms, &timeout) != NULL) {
+                msem_deadline(&timeout, &deadline);
+                left = &timeout;
+        }
+
+        for (;;) {
+                if (semop(semid, &take, 1) == 0) {
+                        return 1;
+                }
+                if (errno != EAGAIN) {
+                        WARN("(%d) Semaphore operation failed.\n", errno);
+                        return -1;
+                }
+                if (left != NULL && !msem_remaining(&deadline, left)) {
+                        DEBUG("[%d] Timed out after %dms.\n", semid, ms);
+                        errno = EAGAIN;
+                        return -1;
+                }
+                if (msem_operation(semid, peek, nops_peek, left) == -1) {
+                        return -1;
+                }
+        }
+}
+
+
+/**
+ * msem_set_safe
+ * `````````````
+ * Alter a semaphore's value by some amount.
+ *
+ * @semid: Semaphore ID
+ * @value: Value to move semaphore.
+ * Return: -1 on error, return value of semop on success.
+ *
+ * NOTE
+ * If the value of @ms is <= 0, no timeout will be
+ * set. 
+ *
+ * If the process dies while holding a semaphore, it will
+ * undo any semaphore tokens it decremented. 
+ *
+ * Any number of tokens can be given (see msem_semop_give),
+ * but no more than MSEM_SEMVMX taken at once.
+ */
+int msem_set_safe(int semid, int value, int ms)
+{
+        struct sembuf sops[nops_sem];
+        struct timespec timeout;
+        pid_t pid = 1;
+
+        memcpy(sops, op_sem, sizeof(sops));
+
+        /*
+         * No operation is defined for value 0, so
+         * we have to prevent this being argued.
+         */
+
+        if (value == 0) {
+                WARN("Semaphore operation value 0 not permitted.\n");
+                return -1;
+        }
+        if (value < -MSEM_SEMVMX) {
+                WARN("Cannot take %d tokens at once.\n", -value);
+                errno = ERANGE;
+                return -1;
+        }
+        if (value > 0) {
+                return (msem_semop_give(semid, SEMAPHORE, value, true) < value) ? -1 : pid;
+        }
+
+        sops[0].sem_op = value;
+
+        /*
+         * If the operation returns with EAGAIN and a timeout
+         * was given, the operation timed out.
+         */
+
+        if ((msem_operation(semid, &sops[0], nops_sem, msem_timeout(ms, &timeout))) == -1) {
+                if (errno == EAGAIN && ms > 0) {
+                        DEBUG("[%d] Timed out after %dms.\n", semid, ms);
+                        return -1;
+                } else {
+                        WARN("Semaphore operation failed.\n");
+                        return -1;
+                }
+        }
+
+        return pid;
+}
+
+
+
+
+
+
+
+/**
+ * msem_sysv_relax
+ * ```````````````
+ * Release every process waiting on a semaphore, in one operation.
+ *
+ * @sem  : Open semaphore.
+ * Return: -1 on error, else 1.
+ *
+ * NOTE
+ * Everyone waiting for the next relax (msem_sysv_next) is woken,
+ * and exactly those: the gate they wait on opens and the next one
+ * closes in the same semop(). Processes waiting to lock are given
+ * one token each, in the same semop(), as many as the kernel
+ * counted just before. Selectors (see msem_select) are not given
+ * tokens, but see the relax on the change word (see
+ * msem_changes_relax).
+ *
+ * The generation read beforehand is checked by the semop() itself:
+ * if another relax got in between, the current gate is already 0,
+ * the IPC_NOWAIT decrement fails, and the relax is tried again.
+ *
+ * The sequence number is moved on before the generation, so that
+ * a waiter woken by the generation always finds it moved.
+ *
+ * The same semop() gives only as many tokens as the value has room
+ * for (MSEM_SEMVMX); the rest follow at once (see msem_semop_give).
+ */
+int msem_sysv_relax(struct msem_sysv *sem)
+{
+        struct sembuf sops[5];
+        union semun control;
+        int semid = sem->semid;
+        int given;
+        int gen;
+        int val;
+        int now;
+        int n;
+
+        __atomic_add_fetch(&sem->hdr->seq, 1, __ATOMIC_SEQ_CST);
+
+        for (;;) {
+                control.val = 0;
+                if ((gen = semctl(semid, GENERATION, GETVAL, control)) == -1
+                 || (n = semctl(semid, SEMAPHORE, GETNCNT, control)) == -1
+                 || (val = semctl(semid, SEMAPHORE, GETVAL, control)) == -1) {
+                        WARN("Could not read semaphore.\n");
+                        return -1;
+                }
+                now = (n < MSEM_SEMVMX - val) ? n : MSEM_SEMVMX - val;
+                now = (now > 0) ? now : 0;
+
+                sops[0].sem_num = GATE(gen);
+                sops[0].sem_op  = -1;
+                sops[0].sem_flg = IPC_NOWAIT;
+
+                sops[1].sem_num = GATE(gen + 1);
+                sops[1].sem_op  = 1;
+                sops[1].sem_flg = IPC_NOWAIT;
+
+                sops[2].sem_num = GENERATION;
+                sops[2].sem_op  = (gen == GEN_MAX - 1) ? -(GEN_MAX - 1) : 1;
+                sops[2].sem_flg = IPC_NOWAIT;
+
+                sops[3].sem_num = COGENERATION;
+                sops[3].sem_op  = -sops[2].sem_op;
+                sops[3].sem_flg = IPC_NOWAIT;
+
+                sops[4].sem_num = SEMAPHORE;
+                sops[4].sem_op  = now;
+                sops[4].sem_flg = IPC_NOWAIT;
+
+                if (semop(semid, sops, (now > 0) ? 5 : 4) == 0) {
+                        if (n > now && (given = msem_semop_give(semid, SEMAPHORE, n - now, false)) < n - now) {
+                                WARN("(%d) Relax gave %d of %d tokens.\n", errno, now + given, n);
+                        }
+                        return 1;
+                }
+                if (errno != EAGAIN && errno != ERANGE) {
+                        WARN("(%d) Relax failed.\n", errno);
+                        return -1;
+                }
+                DEBUG("[%d] Generation moved during relax, retrying.\n", semid);
+        }
+}
+
+
+/**
+ * msem_sysv_seq
+ * `````````````
+ * @sem  : Open semaphore.
+ * Return: The semaphore's sequence number: how many times it has
+ *         been relaxed since it was created.
+ */
+static int64_t msem_sysv_seq(struct msem_sysv *sem)
+{
+        return (int64_t)__atomic_load_n(&sem->hdr->seq, __ATOMIC_SEQ_CST);
+}
+
+
+/**
+ * msem_sysv_next
+ * ``````````````
+ * Wait until the sequence number is no longer @after.
+ *
+ * @sem  : Open semaphore.
+ * @after: Sequence number the caller last saw.
+ * @ms   : Milliseconds before timeout.
+ * Return: The new sequence number, or -1 on error (errno EAGAIN
+ *         on timeout).
+ *
+ * NOTE
+ * The generation is read before the sequence number, and the
+ * semop() which waits on its gate first checks that it is still
+ * the generation read: GENERATION >= gen and COGENERATION >=
+ * GEN_MAX-1-gen, each taken and given back with IPC_NOWAIT. If a
+ * relax has moved it on, before the wait or during it, the semop()
+ * fails with EAGAIN and the sequence number is read again, so no
+ * relax falls between reading it and going to sleep.
+ */
+static int64_t msem_sysv_next(struct msem_sysv *sem, int64_t after, int ms)
+{
+        struct timespec timeout;
+        struct timespec deadline;
+        struct timespec left;
+        struct sembuf sops[5];
+        union semun control;
+        int64_t seq;
+        int gen;
+        int n;
+
+        if (msem_timeout(ms, &timeout) != NULL) {
+                msem_deadline(&timeout, &deadline);
+        }
+
+        for (;;) {
+                control.val = 0;
+                if ((gen = semctl(sem->semid, GENERATION, GETVAL, control)) == -1) {
+                        WARN("Could not read generation.\n");
+                        return -1;
+                }
+                if ((seq = msem_sysv_seq(sem)) != after) {
+                        return seq;
+                }
+                if (ms > 0 && !msem_remaining(&deadline, &left)) {
+                        DEBUG("[%d] Timed out after %dms.\n", sem->semid, ms);
+                        errno = EAGAIN;
+                        return -1;
+                }
+
+                n = 0;
+
+                /* An operation of 0 would wait for zero instead. */
+                if (gen > 0) {
+                        sops[n].sem_num = GENERATION;
+                        sops[n].sem_op  = -gen;
+                        sops[n].sem_flg = IPC_NOWAIT;
+                        n++;
+                        sops[n].sem_num = GENERATION;
+                        sops[n].sem_op  = gen;
+                        sops[n].sem_flg = 0;
+                        n++;
+                }
+                if (gen < GEN_MAX - 1) {
+                        sops[n].sem_num = COGENERATION;
+                        sops[n].sem_op  = -(GEN_MAX - 1 - gen);
+                        sops[n].sem_flg = IPC_NOWAIT;
+                        n++;
+                        sops[n].sem_num = COGENERATION;
+                        sops[n].sem_op  = GEN_MAX - 1 - gen;
+                        sops[n].sem_flg = 0;
+                        n++;
+                }
+
+                sops[n].sem_num = GATE(gen);
+                sops[n].sem_op  = 0;
+                sops[n].sem_flg = 0;
+                n++;
+
+                if (semtimedop(sem->semid, sops, n, (ms > 0) ? &left : NULL) == -1) {
+                        if (errno != EAGAIN && errno != EINTR) {
+                                WARN("(%d) Wait failed.\n", errno);
+                                return -1;
+                        }
+                        if (errno == EINTR && ms <= 0) {
+                                return -1;
+                        }
+                }
+        }
+}
+
+
+
+/******************************************************************************
+ * SYSTEM V ENGINE
+ *
+ * Adapts the functions above to the engine interface (see
+ * msem_engine.h).
+ *
+ ******************************************************************************/
+
+static void *sysv_open(char *path, char *tag, int init, bool excl, int flags)
+{
+        return msem_sysv_open(path, tag, init, excl, flags);
+}
+
+static int sysv_close(void *sem)
+{
+        return msem_sysv_close(sem);
+}
+
+static int sysv_remove(void *sem)
+{
+        return msem_sysv_remove(sem);
+}
+
+static bool sysv_exists(char *path, char *tag)
+{
+        return (bool)msem_sysv_exists(path, tag);
+}
+
+static int sysv_query(void *sem, char code)
+{
+        struct msem_sysv *s = sem;
+        char query_code[2] = { code, '\0' };
+        int r;
+
+        if (code == 'f') {
+                return (int)s->hdr->flags;
+        }
+        if (code == 'n') {
+                if ((r = msem_sysv_query(s->semid, query_code)) == -1) {
+                        return -1;
+                }
+                return r + msem_selectors(&s->hdr->changes);
+        }
+
+        return msem_sysv_query(s->semid, query_code);
+}
+
+/*
+ * A lock may be about to wait, which changes the waiter count, so
+ * monitors, if there are any, are told before as well as after. One
+ * told too soon reads the count again (see msem_watch); no semop()
+ * is spent finding out whether the lock will wait.
+ *
+ * A lock which completes across a relax is taken to be one of the
+ * waiters it released (MSEM_RELAXED): its token is one of those
+ * the relax gave, not one of its own.
+ */
+static int sysv_set(void *sem, int value, int ms, bool undo)
+{
+        struct msem_sysv *s = sem;
+        uint32_t relaxes;
+        int r;
+
+        relaxes = __atomic_load_n(&s->hdr->changes.relaxes, __ATOMIC_SEQ_CST);
+
+        if (value < 0 && __atomic_load_n(&s->hdr->changes.nwatch, __ATOMIC_SEQ_CST) > 0) {
+                msem_changed(&s->hdr->changes, 0);
+        }
+
+        if (undo) {
+                r = msem_set_safe(s->semid, value, ms);
+        } else if (value < 0 && (s->hdr->flags & MSEM_ROBUST)) {
+                r = msem_set_take(s->semid, value, ms);
+        } else {
+                r = msem_set_once(s->semid, value, ms);
+        }
+
+        msem_changed(&s->hdr->changes, 0);
+
+        if (r == -1) {
+                return -1;
+        }
+
+        return (value < 0 && __atomic_load_n(&s->hdr->changes.relaxes, __ATOMIC_SEQ_CST) != relaxes) ? MSEM_RELAXED : 1;
+}
+
+/*
+ * The relax is noted on the change word before it is made, so that
+ * a lock it completes finds it noted (see sysv_set).
+ */
+static int sysv_relax(void *sem)
+{
+        struct msem_sysv *s = sem;
+        int r;
+
+        msem_changes_relax(&s->hdr->changes, 0);
+
+        r = msem_sysv_relax(s);
+
+        msem_changed(&s->hdr->changes, 0);
+
+        return r;
+}
+
+static int sysv_trylock(void *sem, bool undo)
+{
+        struct msem_sysv *s = sem;
+        struct sembuf op = { SEMAPHORE, -1, IPC_NOWAIT };
+
+        if (undo) {
+                op.sem_flg |= SEM_UNDO;
+        }
+        if (semop(s->semid, &op, 1) == -1) {
+                if (errno == EAGAIN) {
+                        return 0;
+                }
+                WARN("(%d) Semaphore operation failed.\n", errno);
+                return -1;
+        }
+
+        msem_changed(&s->hdr->changes, 0);
+
+        return 1;
+}
+
+static int sysv_await(void *sem, int ms)
+{
+        return (msem_sysv_next(sem, msem_sysv_seq(sem), ms) == -1) ? -1 : 1;
+}
+
+static int64_t sysv_next(void *sem, int64_t after, int ms)
+{
+        return msem_sysv_next(sem, after, ms);
+}
+
+static struct msem_changes *sysv_changes(void *sem, int *flags)
+{
+        *flags = 0;
+
+        return &((struct msem_sysv *)sem)->hdr->changes;
+}
+
+static struct msem_queue *sysv_queue(void *sem, int *flags)
+{
+        *flags = 0;
+
+        return &((struct msem_sysv *)sem)->hdr->queue;
+}
+
+static struct msem_holders *sysv_holders(void *sem)
+{
+        return &((struct msem_sysv *)sem)->hdr->holders;
+}
+
+static int sysv_member(void *sem, unsigned short *num)
+{
+        *num = SEMAPHORE;
+
+        return ((struct msem_sysv *)sem)->semid;
+}
+
+const struct msem_engine msem_sysv_engine = {
+        .name   = "sysv",
+        .open   = sysv_open,
+        .close  = sysv_close,
+        .remove = sysv_remove,
+        .exists = sysv_exists,
+        .query  = sysv_query,
+        .set    = sysv_set,
+        .member = sysv_member,
+        .relax  = sysv_relax,
+        .await  = sysv_await,
+        .next   = sysv_next,
+        .changes = sysv_changes,
+        .trylock = sysv_trylock,
+        .queue  = sysv_queue,
+        .holders = sysv_holders
+};
@@ -0,0 +1,383 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include "msem.h"
+
+/******************************************************************************
+ * STRESS DRIVER
+ *
+ * Parks a great many waiters on one semaphore and has them all
+ * served, to show that nothing in the way openers, waiters or
+ * tokens are counted stops short of the numbers asked for.
+ *
+ *      msem-stress <engine> <waiters>
+ *
+ * The waiters are threads, STRESS_THREADS to a process, each
+ * process with its own opener. Every waiter locks two semaphores
+ * in turn:
+ *
+ *      gate    STRESS_TOKENS tokens each, released by one unlock
+ *              of them all, more than one semop(2) can carry
+ *              (SEMVMX) once there are 16384 waiters
+ *      crowd   released by one relax
+ *
+ * The driver waits until the kernel (or engine) counts them all
+ * as waiting ('n') before each release, and fails if any waiter is
+ * left unserved, or any token is left over.
+ *
+ * NOTE
+ * Each waiter is a task blocked in the kernel, so the real ceiling
+ * is the number of tasks the system allows: the smallest of
+ * kernel.pid_max, kernel.threads-max, RLIMIT_NPROC and the pids
+ * limit of the cgroup, less what is already running. The driver
+ * reports it and stops, rather than leave a run half parked.
+ *
+ ******************************************************************************/
+
+#define STRESS_PATH     "/tmp/msem-stress"
+#define STRESS_THREADS  1000
+#define STRESS_TOKENS   2
+#define STRESS_STACK    65536
+#define STRESS_WAIT_MS  600000
+#define STRESS_STALL_S  30
+
+struct stress {
+        int parked;     /* Waiters started           */
+        int spawned;    /* Processes done starting   */
+        int opened;     /* Processes which opened    */
+        int gate;       /* Waiters served by gate    */
+        int crowd;      /* Waiters served by crowd   */
+        int failed;     /* Locks which failed        */
+};
+
+static struct stress *stats;
+static int gate;
+static int crowd;
+
+
+
+/******************************************************************************
+ * LIMITS
+ ******************************************************************************/
+
+/**
+ * stress_sysctl
+ * `````````````
+ * Read a number from a file under /proc or /sys.
+ *
+ * @path : File.
+ * Return: The number, or -1 if there is none.
+ */
+static long stress_sysctl(const char *path)
+{
+        FILE *file;
+        long n;
+
+        if ((file = fopen(path, "r")) == NULL) {
+                return -1;
+        }
+        if (fscanf(file, "%ld", &n) != 1) {
+                n = -1;
+        }
+        fclose(file);
+
+        return n;
+}
+
+
+/**
+ * stress_ceiling
+ * ``````````````
+ * Find the most tasks this system lets one user have.
+ *
+ * @what : Filled in with the name of the limit.
+ * Return: The smallest limit on tasks, or -1 if none is known.
+ */
+static long stress_ceiling(const char **what)
+{
+        struct rlimit rl;
+        long min = -1;
+        long n;
+
+        static const char *files[] = {
+                "/proc/sys/kernel/pid_max",
+                "/proc/sys/kernel/threads-max",
+                "/sys/fs/cgroup/pids.max"
+        };
+        size_t i;
+
+        for (i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+                if ((n = stress_sysctl(files[i])) > 0 && (min == -1 || n < min)) {
+                        min   = n;
+                        *what = files[i];
+                }
+        }
+        if (getrlimit(RLIMIT_NPROC, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY) {
+                if (min == -1 || (long)rl.rlim_cur < min) {
+                        min   = (long)rl.rlim_cur;
+                        *what = "RLIMIT_NPROC";
+                }
+        }
+
+        return min;
+}
+
+
+
+/******************************************************************************
+ * WAITERS
+ ******************************************************************************/
+
+/**
+ * stress_waiter
+ * `````````````
+ * Lock the gate, then the crowd.
+ *
+ * @arg  : Unused.
+ * Return: NULL.
+ */
+static void *stress_waiter(void *arg)
+{
+        struct msem_op take = { gate, "-", STRESS_TOKENS, 0, 0 };
+
+        if (msem_batch(&take, 1, STRESS_WAIT_MS) != -1 && take.error == 0) {
+                __atomic_add_fetch(&stats->gate, 1, __ATOMIC_SEQ_CST);
+        } else {
+                __atomic_add_fetch(&stats->failed, 1, __ATOMIC_SEQ_CST);
+        }
+        if (msem(crowd, "-", STRESS_WAIT_MS)) {
+                __atomic_add_fetch(&stats->crowd, 1, __ATOMIC_SEQ_CST);
+        } else {
+                __atomic_add_fetch(&stats->failed, 1, __ATOMIC_SEQ_CST);
+        }
+
+        return NULL;
+}
+
+
+/**
+ * stress_process
+ * ``````````````
+ * Open both semaphores and start @n waiters on them.
+ *
+ * @n    : Waiters.
+ * Return: Nothing; exits.
+ */
+static void stress_process(int n)
+{
+        pthread_attr_t attr;
+        pthread_t *threads;
+        int started = 0;
+        int i;
+
+        gate  = msem_open(STRESS_PATH, "g", 0);
+        crowd = msem_open(STRESS_PATH, "c", 0);
+
+        if (gate == -1 || crowd == -1 || (threads = calloc(n, sizeof(pthread_t))) == NULL) {
+                __atomic_add_fetch(&stats->spawned, 1, __ATOMIC_SEQ_CST);
+                _exit(1);
+        }
+        __atomic_add_fetch(&stats->opened, 1, __ATOMIC_SEQ_CST);
+
+        pthread_attr_init(&attr);
+        pthread_attr_setstacksize(&attr, STRESS_STACK);
+
+        for (i = 0; i < n; i++) {
+                if (pthread_create(&threads[i], &attr, stress_waiter, NULL) != 0) {
+                        break;
+                }
+                started++;
+        }
+        __atomic_add_fetch(&stats->parked, started, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&stats->spawned, 1, __ATOMIC_SEQ_CST);
+
+        for (i = 0; i < started; i++) {
+                pthread_join(threads[i], NULL);
+        }
+
+        msem_close(gate);
+        msem_close(crowd);
+
+        _exit(0);
+}
+
+
+
+/******************************************************************************
+ * DRIVER
+ ******************************************************************************/
+
+/**
+ * stress_settle
+ * `````````````
+ * Wait until @semid counts @n waiters.
+ *
+ * @semid: Handle.
+ * @n    : Waiters.
+ * Return: true once it does, false if the count stalls.
+ */
+static bool stress_settle(int semid, int n)
+{
+        time_t moved = time(NULL);
+        int last = -1;
+        int now;
+
+        while ((now = msem_query(semid, "n")) != n) {
+                if (now != last) {
+                        last  = now;
+                        moved = time(NULL);
+                }
+                if (time(NULL) - moved > STRESS_STALL_S) {
+                        fprintf(stderr, "waiters stalled at %d of %d\n", now, n);
+                        return false;
+                }
+                usleep(10000);
+        }
+
+        return true;
+}
+
+
+/**
+ * stress_seconds
+ * ``````````````
+ * Seconds since @t0.
+ */
+static double stress_seconds(struct timespec *t0)
+{
+        struct timespec t1;
+
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+
+        return (t1.tv_sec - t0->tv_sec) + (t1.tv_nsec - t0->tv_nsec) / 1e9;
+}
+
+
+int main(int argc, char *argv[])
+{
+        struct msem_op give;
+        struct timespec t0;
+        const char *what = "no limit";
+        long ceiling;
+        int waiters;
+        int procs;
+        int ok = 1;
+        int n;
+        int i;
+
+        if (argc < 3 || (waiters = atoi(argv[2])) <= 0) {
+                fprintf(stderr, "usage: %s <engine> <waiters>\n", argv[0]);
+                return 2;
+        }
+        setenv("MSEM_ENGINE", argv[1], 1);
+
+        procs = (waiters + STRESS_THREADS - 1) / STRESS_THREADS;
+
+        if ((ceiling = stress_ceiling(&what)) != -1 && waiters + procs >= ceiling) {
+                fprintf(stderr, "%d waiters in %d processes need more tasks than "
+                                "%s allows (%ld); raise it to run at this scale\n",
+                                waiters, procs, what, ceiling);
+                return 2;
+        }
+
+        stats = mmap(NULL, sizeof(*stats), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (stats == MAP_FAILED) {
+                perror("mmap");
+                return 1;
+        }
+
+        fclose(fopen(STRESS_PATH, "a"));
+
+        if ((gate = msem_create(STRESS_PATH, "g", 0)) == -1
+         || (crowd = msem_create(STRESS_PATH, "c", 0)) == -1) {
+                fprintf(stderr, "cannot create the %s semaphores\n", argv[1]);
+                return 1;
+        }
+
+        printf("%s: %d waiters in %d processes\n", argv[1], waiters, procs);
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+
+        for (i = 0; i < procs; i++) {
+                n = (i < procs - 1) ? STRESS_THREADS : waiters - i * STRESS_THREADS;
+                switch (fork()) {
+                case -1:
+                        perror("fork");
+                        procs = i;
+                        break;
+                case 0:
+                        stress_process(n);
+                }
+        }
+        while (__atomic_load_n(&stats->spawned, __ATOMIC_SEQ_CST) < procs) {
+                usleep(10000);
+        }
+
+        n = __atomic_load_n(&stats->parked, __ATOMIC_SEQ_CST);
+        printf("  openers %d, waiters started %d (%.1fs)\n", stats->opened, n, stress_seconds(&t0));
+
+        if (n != waiters) {
+                ok = 0;
+        }
+
+        /* Everyone on the gate, then one unlock for them all. */
+        if (stress_settle(gate, n)) {
+                clock_gettime(CLOCK_MONOTONIC, &t0);
+
+                give.semid  = gate;
+                give.mode   = "+";
+                give.amount = n * STRESS_TOKENS;
+                if (msem_batch(&give, 1, 0) == -1 || give.error != 0) {
+                        fprintf(stderr, "unlock of %d failed (%d)\n", give.amount, give.error);
+                        ok = 0;
+                }
+
+                /* Everyone who got through is now on the crowd. */
+                if (stress_settle(crowd, n)) {
+                        printf("  gate:  %d served by one unlock, holding %d tokens (%.2fs)\n",
+                               stats->gate, give.amount - msem_query(gate, "v"), stress_seconds(&t0));
+
+                        clock_gettime(CLOCK_MONOTONIC, &t0);
+
+                        if (msem(crowd, "+*", 0) == -1) {
+                                fprintf(stderr, "relax failed (%d)\n", errno);
+                                ok = 0;
+                        }
+                } else {
+                        ok = 0;
+                }
+        } else {
+                ok = 0;
+        }
+
+        if (!ok) {
+                signal(SIGTERM, SIG_IGN);
+                kill(0, SIGTERM);
+        }
+        while (wait(NULL) > 0)
+                ;
+
+        if (ok) {
+                printf("  crowd: %d served by one relax (%.2fs)\n", stats->crowd, stress_seconds(&t0));
+        }
+
+        if (stats->gate != n || stats->crowd != n || stats->failed != 0
+         || msem_query(gate, "v") != 0 || msem_query(crowd, "v") != 0) {
+                ok = 0;
+        }
+        printf("%s: %s\n", argv[1], ok ? "ok" : "FAILED");
+
+        msem_remove(gate);
+        msem_remove(crowd);
+        msem_close(gate);
+        msem_close(crowd);
+
+        return ok ? 0 : 1;
+}